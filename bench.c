@@ -0,0 +1,605 @@
+// Microbenchmarks das estruturas internas do servidor.
+// Compila o server.c no mesmo arquivo (sem o main) para acessar as funções static.
+#define SERVER_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "server.c"
+
+#include <time.h>
+
+// xorshift: gerador simples e determinístico
+static uint64_t rng_state = 88172645463325252ull;
+static uint64_t rng(void){
+    rng_state ^= rng_state<<13;
+    rng_state ^= rng_state>>7;
+    rng_state ^= rng_state<<17;
+    return rng_state;
+}
+
+static void make_uid(char* out, uint64_t n){
+    snprintf(out, 11, "%010llu", (unsigned long long)(n % UID_LIMIT));
+}
+
+static void reset_tables(void){
+    free(su_uids); free(su_special); free(su_loc);
+    free(sl_uids); free(sl_loc); free(sl_loc_pos);
+    su_uids = su_special = sl_uids = NULL;
+    sl_loc = NULL;
+    su_loc = NULL;
+    sl_loc_pos = NULL;
+    su_count = sl_count = su_cap = sl_cap = 0;
+    free(su_index.slots);
+    free(sl_index.slots);
+    memset(&su_index, 0, sizeof(su_index));
+    memset(&sl_index, 0, sizeof(sl_index));
+    for (int l=0; l<=MAX_LOC; l++) loc_occ[l].count = 0;
+}
+
+// ----------------------------------------------------
+// Busca de usuários no SU (REQ_USRADD/REQ_USRACCESS/REQ_USRAUTH)
+static void bench_lookup(int n){
+    reset_tables();
+
+    uint64_t* uids = malloc((size_t)n*sizeof(*uids));
+    for (int i=0; i<n; i++) {
+        uids[i] = 1000000000ull + (uint64_t)i*7919;
+    }
+    double t0 = now_ns();
+    for (int i=0; i<n; i++) su_user_add(uids[i], i&1);
+    double t_ins = now_ns()-t0;
+
+    const int lookups = 2000000;
+    int* order = malloc(lookups*sizeof(int));
+    for (int i=0; i<lookups; i++) order[i] = (int)(rng() % n);
+
+    long found = 0;
+    t0 = now_ns();
+    for (int i=0; i<lookups; i++) found += (find_su_user(uids[order[i]])>=0);
+    double t_hit = now_ns()-t0;
+
+    // UIDs ausentes (faixa 9xxxxxxxxx nunca é inserida)
+    for (int i=0; i<n; i++) uids[i] += 8000000000ull;
+    long missed = 0;
+    t0 = now_ns();
+    for (int i=0; i<lookups; i++) missed += (find_su_user(uids[order[i]])<0);
+    double t_miss = now_ns()-t0;
+
+    printf("users=%-8d insert=%6.1f ns/op  hit=%6.1f ns/op  miss=%6.1f ns/op  (%ld/%ld ok)\n",
+           n, t_ins/n, t_hit/lookups, t_miss/lookups, found, missed);
+    free(order);
+    free(uids);
+}
+
+// ----------------------------------------------------
+// Codificação + decodificação de REQ_LOCREG no peer: texto x binário
+static void bench_peer_codec(void){
+    const int n = 2000000;
+    char uid[11], m[PEER_MSG_MAX];
+    size_t bytes[2] = {0, 0};
+    double ns[2];
+    long check = 0;
+    for (int bin=0; bin<2; bin++) {
+        double t0 = now_ns();
+        for (int i=0; i<n; i++) {
+            make_uid(uid, 2000000000ull + i);
+            uint64_t u = 0, du = 0;
+            uid_parse(uid, &u);
+            size_t len = enc_req_locreg(m, bin, u, 1+i%10, (uint32_t)i);
+            bytes[bin] += len;
+            int loc;
+            unsigned rid;
+            if (!bin) {
+                char duid[11];
+                m[len-1] = '\0';
+                sscanf(m+10, "%10s %d %u", duid, &loc, &rid);
+                uid_parse(duid, &du);
+            } else {
+                const uint8_t* f = (const uint8_t*)m+2;
+                du = get_u64(f+1);
+                loc = (int16_t)get_u16(f+9);
+                rid = get_u32(f+11);
+            }
+            check += loc + rid + du;
+        }
+        ns[bin] = now_ns()-t0;
+    }
+    // make_uid (snprintf) e o parse do UID do cliente entram nos dois lados; desconta
+    double t0 = now_ns();
+    for (int i=0; i<n; i++) {
+        uint64_t u = 0;
+        make_uid(uid, 2000000000ull + i);
+        uid_parse(uid, &u);
+        check += u;
+    }
+    double base = now_ns()-t0;
+    printf("peer REQ_LOCREG  text=%6.1f ns/msg %4.1f B/msg  binary=%6.1f ns/msg %4.1f B/msg  (%ld)\n",
+           (ns[0]-base)/n, (double)bytes[0]/n, (ns[1]-base)/n, (double)bytes[1]/n, check&1);
+}
+
+// ----------------------------------------------------
+// Reconhecimento das linhas de cliente: a cadeia de strncmp + strtok_r de
+// antes (com stat_kind e cmd_owner, que também olhavam a linha) x cmd_parse
+static int old_stat_kind(const char* line){
+    static const struct { const char* cmd; int kind; } k[] = {
+        { "REQ_USRACCESS ", ST_USRACCESS }, { "REQ_USRLOC ", ST_USRLOC },
+        { "REQ_LOCLIST ", ST_LOCLIST },     { "REQ_USRADD ", ST_USRADD },
+        { "REQ_CONN(", ST_CONN },           { "REQ_DISC(", ST_DISC },
+        { "REQ_STATS", ST_STATS },
+    };
+    for (size_t i=0; i<sizeof(k)/sizeof(k[0]); i++) {
+        if (strncmp(line, k[i].cmd, strlen(k[i].cmd))==0) return k[i].kind;
+    }
+    return ST_OTHER;
+}
+static long old_parse(char* line, int su){
+    long r = old_stat_kind(line);
+    const char* p = strchr(line, ' ');
+    uint64_t u = 0;
+    if (p && uid_scan(p+1, &u)==0 && (p[11]=='\0' || p[11]==' ')) r += u & 7;
+    if (strncmp(line,"REQ_CONN(",9)==0) return r + atoi(line+9);
+    if (strncmp(line,"REQ_DISC(",9)==0) return r + 1;
+    if (strcmp(line,"REQ_STATS")==0) return r + 2;
+    char* saveptr;
+    if (su) {
+        if (strncmp(line,"REQ_USRADD ",11)==0) {
+            char* uid = strtok_r(line+11," ",&saveptr);
+            char* spec = strtok_r(NULL," ",&saveptr);
+            if (!uid || uid_parse(uid, &u)<0 || !spec) return r;
+            return r + (u & 7) + (atoi(spec)!=0);
+        }
+        else if (strncmp(line,"REQ_USRACCESS ",14)==0) {
+            char* uid = strtok_r(line+14," ",&saveptr);
+            char* dir = strtok_r(NULL," ",&saveptr);
+            char* opt = strtok_r(NULL," ",&saveptr);
+            if (!uid || uid_parse(uid, &u)<0 || !dir) return r;
+            return r + (u & 7) + (strcmp(dir,"in")==0) + (opt && strcmp(opt,"seq")==0);
+        }
+    } else {
+        if (strncmp(line,"REQ_USRLOC ",11)==0) {
+            if (uid_scan(line+11, &u)<0 || (line[21]!='\0' && line[21]!=' ')) return r;
+            return r + (u & 7) + (line[21]==' ' ? (long)strtoull(line+22, NULL, 10) : 0);
+        }
+        else if (strncmp(line,"REQ_LOCLIST ",12)==0) {
+            char* uid = strtok_r(line+12," ",&saveptr);
+            char* sLoc = strtok_r(NULL," ",&saveptr);
+            if (!uid || uid_parse(uid, &u)<0 || !sLoc) return r;
+            return r + (u & 7) + atoi(sLoc);
+        }
+    }
+    return r - 1;
+}
+static long new_parse(char* line, int su){
+    Cmd c;
+    cmd_parse(line, &c);
+    long r = cmd_stat[c.op] + (c.has_uid ? (long)(c.uid & 7) : 0) + c.flag + c.want_seq + c.num + (long)c.seq;
+    return r + (cmd_fns[su][c.op]!=NULL);
+}
+
+static void bench_parse(void){
+    const int n = 1<<16, reps = 30;
+    // mistura do loadgen: acessos, consultas e inspects, alguns cadastros
+    static const char* fmt[] = {
+        "REQ_USRACCESS %s in", "REQ_USRACCESS %s out", "REQ_USRLOC %s", "REQ_LOCLIST %s 7",
+        "REQ_USRACCESS %s in", "REQ_USRLOC %s", "REQ_USRADD %s 0", "REQ_STATS",
+    };
+    static const int su[] = { 1, 1, 0, 0, 1, 0, 1, 0 };   // papel que trata cada uma
+    char (*lines)[64] = malloc((size_t)n*64);
+    char buf[64];
+    for (int i=0; i<n; i++) {
+        char uid[11];
+        make_uid(uid, rng());
+        snprintf(lines[i], 64, fmt[i%8], uid);
+    }
+    kw_init();
+    long check[2] = {0, 0};
+    double ns[2];
+    for (int v=0; v<2; v++) {
+        double t0 = now_ns();
+        for (int r=0; r<reps; r++) {
+            for (int i=0; i<n; i++) {
+                // o servidor recebe a linha num buffer que pode mudar (strtok_r)
+                memcpy(buf, lines[i], 64);
+                check[v] += v ? new_parse(buf, su[i%8]) : old_parse(buf, su[i%8]);
+            }
+        }
+        ns[v] = now_ns()-t0;
+    }
+    free(lines);
+    double total = (double)n*reps;
+    printf("parse client line  strncmp chain=%6.1f ns/cmd (%5.1f M/s)  table=%6.1f ns/cmd (%5.1f M/s)  (%ld/%ld)\n",
+           ns[0]/total, total/ns[0]*1e3, ns[1]/total, total/ns[1]*1e3, check[0]&1, check[1]&1);
+}
+
+// ----------------------------------------------------
+// REQ_USRIMPORT: o lote aplicado de uma vez (tabelas reservadas no tamanho
+// final) x um REQ_USRADD por usuário (busca + inserção, crescendo aos poucos)
+static void bench_import(int n){
+    uint64_t* e = malloc((size_t)n*sizeof(uint64_t));
+    for (int i=0; i<n; i++) e[i] = (1000000000ull + (uint64_t)i*7919)<<1 | (i%10==0);
+    reset_tables();
+    double t0 = now_ns();
+    for (int i=0; i<n; i++) {
+        uint64_t u = e[i]>>1;
+        int idx = find_su_user(u);
+        if (idx>=0) su_set_special(idx, (int)(e[i]&1));
+        else su_user_add(u, (int)(e[i]&1));
+    }
+    double t_add = now_ns()-t0;
+    reset_tables();
+    ImportCount c = {0};
+    t0 = now_ns();
+    su_import_apply(e, n, &c);
+    double t_imp = now_ns()-t0;
+    free(e);
+    printf("import users=%-8d one by one=%6.1f ns/user  batch=%6.1f ns/user  (%d added)\n",
+           n, t_add/n, t_imp/n, c.added);
+}
+
+// ----------------------------------------------------
+// Persistência: WAL com group commit e partida a partir do snapshot
+static void bench_persist(int n){
+    char dir[] = "/tmp/bench-persistXXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return;
+    }
+    data_dir = dir;
+    is_su = 1;
+    reset_tables();
+    persist_open();
+
+    // 100 mudanças por fsync, como numa iteração cheia do loop
+    const int wal_n = 20000;
+    double t0 = now_ns();
+    for (int i=0; i<wal_n; i++) {
+        wal_log(5000000000ull + i, i&1);
+        if (i%100==99) wal_commit();
+    }
+    wal_commit();
+    double t_wal = now_ns()-t0;
+
+    for (int i=0; i<n; i++) su_user_add(1000000000ull + (uint64_t)i*7919, i&1);
+    t0 = now_ns();
+    snapshot_write();
+    double t_snap = now_ns()-t0;
+
+    reset_tables();
+    close(wal_fd);
+    t0 = now_ns();
+    persist_open();
+    double t_load = now_ns()-t0;
+
+    printf("persist users=%-8d wal=%6.1f us/op (100/fsync)  snapshot=%7.1f ms  restart=%7.1f ms  (%d)\n",
+           n, t_wal/wal_n/1e3, t_snap/1e6, t_load/1e6, su_count);
+
+    char path[PATH_MAX];
+    persist_path(path, sizeof(path), 0, "snap");
+    unlink(path);
+    persist_path(path, sizeof(path), 0, "wal");
+    unlink(path);
+    rmdir(dir);
+    close(wal_fd);
+    wal_fd = -1;
+    data_dir = NULL;
+}
+
+// ----------------------------------------------------
+// Réplica de leitura: estado inicial (dump no primário, aplicação na réplica)
+// e o fluxo de mudanças ao vivo (numerar + aplicar)
+static void bench_repl(int n){
+    is_su = 0;
+    reset_tables();
+    for (int i=0; i<n; i++) sl_record_add(1000000000ull + (uint64_t)i*7919, 1+i%10);
+
+    TxBuf dump = {0};
+    double t0 = now_ns();
+    repl_dump(&dump);
+    double t_dump = now_ns()-t0;
+
+    // a réplica recebe o mesmo texto, linha a linha
+    size_t bytes = tx_pending(&dump);
+    t0 = now_ns();
+    sl_clear();
+    char* p = dump.data;
+    char* end = dump.data+bytes;
+    while (p<end) {
+        char* nl = memchr(p, '\n', end-p);
+        *nl = '\0';
+        repl_line(p);
+        p = nl+1;
+    }
+    double t_apply = now_ns()-t0;
+    tx_free(&dump);
+
+    // ao vivo: uma réplica "conectada" só acumula na fila
+    for (int i=1; i<MAX_REPLICAS; i++) replicas[i].sock = -1;
+    replicas[0].sock = 0;
+    repl_count = 1;
+    const int live = 1000000;
+    t0 = now_ns();
+    for (int i=0; i<live; i++) repl_log(1000000000ull + (uint64_t)(i%n)*7919, 1+i%7);
+    double t_log = now_ns()-t0;
+    TxBuf* tx = &replicas[0].tx;
+    size_t live_bytes = tx_pending(tx);
+    t0 = now_ns();
+    p = tx->data+tx->off;
+    end = p+live_bytes;
+    while (p<end) {
+        char* nl = memchr(p, '\n', end-p);
+        *nl = '\0';
+        repl_line(p);
+        p = nl+1;
+    }
+    double t_live = now_ns()-t0;
+    tx_free(tx);
+    replicas[0].sock = -1;
+    repl_count = 0;
+
+    printf("repl records=%-8d dump=%5.1f ns/rec  apply=%6.1f ns/rec (%4.1f B/rec)  live log=%5.1f ns/op apply=%6.1f ns/op  (%d)\n",
+           n, t_dump/n, t_apply/n, (double)bytes/n, t_log/live, t_live/live, sl_count);
+}
+
+// ----------------------------------------------------
+// Cache de autorização do SL: custo do acerto e taxa de acerto com n
+// usuários fazendo inspect (mapeamento direto de AUTH_CACHE entradas)
+static void bench_auth_cache(int n){
+    int g = atomic_load(&auth_cache_gen)+1;
+    atomic_store(&auth_cache_gen, g);
+    auth_cache_reset(g);
+    const int lookups = 2000000;
+    uint64_t* uids = malloc((size_t)lookups*sizeof(*uids));
+    for (int i=0; i<lookups; i++) uids[i] = 1000000000ull + (rng() % n)*7919;
+
+    long hits = 0;
+    double t0 = now_ns();
+    for (int i=0; i<lookups; i++) {
+        int spec = auth_cache_get(uids[i]);
+        if (spec>=0) hits++;
+        else auth_cache_put(uids[i], i&1);   // a resposta do SU chegou
+    }
+    double t = now_ns()-t0;
+    printf("auth cache users=%-8d %5.1f ns/op  hit=%5.1f%%\n", n, t/lookups, 100.0*hits/lookups);
+    free(uids);
+}
+
+// ----------------------------------------------------
+// Painel de ocupação: um REQ_LOCCOUNT x um REQ_LOCLIST por local (sem
+// contar a ida ao SU), e o custo de cada movimento com as contagens
+static void bench_loccount(int n){
+    reset_tables();
+    for (int i=0; i<n; i++) sl_record_add(1000000000ull + (uint64_t)i*7919, 1 + i%MAX_LOC);
+    const int moves = 2000000;
+    double t0 = now_ns();
+    for (int i=0; i<moves; i++) sl_set_location((int)(rng() % n), 1 + (int)(rng() % MAX_LOC));
+    double t_move = now_ns()-t0;
+
+    const int refresh = 200;
+    TxBuf tx = {0};
+    t0 = now_ns();
+    for (int r=0; r<refresh; r++) {
+        for (int l=1; l<=MAX_LOC; l++) {
+            tx.off = tx.len = 0;
+            loc_append_uids(&tx, l);
+        }
+    }
+    double t_list = now_ns()-t0;
+    char out[LOCCOUNT_MAX];
+    size_t len = 0;
+    t0 = now_ns();
+    for (int r=0; r<refresh; r++) len += loccount_reply(out);
+    double t_count = now_ns()-t0;
+    tx_free(&tx);
+    printf("occupancy users=%-8d move %5.1f ns  refresh: LOCLIST x%d %9.1f us  LOCCOUNT %6.2f us (%zu B)\n",
+           n, t_move/moves, MAX_LOC, t_list/refresh/1000, t_count/refresh/1000, len/refresh);
+}
+
+// ----------------------------------------------------
+// Assinaturas: custo de cada mudança sem ninguém assinando, com um
+// assinante que lê em dia (EVT_LOC direto na saída) e com um assinante
+// lento (fila com um evento por UID) para users UIDs distintos se mexendo
+static void bench_subscribe(int users){
+    const int moves = 2000000;
+    int8_t* loc = calloc(users, 1);
+    uint64_t* ev = malloc((size_t)moves*sizeof(*ev));
+    for (int i=0; i<moves; i++) ev[i] = rng();
+    clients_cap = 8;
+    clients = calloc(clients_cap, sizeof(Client));
+    clients[5].in_use = 1;
+    clients[5].id = 77;
+    SubTarget t = { 0, 5, 77 };
+    double res[3];
+    for (int mode=0; mode<3; mode++) {
+        if (mode==1) sub_add(&sub_loc[3], &t);
+        memset(&wstats, 0, sizeof(wstats));
+        double t0 = now_ns();
+        for (int i=0; i<moves; i++) {
+            int u = (int)(ev[i] % users);
+            int to = 1 + (int)(ev[i]>>32) % 5;   // 1..5: um quinto das mudanças passa pelo 3
+            if (to==loc[u]) to = -1;
+            sub_notify(1000000000ull + (uint64_t)u*7919, loc[u] ? loc[u] : -1, to);
+            loc[u] = to>0 ? to : 0;
+            if (mode==1 && tx_pending(&clients[5].tx)>=SUB_TX_MAX/2) clients[5].tx.off = clients[5].tx.len = 0;
+            if (mode==2 && tx_pending(&clients[5].tx)<SUB_TX_MAX) tx_append(&clients[5].tx, ev, SUB_TX_MAX);
+        }
+        res[mode] = (now_ns()-t0)/moves;
+    }
+    printf("subscribe users=%-8d per move: none %5.1f ns  reader %5.1f ns  slow %5.1f ns (merged %llu, lost %llu)\n",
+           users, res[0], res[1], res[2], (unsigned long long)wstats.evt_merged, (unsigned long long)wstats.evt_lost);
+    sub_del(&sub_loc[3], &t);
+    sub_queue_free(clients[5].subq);
+    tx_free(&clients[5].tx);
+    free(clients);
+    clients = NULL;
+    clients_cap = 0;
+    free(loc);
+    free(ev);
+}
+
+// ----------------------------------------------------
+// Histórico: custo de cada transição guardada, bytes por transição nos
+// blocos selados (contra 24 B de ts+uid+de+para crus), um REQ_LOCHIST de
+// um shard até o limite de respostas e quantos blocos o índice deixa um
+// REQ_USRHIST pular para um UID que se mexeu uma vez
+static void bench_history(int users){
+    const int moves = 2000000;
+    int8_t* loc = calloc(users, 1);
+    double t0 = now_ns();
+    for (int i=0; i<moves; i++) {
+        uint64_t r = rng();
+        int u = (int)(r % users);
+        int to = 1 + (int)(r>>32) % 10;   // os locais 1..10 do cliente
+        if (to==loc[u]) to = -1;
+        hist_append(1000000000ull + (uint64_t)u*7919, loc[u] ? loc[u] : -1, to);
+        loc[u] = to>0 ? to : 0;
+    }
+    double t_append = (now_ns()-t0)/moves;
+    int64_t sealed = hist_events - hist_cur.count;
+
+    TxBuf out = {0};
+    t0 = now_ns();
+    hist_entered(&out, 3, 0, INT64_MAX);
+    double t_loc = now_ns()-t0;
+    size_t hits = tx_pending(&out)/sizeof(HistHit);
+
+    uint64_t rare = 9999999999ull;   // fora da faixa dos outros: cai no Bloom
+    hist_append(rare, -1, 3);
+    int scanned = 0;
+    t0 = now_ns();
+    for (int k=0; k<=hist_nblocks; k++)
+        if (hb_may_have(hist_block(k), rare)) scanned++;
+    double t_usr = now_ns()-t0;
+    printf("history users=%-8d append %5.1f ns  sealed %4.1f B/transition (raw 24)  LOCHIST %zu hits %6.2f ms  USRHIST index %d/%d blocks %5.1f us\n",
+           users, t_append, sealed ? (double)hist_bytes/sealed : 0.0, hits, t_loc/1e6,
+           scanned, hist_nblocks+1, t_usr/1000);
+
+    tx_free(&out);
+    while (hist_nblocks) hist_drop_oldest();
+    free(hist_cur.data);
+    free(hist_cur.bloom);
+    memset(&hist_cur, 0, sizeof(hist_cur));
+    hist_first = hist_events = hist_horizon = hist_last = 0;
+    free(loc);
+}
+
+// ----------------------------------------------------
+// Log do "< linha" de cada comando: write() direto x anel + thread de log.
+// Mede o custo no worker; o destino é o /dev/null nos dois casos.
+static void bench_log(void){
+    const int n = 1000000;
+    const char* line = "REQ_USRACCESS 2021000001 in";
+    log_fd = open("/dev/null", O_WRONLY);
+    double t0 = now_ns();
+    for (int i=0; i<n; i++) log_trace_cmd(line);
+    double t_sync = now_ns()-t0;
+
+    log_start();
+    long lines = 0;
+    t0 = now_ns();
+    for (int i=0; i<n; i++) {
+        log_trace_cmd(line);
+        lines++;
+        // no ritmo de um loop ocupado: a thread de log acompanha
+        if (i%1000==999) sched_yield();
+    }
+    double t_async = now_ns()-t0;
+    log_shutdown();
+    close(log_fd);
+    log_fd = STDOUT_FILENO;
+    printf("log trace line  write()=%6.1f ns/line  ring=%6.1f ns/line  (%ld, %lu dropped)\n",
+           t_sync/n, t_async/n, lines, atomic_load(&log_dropped));
+}
+
+// ----------------------------------------------------
+// Memória por usuário: layout atual x o antigo (registro com char uid[11],
+// índice com o UID em texto no slot), com as mesmas capacidades
+typedef struct { char uid[11]; int is_special; } OldSU;
+typedef struct { char uid[11]; int location; int loc_pos; } OldSL;
+typedef struct { char uid[11]; int32_t idx; } OldSlot;
+
+static void bench_memory(int n){
+    reset_tables();
+    for (int i=0; i<n; i++) {
+        uint64_t u = 1000000000ull + (uint64_t)i*7919;
+        su_user_add(u, (i%10)==0);
+        sl_record_add(u, 1+i%10);
+    }
+    double su_new = su_cap*(sizeof(uint64_t)+sizeof(int16_t)) + su_cap/8 + (double)su_index.cap*sizeof(uint64_t);
+    double su_old = su_cap*sizeof(OldSU) + (double)su_index.cap*sizeof(OldSlot);
+    // ocupantes (int por registro) iguais nos dois
+    double sl_new = sl_cap*(sizeof(uint64_t)+1+sizeof(int32_t)) + (double)sl_index.cap*sizeof(uint64_t) + n*sizeof(int);
+    double sl_old = sl_cap*sizeof(OldSL) + (double)sl_index.cap*sizeof(OldSlot) + n*sizeof(int);
+
+    // Varredura de is_special: bitset x campo no registro antigo
+    OldSU* old = malloc((size_t)n*sizeof(OldSU));
+    for (int i=0; i<n; i++) {
+        make_uid(old[i].uid, su_uids[i]);
+        old[i].is_special = su_is_special(i);
+    }
+    const int reps = 20;
+    long c_new = 0, c_old = 0;
+    double t0 = now_ns();
+    for (int r=0; r<reps; r++) {
+        for (int w=0; w<(n+63)/64; w++) c_new += __builtin_popcountll(su_special[w]);
+    }
+    double t_new = now_ns()-t0;
+    t0 = now_ns();
+    for (int r=0; r<reps; r++) {
+        for (int i=0; i<n; i++) c_old += old[i].is_special;
+    }
+    double t_old = now_ns()-t0;
+    free(old);
+
+    printf("memory users=%-8d SU %5.1f -> %5.1f B/user  SL %5.1f -> %5.1f B/user  special scan %6.3f -> %6.3f ns/user (%ld/%ld)\n",
+           n, su_old/n, su_new/n, sl_old/n, sl_new/n, t_old/reps/n, t_new/reps/n, c_old/reps, c_new/reps);
+}
+
+int main(int argc, char* argv[]){
+    const char* which = argc>1 ? argv[1] : "all";
+    if (strcmp(which,"all")==0 || strcmp(which,"lookup")==0) {
+        bench_lookup(1000);
+        bench_lookup(100000);
+        bench_lookup(1000000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"peer")==0) {
+        bench_peer_codec();
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"parse")==0) {
+        bench_parse();
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"memory")==0) {
+        bench_memory(100000);
+        bench_memory(1000000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"import")==0) {
+        bench_import(100000);
+        bench_import(1000000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"auth")==0) {
+        bench_auth_cache(1000);
+        bench_auth_cache(50000);
+        bench_auth_cache(1000000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"repl")==0) {
+        bench_repl(100000);
+        bench_repl(1000000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"occupancy")==0) {
+        bench_loccount(10000);
+        bench_loccount(1000000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"subscribe")==0) {
+        bench_subscribe(500);
+        bench_subscribe(100000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"history")==0) {
+        bench_history(500);
+        bench_history(100000);
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"log")==0) {
+        bench_log();
+    }
+    if (strcmp(which,"all")==0 || strcmp(which,"persist")==0) {
+        bench_persist(1000000);
+        bench_persist(4000000);
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Ordem das respostas numa conexão (make check): o lote do cliente (-f) mistura
+# comandos que o servidor responde na hora (add, find, count) com os que
+# esperam o outro servidor (in espera o SL, inspect espera o REQ_USRAUTH do SU).
+# Cada resposta tem de ser a do seu comando, com um worker e com vários.
+# o papel vem da porta: 50000 é o SU, 60000 o SL
+PEER=${PEER:-41990}
+SU=50000
+SL=60000
+N=${N:-500}
+batch=$(mktemp)
+out=$(mktemp)
+trap 'rm -f "$batch" "$out"' EXIT
+
+# S é especial; A_i entra no local 2 entre os add de B_i
+awk -v n="$N" 'BEGIN {
+    print "add 8999999999 1"
+    for (i=0; i<n; i++) {
+        printf "add 80%08d 0\n", i
+        printf "in 80%08d\n", i
+        printf "add 81%08d 0\n", i
+    }
+    for (i=0; i<n; i++) {
+        printf "inspect 8999999999 2\n"
+        printf "find 80%08d\n", i
+        printf "inspect 80%08d 2\n", i
+        printf "count\n"
+        printf "find 81%08d\n", i
+    }
+}' > "$batch"
+
+fails=0
+for opts in "" "-n 2"; do
+    ./server $opts $PEER $SU </dev/null >/dev/null 2>&1 &
+    su=$!
+    ./server $opts $PEER $SL </dev/null >/dev/null 2>&1 &
+    sl=$!
+    sleep 0.5
+    timeout 60 ./client -f "$batch" -w 64 127.0.0.1 $SU $SL 2 > "$out"
+    kill $su $sl
+    wait $su $sl 2>/dev/null
+    bad=$(awk -F '\t' '
+        NF<3 { next }
+        {
+            split($2, a, " ")
+            if (a[1]=="add")          ok = $3=="OK(02) " a[2]
+            else if (a[1]=="in")      ok = $3=="RES_USRACCESS(-1)"
+            else if (a[1]=="find")    ok = $3==(substr(a[2], 1, 2)=="80" ? "RES_USRLOC(2)" : "ERROR(18)")
+            else if (a[1]=="inspect") ok = a[2]=="8999999999" ? $3 ~ /^RES_LOCLIST / : $3=="ERROR(19)"
+            else if (a[1]=="count")   ok = $3 ~ /^RES_LOCCOUNT /
+            else                      ok = 0
+            if (!ok) { bad++; if (bad<=3) print "  " $0 > "/dev/stderr" }
+            total++
+        }
+        END { print (total==8*'"$N"'+1 ? bad+0 : "missing") }' "$out")
+    echo "server $opts: $bad mismatched replies"
+    [ "$bad" = 0 ] || fails=1
+done
+exit $fails
@@ -5,32 +5,181 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#ifndef LOADGEN
+#include <poll.h>
+#endif
+#ifdef LOADGEN
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "histogram.h"
+#endif
 
 #define BUFFER_SIZE 500
 
+// Com réplica, o seq da última entrada/saída vai junto no find (lê o que escreveu)
+static unsigned long long last_seq = 0;
+#ifndef LOADGEN
+// -f: só os resultados vão para stdout
+static int batch = 0;
+#endif
+
 void connect_to_server(const char* ip, int port, int* sock);
 void read_server_responses(int sock_fd, const char* label);
 void read_server_single_line(int sock_fd, const char* label);
 void process_response(const char* line, const char* label);
+int  send_import(int sock, FILE* f);
+
+#ifndef LOADGEN
+// Destino de um pedido: o SU, o SL ou o socket do find (SL ou réplica)
+enum { T_SU, T_SL, T_FIND, T_N };
+
+#define HIST_SECS 3600   // janela padrão de history/entered
+
+// Começo da janela de history/entered: agora menos secs (padrão HIST_SECS); -1 se inválido
+static long long hist_since(const char* secs, long long* now){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *now = (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+    long long s = secs ? atoll(secs) : HIST_SECS;
+    if (s<=0) return -1;
+    return *now>s*1000 ? *now-s*1000 : 0;
+}
+
+// Comando do usuário -> pedido em msg; devolve o destino, ou -1 com o uso em *usage.
+// Com réplica, in/out pedem o seq e o find leva o último.
+static int build_request(char* command, int replica, char* msg, size_t n, const char** usage){
+    if (strncmp(command,"add ",4)==0) {
+        char* uid = strtok(command+4," ");
+        char* sIsSpec = strtok(NULL," ");
+        *usage = "Usage: add <UID(10)> <0|1>";
+        if(!uid || strlen(uid)!=10 || !sIsSpec) return -1;
+        snprintf(msg,n,"REQ_USRADD %s %s\n", uid, sIsSpec);
+        return T_SU;
+    }
+    if(strncmp(command,"in ",3)==0 || strncmp(command,"out ",4)==0){
+        int in = command[0]=='i';
+        char* uid = strtok(command+(in ? 3 : 4)," ");
+        *usage = in ? "Usage: in <UID(10)>" : "Usage: out <UID(10)>";
+        if(!uid || strlen(uid)!=10) return -1;
+        snprintf(msg,n,"REQ_USRACCESS %s %s%s\n", uid, in ? "in" : "out", replica ? " seq" : "");
+        return T_SU;
+    }
+    if(strncmp(command,"find ",5)==0){
+        char* uid = strtok(command+5," ");
+        *usage = "Usage: find <UID(10)>";
+        if(!uid || strlen(uid)!=10) return -1;
+        if (replica) snprintf(msg,n,"REQ_USRLOC %s %llu\n", uid, last_seq);
+        else         snprintf(msg,n,"REQ_USRLOC %s\n", uid);
+        return T_FIND;
+    }
+    if(strncmp(command,"inspect ",8)==0){
+        char* uid = strtok(command+8," ");
+        char* sLoc= strtok(NULL," ");
+        *usage = "Usage: inspect <UID(10)> <LOC>";
+        if(!uid || strlen(uid)!=10 || !sLoc) return -1;
+        snprintf(msg,n,"REQ_LOCLIST %s %s\n", uid, sLoc);
+        return T_SL;
+    }
+    if(strcmp(command,"count")==0){
+        snprintf(msg,n,"REQ_LOCCOUNT\n");
+        return T_FIND;
+    }
+    if(strncmp(command,"watch ",6)==0 || strncmp(command,"unwatch ",8)==0){
+        // watch <UID> loc <LOC>: o UID precisa ser especial, como no inspect (vai ao SL)
+        int on = command[0]=='w';
+        char* uid  = strtok(command+(on ? 6 : 8)," ");
+        char* what = strtok(NULL," ");
+        char* sLoc = strtok(NULL," ");
+        *usage = on ? "Usage: watch <UID(10)> [loc <LOC>]" : "Usage: unwatch <UID(10)> [loc <LOC>]";
+        if(!uid || strlen(uid)!=10) return -1;
+        if(!what){
+            snprintf(msg,n,"REQ_%sSUBSCRIBE %s\n", on ? "" : "UN", uid);
+            return T_FIND;
+        }
+        if(strcmp(what,"loc")!=0 || !sLoc) return -1;
+        snprintf(msg,n,"REQ_%sSUBSCRIBE %s LOC %s\n", on ? "" : "UN", uid, sLoc);
+        return T_SL;
+    }
+    if(strncmp(command,"history ",8)==0){
+        char* uid = strtok(command+8," ");
+        char* secs = strtok(NULL," ");
+        long long now, t1 = hist_since(secs, &now);
+        *usage = "Usage: history <UID(10)> [Seconds]";
+        if(!uid || strlen(uid)!=10 || t1<0) return -1;
+        snprintf(msg,n,"REQ_USRHIST %s %lld %lld\n", uid, t1, now);
+        return T_FIND;
+    }
+    if(strncmp(command,"entered ",8)==0){
+        // UID especial, como no inspect (vai ao SL)
+        char* uid  = strtok(command+8," ");
+        char* sLoc = strtok(NULL," ");
+        char* secs = strtok(NULL," ");
+        long long now, t1 = hist_since(secs, &now);
+        *usage = "Usage: entered <UID(10)> <LOC> [Seconds]";
+        if(!uid || strlen(uid)!=10 || !sLoc || t1<0) return -1;
+        snprintf(msg,n,"REQ_LOCHIST %s %s %lld %lld\n", uid, sLoc, t1, now);
+        return T_SL;
+    }
+    *usage = "Unknown command.";
+    return -1;
+}
+
+static int run_batch(FILE* in, int socks[T_N], int locId, int window);
+
+static void usage(const char* prog){
+    fprintf(stderr, "Usage: %s [-f File|-] [-w Window] <IP> <Port_SU> <Port_SL> <LocID> [Port_Replica]\n", prog);
+    fprintf(stderr, "  -f  run the commands in File (- for stdin) without waiting for each reply\n");
+    fprintf(stderr, "  -w  requests in flight per connection with -f (default 256)\n");
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char* argv[]) {
-    if (argc!=5) {
-        fprintf(stderr, "Usage: %s <IP> <Port_SU> <Port_SL> <LocID>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-    const char* ip_su = argv[1];
-    int port_su = atoi(argv[2]);
-    int port_sl = atoi(argv[3]);
-    int locId   = atoi(argv[4]);
+    const char* script = NULL;
+    int window = 256;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:w:"))!=-1) {
+        switch (opt) {
+        case 'f': script = optarg; batch = 1; break;
+        case 'w': window = atoi(optarg);     break;
+        default:  usage(argv[0]);
+        }
+    }
+    int nargs = argc-optind;
+    char** arg = argv+optind;
+    if ((nargs!=4 && nargs!=5) || window<1) usage(argv[0]);
+    const char* ip_su = arg[0];
+    int port_su = atoi(arg[1]);
+    int port_sl = atoi(arg[2]);
+    int locId   = atoi(arg[3]);
     if (locId<1 || locId>10) {
         fprintf(stderr, "Invalid argument: LocID must be 1..10\n");
         exit(1);
     }
+    FILE* in = NULL;
+    if (script) {
+        in = strcmp(script,"-")==0 ? stdin : fopen(script, "r");
+        if (!in) {
+            perror(script);
+            exit(1);
+        }
+    }
 
     int sock_su, sock_sl;
     connect_to_server(ip_su, port_su, &sock_su);
     connect_to_server(ip_su, port_sl, &sock_sl);
-
+    // find vai para a réplica, se houver
+    int sock_find = sock_sl;
+    if (nargs==5) {
+        connect_to_server(ip_su, atoi(arg[4]), &sock_find);
+    }
+    if (in) {
+        int socks[T_N] = { sock_su, sock_sl, sock_find };
+        return run_batch(in, socks, locId, window);
+    }
     // Envia REQ_CONN(locId) p/ SU e SL
     {
         char msg[BUFFER_SIZE];
@@ -40,11 +189,38 @@ int main(int argc, char* argv[]) {
 
         send(sock_sl, msg, strlen(msg), 0);
         read_server_responses(sock_sl, "SL");
+
+        if (sock_find!=sock_sl) {
+            send(sock_find, msg, strlen(msg), 0);
+            read_server_responses(sock_find, "SL");
+        }
     }
 
     char command[BUFFER_SIZE];
+    int watching = 0;
     while (1) {
         printf("Enter command: ");
+        fflush(stdout);
+        // com assinaturas, mostra os eventos enquanto espera o comando
+        while (watching) {
+            // as de UID vêm pelo socket do find; as de local, pelo SL
+            struct pollfd pfd[3] = { { 0, POLLIN, 0 }, { sock_find, POLLIN, 0 }, { sock_sl, POLLIN, 0 } };
+            int nfds = sock_find!=sock_sl ? 3 : 2;
+            if (poll(pfd, nfds, -1)<0 && errno!=EINTR) break;
+            if (pfd[0].revents) break;
+            for (int k=1; k<nfds; k++) {
+                if (pfd[k].revents & (POLLHUP|POLLERR)) {
+                    printf("\nConnection closed by the server\n");
+                    return 1;
+                }
+                if (pfd[k].revents) {
+                    printf("\n");
+                    read_server_responses(pfd[k].fd, "SL");
+                    printf("Enter command: ");
+                    fflush(stdout);
+                }
+            }
+        }
         if (!fgets(command, sizeof(command), stdin)) {
             break;
         }
@@ -62,6 +238,12 @@ int main(int argc, char* argv[]) {
             read_server_single_line(sock_sl,"SL");
 
 
+            if (sock_find!=sock_sl) {
+                send(sock_find, msg, strlen(msg),0);
+                read_server_single_line(sock_find,"SL");
+                close(sock_find);
+            }
+
             close(sock_su);
             printf("SU Successful disconnect\n");
             close(sock_sl);
@@ -69,75 +251,288 @@ int main(int argc, char* argv[]) {
             break;
         }
 
-        if (strncmp(command,"add ",4)==0) {
-            char* uid = strtok(command+4," ");
-            char* sIsSpec = strtok(NULL," ");
-            if(!uid || strlen(uid)!=10 || !sIsSpec){
-                printf("Usage: add <UID(10)> <0|1>\n");
+        if(strncmp(command,"import ",7)==0){
+            char* path = strtok(command+7," ");
+            FILE* f = path ? fopen(path,"r") : NULL;
+            if(!f){
+                printf("Usage: import <file>  (one \"<UID(10)> <0|1>\" per line)\n");
                 continue;
             }
-            char msg[BUFFER_SIZE];
-            snprintf(msg,sizeof(msg),"REQ_USRADD %s %s\n", uid, sIsSpec);
-            send(sock_su, msg, strlen(msg),0);
-            read_server_single_line(sock_su,"SU");
-            continue;
-        }
-        if(strncmp(command,"in ",3)==0){
-            char* uid = strtok(command+3," ");
-            if(!uid || strlen(uid)!=10){
-                printf("Usage: in <UID(10)>\n");
+            int err = send_import(sock_su, f);
+            fclose(f);
+            if(err<0){
+                perror("import");
                 continue;
             }
-            char msg[BUFFER_SIZE];
-            snprintf(msg,sizeof(msg),"REQ_USRACCESS %s in\n", uid);
-            send(sock_su, msg, strlen(msg),0);
             read_server_single_line(sock_su,"SU");
             continue;
         }
-        if(strncmp(command,"out ",4)==0){
-            char* uid = strtok(command+4," ");
-            if(!uid || strlen(uid)!=10){
-                printf("Usage: out <UID(10)>\n");
-                continue;
-            }
-            char msg[BUFFER_SIZE];
-            snprintf(msg,sizeof(msg),"REQ_USRACCESS %s out\n", uid);
-            send(sock_su, msg, strlen(msg),0);
-            read_server_single_line(sock_su,"SU");
+
+        char msg[BUFFER_SIZE];
+        const char* use;
+        int t = build_request(command, sock_find!=sock_sl, msg, sizeof(msg), &use);
+        if (t<0) {
+            printf("%s\n", use);
             continue;
         }
-        if(strncmp(command,"find ",5)==0){
-            char* uid = strtok(command+5," ");
-            if(!uid || strlen(uid)!=10){
-                printf("Usage: find <UID(10)>\n");
-                continue;
+        int sock = t==T_SU ? sock_su : t==T_SL ? sock_sl : sock_find;
+        // com stdin em arquivo/pipe o stdio já leu adiante: o poll não veria
+        if (strncmp(msg,"REQ_SUBSCRIBE ",14)==0) watching = isatty(0);
+        send(sock, msg, strlen(msg),0);
+        read_server_single_line(sock, t==T_SU ? "SU" : "SL");
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------
+// Modo em lote (-f): lê todos os comandos e mantém até window pedidos em
+// andamento por conexão, sem esperar cada resposta. Cada servidor responde
+// na ordem em que recebeu (a resposta que espera o outro servidor segura as
+// seguintes), então a resposta que chega é a do pedido mais antigo daquela
+// conexão; o make check confere. Ao mudar de conexão espera as respostas da
+// outra: um find depois de um in vê a entrada, como no modo interativo.
+#define BATCH_TIMEOUT_MS 10000   // sem nenhuma resposta nesse tempo: desiste
+
+typedef struct {
+    char* text;
+    char* reply;         // NULL enquanto não chegou
+    int   target;        // T_*, ou -1 (uso errado: reply é a mensagem de uso)
+} BatchCmd;
+
+typedef struct {
+    int    sock;
+    int*   fifo;         // pedidos em andamento (-1: o REQ_CONN), na ordem de envio
+    int    head, count;
+    char*  out;          // a enviar
+    size_t out_len, out_off, out_cap;
+    char*  in;           // linha incompleta recebida
+    size_t in_len, in_cap;
+} BatchConn;
+
+static int batch_push(BatchConn* c, int window, int idx, const char* msg){
+    size_t len = strlen(msg);
+    if (c->out_off==c->out_len) c->out_off = c->out_len = 0;
+    if (c->out_len+len>c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 65536;
+        while (cap<c->out_len+len) cap *= 2;
+        char* o = realloc(c->out, cap);
+        if (!o) return -1;
+        c->out = o;
+        c->out_cap = cap;
+    }
+    memcpy(c->out+c->out_len, msg, len);
+    c->out_len += len;
+    c->fifo[(c->head+c->count++) % (window+1)] = idx;
+    return 0;
+}
+
+static int64_t batch_now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int run_batch(FILE* in, int socks[T_N], int locId, int window){
+    BatchCmd* cmds = NULL;
+    int n = 0, cap = 0;
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0] || line[0]=='#') continue;
+        if (strncmp(line, "kill", 4)==0) break;      // fim do lote
+        if (n==cap) {
+            cap = cap ? 2*cap : 1024;
+            BatchCmd* c = realloc(cmds, cap*sizeof(BatchCmd));
+            if (!c) {
+                perror("batch");
+                return 1;
             }
-            char msg[BUFFER_SIZE];
-            snprintf(msg,sizeof(msg),"REQ_USRLOC %s\n", uid);
-            send(sock_sl, msg, strlen(msg),0);
-            read_server_single_line(sock_sl,"SL");
-            continue;
+            cmds = c;
         }
-        if(strncmp(command,"inspect ",8)==0){
-            char* uid = strtok(command+8," ");
-            char* sLoc= strtok(NULL," ");
-            if(!uid || strlen(uid)!=10 || !sLoc){
-                printf("Usage: inspect <UID(10)> <LOC>\n");
-                continue;
-            }
-            char msg[BUFFER_SIZE];
-            snprintf(msg,sizeof(msg),"REQ_LOCLIST %s %s\n", uid, sLoc);
-            send(sock_sl, msg, strlen(msg),0);
-            read_server_single_line(sock_sl,"SL");
-            continue;
+        char tmp[BUFFER_SIZE], msg[BUFFER_SIZE];
+        const char* use;
+        strcpy(tmp, line);
+        cmds[n].text = strdup(line);
+        cmds[n].target = build_request(tmp, socks[T_FIND]!=socks[T_SL], msg, sizeof(msg), &use);
+        cmds[n].reply = cmds[n].target<0 ? strdup(use) : NULL;
+        if (strncmp(line, "import", 6)==0) {
+            cmds[n].target = -1;
+            cmds[n].reply = strdup("import is not available with -f");
         }
+        n++;
+    }
+    if (in!=stdin) fclose(in);
 
-        printf("Unknown command.\n");
+    // sem réplica o find vai na conexão do SL
+    int nconn = socks[T_FIND]!=socks[T_SL] ? T_N : T_FIND;
+    BatchConn conns[T_N];
+    memset(conns, 0, sizeof(conns));
+    char msg[BUFFER_SIZE];
+    snprintf(msg, sizeof(msg), "REQ_CONN(%d)\n", locId);
+    for (int i=0; i<nconn; i++) {
+        conns[i].sock = socks[i];
+        conns[i].fifo = malloc((window+1)*sizeof(int));
+        if (!conns[i].fifo || batch_push(&conns[i], window, -1, msg)<0) {
+            perror("batch");
+            return 1;
+        }
+        fcntl(socks[i], F_SETFL, fcntl(socks[i], F_GETFL, 0) | O_NONBLOCK);
     }
 
+    int64_t t0 = batch_now_ms(), last_reply = t0;
+    int next = 0, printed = 0, errors = 0, cur = -1;
+    while (printed<n) {
+        // Envia enquanto houver janela; troca de conexão só com a outra vazia
+        for (; next<n; next++) {
+            BatchCmd* c = &cmds[next];
+            if (c->target<0) continue;
+            int ci = c->target<nconn ? c->target : T_SL;
+            if (conns[ci].count>window-1) break;
+            int busy = 0;
+            for (int i=0; i<nconn; i++) busy |= i!=ci && conns[i].count>0;
+            if (busy && ci!=cur) break;
+            char tmp[BUFFER_SIZE];
+            const char* use;
+            strcpy(tmp, c->text);
+            build_request(tmp, nconn==T_N, msg, sizeof(msg), &use);
+            if (batch_push(&conns[ci], window, next, msg)<0) {
+                perror("batch");
+                return 1;
+            }
+            cur = ci;
+        }
+        // Resultados prontos, na ordem do arquivo
+        while (printed<n && cmds[printed].reply) {
+            BatchCmd* c = &cmds[printed];
+            if (c->target<0 || strncmp(c->reply, "ERROR(", 6)==0 || strcmp(c->reply, "UNKNOWN_CMD")==0) errors++;
+            printf("%d\t%s\t%s\n", printed+1, c->text, c->reply);
+            free(c->text);
+            free(c->reply);
+            printed++;
+        }
+        if (printed==n) break;
+
+        struct pollfd pfd[T_N];
+        for (int i=0; i<nconn; i++) {
+            pfd[i].fd = conns[i].sock;
+            pfd[i].events = (conns[i].count ? POLLIN : 0) | (conns[i].out_off<conns[i].out_len ? POLLOUT : 0);
+            pfd[i].revents = 0;
+        }
+        if (poll(pfd, nconn, 100)<0 && errno!=EINTR) {
+            perror("poll");
+            return 1;
+        }
+        for (int i=0; i<nconn; i++) {
+            BatchConn* c = &conns[i];
+            if (pfd[i].revents & POLLOUT) {
+                ssize_t k = send(c->sock, c->out+c->out_off, c->out_len-c->out_off, 0);
+                if (k>0) c->out_off += k;
+            }
+            if (!(pfd[i].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+            if (c->in_len+4096>c->in_cap) {
+                // RES_LOCLIST de um local cheio pode ser bem longa
+                size_t ncap = c->in_cap ? 2*c->in_cap : 65536;
+                char* b = realloc(c->in, ncap);
+                if (!b) {
+                    perror("batch");
+                    return 1;
+                }
+                c->in = b;
+                c->in_cap = ncap;
+            }
+            ssize_t k = recv(c->sock, c->in+c->in_len, c->in_cap-c->in_len, 0);
+            if (k<=0 && !(k<0 && (errno==EAGAIN || errno==EINTR))) {
+                fprintf(stderr, "Connection closed by the server (%d commands unanswered)\n", n-printed);
+                return 1;
+            }
+            if (k<=0) continue;
+            c->in_len += k;
+            last_reply = batch_now_ms();
+            char* p = c->in;
+            char* nl;
+            while (c->count && (nl = memchr(p, '\n', c->in+c->in_len-p))) {
+                *nl = '\0';
+                if (strncmp(p, "EVT_", 4)==0) {
+                    // evento de assinatura: não é resposta de nenhum pedido
+                    p = nl+1;
+                    continue;
+                }
+                int idx = c->fifo[c->head];
+                c->head = (c->head+1) % (window+1);
+                c->count--;
+                if (idx<0) {
+                    if (strncmp(p, "RES_CONN(", 9)!=0) {
+                        fprintf(stderr, "Connect failed: %s\n", p);
+                        return 1;
+                    }
+                } else {
+                    unsigned long long seq;
+                    int oldLoc;
+                    if (sscanf(p, "RES_USRACCESS(%d) %llu", &oldLoc, &seq)==2 && seq>last_seq) last_seq = seq;
+                    cmds[idx].reply = strdup(p);
+                }
+                p = nl+1;
+            }
+            c->in_len -= p-c->in;
+            memmove(c->in, p, c->in_len);
+        }
+        if (batch_now_ms()-last_reply>BATCH_TIMEOUT_MS) {
+            fprintf(stderr, "No reply for %d s (%d commands unanswered)\n", BATCH_TIMEOUT_MS/1000, n-printed);
+            return 1;
+        }
+    }
+    double secs = (batch_now_ms()-t0)/1e3;
+    fflush(stdout);
+    fprintf(stderr, "%d commands in %.2f s (%.0f/s), %d errors\n", n, secs, secs>0 ? n/secs : 0, errors);
+    for (int i=0; i<nconn; i++) {
+        close(conns[i].sock);
+        free(conns[i].fifo);
+        free(conns[i].out);
+        free(conns[i].in);
+    }
+    free(cmds);
     return 0;
 }
 
+// Manda o arquivo num REQ_USRIMPORT <N> seguido das N linhas (sem as vazias)
+int send_import(int sock, FILE* f){
+    char* data = NULL;
+    size_t len = 0, cap = 0;
+    int n = 0;
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        size_t l = strlen(line);
+        if (!l) continue;
+        if (len+l+1>cap) {
+            cap = cap ? 2*cap : 1<<16;
+            while (len+l+1>cap) cap *= 2;
+            char* d = realloc(data, cap);
+            if (!d) {
+                free(data);
+                return -1;
+            }
+            data = d;
+        }
+        memcpy(data+len, line, l);
+        len += l;
+        data[len++] = '\n';
+        n++;
+    }
+    char hdr[64];
+    int hl = snprintf(hdr, sizeof(hdr), "REQ_USRIMPORT %d\n", n);
+    int err = send(sock, hdr, hl, 0)<0 ? -1 : 0;
+    for (size_t off=0; off<len && !err; ) {
+        ssize_t k = send(sock, data+off, len-off, 0);
+        if (k<0) err = -1;
+        else off += k;
+    }
+    free(data);
+    return err;
+}
+#endif
+
 void read_server_responses(int sock_fd, const char* label) {
     char buffer[BUFFER_SIZE+1];
 
@@ -161,18 +556,48 @@ void read_server_responses(int sock_fd, const char* label) {
     }
 }
 
+// Lê até a resposta, que pode vir em vários read() (RES_LOCLIST, RES_LOCHIST);
+// eventos de assinatura (EVT_*) que vierem antes são mostrados
 void read_server_single_line(int sock_fd, const char* label) {
-    char buffer[BUFFER_SIZE+1];
-    int n = read(sock_fd, buffer, BUFFER_SIZE);
-    if (n > 0) {
-        buffer[n] = '\0';
-        char* line = strtok(buffer, "\n");
-        if (line) {
+    static char*  buffer;
+    static size_t cap;
+    size_t len = 0;
+    int replied = 0;
+    while (!replied) {
+        if (cap-len<BUFFER_SIZE+1) {
+            size_t ncap = cap ? 2*cap : 4096;
+            char* b = realloc(buffer, ncap);
+            if (!b) return;
+            buffer = b;
+            cap = ncap;
+        }
+        int n = read(sock_fd, buffer+len, cap-len-1);
+        if (n <= 0) return;
+        len += n;
+        buffer[len] = '\0';
+        char* line = buffer;
+        char* nl;
+        while ((nl = strchr(line, '\n'))) {
+            *nl = '\0';
             process_response(line, label);
+            if (strncmp(line, "EVT_", 4)!=0) replied = 1;
+            line = nl+1;
         }
+        len -= line-buffer;
+        memmove(buffer, line, len);
     }
 }
 
+// ms (epoch) como hora local "HH:MM:SS.mmm"
+static const char* hist_time(long long ms, char* out, size_t n){
+    time_t t = (time_t)(ms/1000);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    size_t k = strftime(out, n, "%H:%M:%S", &tm);
+    snprintf(out+k, n-k, ".%03lld", ms%1000);
+    return out;
+}
+
 void process_response(const char* line, const char* label){
     if(!line)return;
     if(strncmp(line,"OK(02)",6)==0){
@@ -189,12 +614,26 @@ void process_response(const char* line, const char* label){
             printf("User updated: %s\n", p+1);
         }
     }
+    else if(strncmp(line,"RES_USRIMPORT ",14)==0){
+        int added=0, updated=0, rejected=0;
+        sscanf(line+14,"%d %d %d", &added, &updated, &rejected);
+        printf("Imported: %d new, %d updated, %d rejected\n", added, updated, rejected);
+    }
+    else if(strncmp(line,"ERROR(17)",9)==0){
+        printf("Invalid user data\n");
+    }
     else if(strncmp(line,"ERROR(18)",9)==0){
         printf("User not found\n");
     }
     else if(strncmp(line,"ERROR(19)",9)==0){
         printf("Permission denied\n");
     }
+    else if(strncmp(line,"ERROR(20)",9)==0){
+        printf("Location served by another SL\n");
+    }
+    else if(strncmp(line,"ERROR(21)",9)==0){
+        printf("Replica is behind, try again\n");
+    }
     else if(strncmp(line,"RES_USRLOC(",11)==0){
         int loc=-1;
         sscanf(line,"RES_USRLOC(%d)", &loc);
@@ -202,7 +641,8 @@ void process_response(const char* line, const char* label){
     }
     else if(strncmp(line,"RES_USRACCESS(",14)==0){
         int oldLoc=-1;
-        sscanf(line,"RES_USRACCESS(%d)", &oldLoc);
+        unsigned long long seq;
+        if (sscanf(line,"RES_USRACCESS(%d) %llu", &oldLoc, &seq)==2 && seq>last_seq) last_seq = seq;
         printf("Ok. Last location: %d\n", oldLoc);
     }
     else if(strncmp(line,"RES_LOCLIST",11)==0){
@@ -217,6 +657,82 @@ void process_response(const char* line, const char* label){
             }
         }
     }
+    else if(strncmp(line,"RES_LOCCOUNT ",13)==0){
+        // Ex: "RES_LOCCOUNT 3:12 7:1" (só os locais ocupados)
+        const char* p = line+13;
+        if(strncmp(p,"EMPTY",5)==0){
+            printf("No users at any location\n");
+        } else {
+            printf("People per location:");
+            int loc, k, used;
+            while(sscanf(p," %d:%d%n", &loc, &k, &used)==2){
+                printf(" %d=%d", loc, k);
+                p += used;
+            }
+            printf("\n");
+        }
+    }
+    else if(strncmp(line,"RES_USRHIST ",12)==0){
+        // Ex: "RES_USRHIST 3 1729170000123:7 1729170004567:-1" (local no começo, depois as mudanças)
+        const char* p = line+12;
+        int loc, used;
+        long long ts;
+        char when[32];
+        if(sscanf(p,"%d%n", &loc, &used)!=1) return;
+        printf("Location at window start: %d\n", loc);
+        p += used;
+        while(sscanf(p," %lld:%d%n", &ts, &loc, &used)==2){
+            printf("  %s -> %d\n", hist_time(ts, when, sizeof(when)), loc);
+            p += used;
+        }
+        if(strstr(p,"MORE")) printf("  ... (more, use a shorter window)\n");
+    }
+    else if(strncmp(line,"RES_LOCHIST ",12)==0){
+        // Ex: "RES_LOCHIST 1729170000123:2021808080 ..." em ordem de tempo
+        const char* p = line+12;
+        long long ts;
+        char uid[11], when[32];
+        int used;
+        if(strncmp(p,"EMPTY",5)==0){
+            printf("Nobody entered the location in the window\n");
+            return;
+        }
+        printf("Entered the location:\n");
+        while(sscanf(p," %lld:%10s%n", &ts, uid, &used)==2){
+            printf("  %s %s\n", hist_time(ts, when, sizeof(when)), uid);
+            p += used;
+        }
+        if(strstr(p,"MORE")) printf("  ... (more, use a shorter window)\n");
+    }
+    else if(strncmp(line,"ERROR(23)",9)==0){
+        printf("Invalid history query\n");
+    }
+    else if(strncmp(line,"ERROR(24)",9)==0){
+        printf("History not kept that far back\n");
+    }
+    else if(strncmp(line,"ERROR(25)",9)==0){
+        printf("Server out of memory, try again\n");
+    }
+    else if(strncmp(line,"EVT_LOC ",8)==0){
+        // Ex: "EVT_LOC 2021808080 3 7" (-1 = fora)
+        char uid[11];
+        int from, to;
+        if(sscanf(line+8,"%10s %d %d", uid, &from, &to)==3){
+            printf("Location change: %s %d -> %d\n", uid, from, to);
+        }
+    }
+    else if(strncmp(line,"EVT_LOST ",9)==0){
+        printf("%s location changes lost, re-read what you need\n", line+9);
+    }
+    else if(strncmp(line,"OK(04)",6)==0){
+        printf("Subscribed\n");
+    }
+    else if(strncmp(line,"OK(05)",6)==0){
+        printf("Unsubscribed\n");
+    }
+    else if(strncmp(line,"ERROR(22)",9)==0){
+        printf("Invalid subscription\n");
+    }
     else if(strncmp(line,"RES_CONN(",9)==0){
         int id=-1;
         if(sscanf(line,"RES_CONN(%d)", &id)==1){
@@ -280,5 +796,361 @@ void connect_to_server(const char* ip, int port, int* sock){
             exit(1);
         }
     }
-    printf("Connected to server on port %d\n", port);
+#ifndef LOADGEN
+    if (!batch) printf("Connected to server on port %d\n", port);
+#endif
+}
+
+#ifdef LOADGEN
+// ----------------------------------------------------
+// Gerador de carga (make loadgen): abre muitos pares de conexões SU/SL e
+// manda uma mistura de comandos numa taxa fixa sem esperar as respostas
+// (malha aberta). A latência conta do instante em que o comando devia
+// sair, então um servidor lento não freia o gerador e a espera aparece
+// nos percentis (sem coordinated omission).
+enum { LG_ADD, LG_IN, LG_OUT, LG_FIND, LG_INSPECT, LG_CMDS, LG_SETUP = LG_CMDS };
+static const char* lg_names[LG_CMDS] = { "add", "in", "out", "find", "inspect" };
+// Começo da resposta certa de cada comando (fora os ERROR)
+static const char* lg_replies[LG_CMDS] = { "OK(0", "RES_USRACCESS", "RES_USRACCESS", "RES_USRLOC", "RES_LOCLIST" };
+
+// Comando enviado esperando resposta; cada conexão responde em ordem
+typedef struct {
+    int64_t at;          // quando devia ter saído (ns)
+    int     cmd;
+} Sent;
+
+typedef struct {
+    int    fd;
+    int    loc;
+    char*  out;          // ainda não aceito pelo socket
+    size_t out_len, out_off, out_cap;
+    char*  in;           // linha incompleta
+    size_t in_len, in_cap;
+    Sent*  q;            // fila circular de comandos sem resposta
+    size_t q_head, q_len, q_cap;
+    int    want_write;
+    int    dirty;
+} LgConn;
+
+static LgConn* lg_conns;     // [2*i] SU, [2*i+1] SL do par i
+static int     lg_nconns;
+static int*    lg_dirty;
+static int     lg_ndirty;
+static int     lg_ep;
+static long    lg_outstanding;
+static Hist    lg_hist[LG_CMDS];
+static long    lg_setup_errors;
+static long    lg_mismatched;  // resposta de outro tipo: o par pedido/resposta se perdeu
+static int64_t lg_last_reply;
+
+static int64_t lg_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ll + ts.tv_nsec;
+}
+
+static uint64_t lg_rng_state = 88172645463325252ull;
+static uint64_t lg_rng(void){
+    lg_rng_state ^= lg_rng_state<<13;
+    lg_rng_state ^= lg_rng_state>>7;
+    lg_rng_state ^= lg_rng_state<<17;
+    return lg_rng_state;
+}
+
+static void* lg_grow(void* p, size_t* cap, size_t need, size_t elem){
+    if (need<=*cap) return p;
+    size_t ncap = *cap ? *cap : 64;
+    while (ncap<need) ncap *= 2;
+    p = realloc(p, ncap*elem);
+    if (!p) {
+        perror("realloc");
+        exit(1);
+    }
+    *cap = ncap;
+    return p;
+}
+
+// Enfileira a linha na conexão c; sai no lg_flush do fim da rodada
+static void lg_send(int ci, int cmd, int64_t at, const char* line, size_t len){
+    LgConn* c = &lg_conns[ci];
+    c->out = lg_grow(c->out, &c->out_cap, c->out_len+len, 1);
+    memcpy(c->out+c->out_len, line, len);
+    c->out_len += len;
+    if (c->q_len==c->q_cap) {
+        // cheia: cresce e desfaz a volta (o que estava antes de q_head vai para o fim)
+        size_t old = c->q_cap;
+        c->q = lg_grow(c->q, &c->q_cap, old+1, sizeof(Sent));
+        memcpy(c->q+old, c->q, c->q_head*sizeof(Sent));
+    }
+    c->q[(c->q_head+c->q_len) % c->q_cap] = (Sent){ at, cmd };
+    c->q_len++;
+    lg_outstanding++;
+    if (!c->dirty) {
+        c->dirty = 1;
+        lg_dirty[lg_ndirty++] = ci;
+    }
+}
+
+static void lg_flush_one(int ci){
+    LgConn* c = &lg_conns[ci];
+    while (c->out_off<c->out_len) {
+        ssize_t n = send(c->fd, c->out+c->out_off, c->out_len-c->out_off, MSG_NOSIGNAL);
+        if (n<0 && errno==EINTR) continue;
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+        if (n<=0) {
+            perror("send");
+            exit(1);
+        }
+        c->out_off += n;
+    }
+    if (c->out_off==c->out_len) c->out_off = c->out_len = 0;
+    int ww = c->out_len>0;
+    if (ww!=c->want_write) {
+        struct epoll_event ev = { .events = EPOLLIN | (ww ? EPOLLOUT : 0), .data.u32 = ci };
+        epoll_ctl(lg_ep, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = ww;
+    }
+}
+
+static void lg_flush(void){
+    for (int i=0; i<lg_ndirty; i++) {
+        lg_conns[lg_dirty[i]].dirty = 0;
+        lg_flush_one(lg_dirty[i]);
+    }
+    lg_ndirty = 0;
+}
+
+// Uma resposta: fecha o comando mais antigo da conexão
+static void lg_response(LgConn* c, const char* line, int64_t now){
+    if (!c->q_len) return;
+    Sent s = c->q[c->q_head];
+    c->q_head = (c->q_head+1) % c->q_cap;
+    c->q_len--;
+    lg_outstanding--;
+    int err = strncmp(line, "ERROR(", 6)==0;
+    if (s.cmd==LG_SETUP) {
+        if (err) lg_setup_errors++;
+        if (strncmp(line, "ERROR(09)", 9)==0) {
+            fprintf(stderr, "Server refused a connection: start it with a larger -m\n");
+            exit(1);
+        }
+        return;
+    }
+    Hist* h = &lg_hist[s.cmd];
+    lg_last_reply = now;
+    if (err) h->errors++;
+    else if (strncmp(line, lg_replies[s.cmd], strlen(lg_replies[s.cmd]))!=0) lg_mismatched++;
+    hist_add(h, (uint64_t)(now-s.at)/1000);
+}
+
+static void lg_read(int ci){
+    LgConn* c = &lg_conns[ci];
+    while (1) {
+        c->in = lg_grow(c->in, &c->in_cap, c->in_len+65536, 1);
+        ssize_t n = recv(c->fd, c->in+c->in_len, c->in_cap-c->in_len, 0);
+        if (n<0 && errno==EINTR) continue;
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+        if (n<=0) {
+            fprintf(stderr, "Connection %d closed by the server\n", ci);
+            exit(1);
+        }
+        int64_t now = lg_now();
+        size_t start = 0;
+        for (size_t i=c->in_len; i<c->in_len+(size_t)n; i++) {
+            if (c->in[i]!='\n') continue;
+            c->in[i] = '\0';
+            lg_response(c, c->in+start, now);
+            start = i+1;
+        }
+        c->in_len += n;
+        memmove(c->in, c->in+start, c->in_len-start);
+        c->in_len -= start;
+    }
+}
+
+// Uma rodada de eventos das conexões
+static void lg_poll(int timeout_ms){
+    struct epoll_event evs[256];
+    int n = epoll_wait(lg_ep, evs, 256, timeout_ms);
+    for (int i=0; i<n; i++) {
+        int ci = evs[i].data.u32;
+        if (evs[i].events & EPOLLOUT) lg_flush_one(ci);
+        if (evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) lg_read(ci);
+    }
+}
+// Espera as respostas até deadline (ns)
+static void lg_drain(int64_t deadline){
+    lg_flush();
+    while (lg_outstanding && lg_now()<deadline) lg_poll(100);
+}
+
+#define LG_UID_BASE  2000000000ull
+
+static void lg_usage(const char* prog){
+    fprintf(stderr,
+        "Usage: %s <IP> <Port_SU> <Port_SL> [-c Pairs] [-r Rate] [-d Seconds] [-u Users] [-x Mix]\n"
+        "  -c Pairs    SU/SL connection pairs (default 100); the servers need -m >= Pairs\n"
+        "  -r Rate     commands per second, sent on schedule whatever the latency (default 10000)\n"
+        "  -d Seconds  duration of the measured run (default 10)\n"
+        "  -u Users    users added before the run, 1 in 10 special (default 10000)\n"
+        "  -x Mix      weights, e.g. add=1,in=4,out=4,find=8,inspect=1 (the default)\n",
+        prog);
+    exit(1);
+}
+
+// -x: "cmd=peso,..."; -1 se mal formado ou com peso negativo
+static int lg_parse_mix(char* s, int* w){
+    for (int i=0; i<LG_CMDS; i++) w[i] = 0;
+    char* save;
+    for (char* t=strtok_r(s, ",", &save); t; t=strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(t, '=');
+        char* end;
+        int i;
+        if (!eq) return -1;
+        *eq = '\0';
+        for (i=0; i<LG_CMDS && strcmp(t, lg_names[i])!=0; i++);
+        if (i==LG_CMDS) {
+            fprintf(stderr, "Unknown command in mix: %s\n", t);
+            return -1;
+        }
+        long v = strtol(eq+1, &end, 10);
+        if (end==eq+1 || *end || v<0 || v>1000000) {
+            fprintf(stderr, "Invalid weight in mix: %s=%s\n", t, eq+1);
+            return -1;
+        }
+        w[i] = (int)v;
+    }
+    return 0;
+}
+
+// Próximo comando do roteiro, no par pair, que devia sair em at
+static void lg_issue(int pair, int64_t at, const int* w, int wsum, long users){
+    int r = (int)(lg_rng() % wsum), cmd = 0;
+    while (r>=w[cmd]) r -= w[cmd++];
+    unsigned long long uid = LG_UID_BASE + lg_rng() % users;
+    char m[BUFFER_SIZE];
+    int n;
+    switch (cmd) {
+    case LG_ADD:
+        n = snprintf(m, sizeof(m), "REQ_USRADD %010llu %d\n", uid, (uid-LG_UID_BASE)%10==0);
+        break;
+    case LG_IN:
+    case LG_OUT:
+        n = snprintf(m, sizeof(m), "REQ_USRACCESS %010llu %s\n", uid, cmd==LG_IN ? "in" : "out");
+        break;
+    case LG_FIND:
+        n = snprintf(m, sizeof(m), "REQ_USRLOC %010llu\n", uid);
+        break;
+    default:
+        // só os especiais (UID múltiplo de 10) podem ver a lista
+        uid -= (uid-LG_UID_BASE)%10;
+        n = snprintf(m, sizeof(m), "REQ_LOCLIST %010llu %d\n", uid, 1+(int)(lg_rng()%10));
+        break;
+    }
+    lg_send(2*pair + (cmd>=LG_FIND), cmd, at, m, n);
+}
+
+int main(int argc, char* argv[]){
+    int pairs = 100, secs = 10;
+    long users = 10000;
+    double rate = 10000;
+    int w[LG_CMDS] = { 1, 4, 4, 8, 1 };
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:d:u:x:"))!=-1) {
+        switch (opt) {
+        case 'c': pairs = atoi(optarg); break;
+        case 'r': rate  = atof(optarg); break;
+        case 'd': secs  = atoi(optarg); break;
+        case 'u': users = atol(optarg); break;
+        case 'x': if (lg_parse_mix(optarg, w)<0) lg_usage(argv[0]); break;
+        default:  lg_usage(argv[0]);
+        }
+    }
+    if (argc-optind!=3 || pairs<1 || rate<=0 || secs<1 || users<10) lg_usage(argv[0]);
+    int wsum = 0;
+    for (int i=0; i<LG_CMDS; i++) wsum += w[i];
+    if (!wsum) lg_usage(argv[0]);
+    const char* ip = argv[optind];
+    int port_su = atoi(argv[optind+1]);
+    int port_sl = atoi(argv[optind+2]);
+
+    // dois sockets por par, além dos de sempre
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl)==0 && rl.rlim_cur<(rlim_t)2*pairs+16) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    lg_ep = epoll_create1(0);
+    lg_nconns = 2*pairs;
+    lg_conns = calloc(lg_nconns, sizeof(LgConn));
+    lg_dirty = malloc(lg_nconns*sizeof(int));
+    if (lg_ep<0 || !lg_conns || !lg_dirty) {
+        perror("loadgen");
+        return 1;
+    }
+    // Preparação: REQ_CONN em todas, e os usuários cadastrados pelas conexões do SU
+    int64_t t_setup = lg_now();
+    for (int ci=0; ci<lg_nconns; ci++) {
+        LgConn* c = &lg_conns[ci];
+        connect_to_server(ip, ci%2 ? port_sl : port_su, &c->fd);
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = ci };
+        epoll_ctl(lg_ep, EPOLL_CTL_ADD, c->fd, &ev);
+        c->loc = 1 + (ci/2)%10;
+        char m[BUFFER_SIZE];
+        int n = snprintf(m, sizeof(m), "REQ_CONN(%d)\n", c->loc);
+        lg_send(ci, LG_SETUP, 0, m, n);
+        lg_flush();
+    }
+    for (long i=0; i<users; i++) {
+        char m[BUFFER_SIZE];
+        int n = snprintf(m, sizeof(m), "REQ_USRADD %010llu %d\n", LG_UID_BASE+i, i%10==0);
+        lg_send(2*(int)(i%pairs), LG_SETUP, 0, m, n);
+        if (lg_outstanding>=65536) lg_drain(lg_now()+30000000000ll);
+    }
+    lg_drain(lg_now()+30000000000ll);
+    if (lg_outstanding || lg_setup_errors) {
+        fprintf(stderr, "Setup failed (%ld unanswered, %ld errors)\n", lg_outstanding, lg_setup_errors);
+        return 1;
+    }
+    printf("setup: %d pairs, %ld users in %.2f s\n", pairs, users, (lg_now()-t_setup)/1e9);
+
+    // Rodada medida: o k-ésimo comando sai em t0 + k/rate, em rodízio pelos pares
+    int64_t t0 = lg_now();
+    int64_t end = t0 + (int64_t)secs*1000000000ll;
+    int64_t lag_max = 0;
+    long k = 0;
+    while (1) {
+        int64_t now = lg_now();
+        int64_t next = t0 + (int64_t)(k*1e9/rate);
+        while (next<=now && next<end) {
+            lg_issue((int)(k%pairs), next, w, wsum, users);
+            if (now-next>lag_max) lag_max = now-next;
+            next = t0 + (int64_t)(++k*1e9/rate);
+        }
+        lg_flush();
+        if (next>=end) break;
+        // menos de 1 ms até o próximo: não dorme (epoll_wait só tem ms)
+        lg_poll((int)((next-now)/1000000));
+    }
+    lg_drain(end + 5000000000ll);
+    double run = (lg_last_reply>t0 ? lg_last_reply-t0 : 1)/1e9;
+
+    uint64_t done = 0;
+    for (int i=0; i<LG_CMDS; i++) done += lg_hist[i].count;
+    printf("sent %ld in %d s (%.0f/s target), answered %llu (%.0f/s), unanswered %ld, max send lag %.2f ms\n",
+           k, secs, rate, (unsigned long long)done, done/run, lg_outstanding, lag_max/1e6);
+    if (lg_mismatched) printf("%ld replies did not match their command: the columns below are not reliable\n", lg_mismatched);
+    printf("%-8s %10s %8s %9s %9s %9s %9s  (us)\n", "cmd", "count", "errors", "p50", "p99", "p999", "max");
+    for (int i=0; i<LG_CMDS; i++) {
+        Hist* h = &lg_hist[i];
+        if (!h->count) continue;
+        printf("%-8s %10llu %8llu %9llu %9llu %9llu %9llu\n", lg_names[i],
+               (unsigned long long)h->count, (unsigned long long)h->errors,
+               (unsigned long long)hist_pct(h, 0.50), (unsigned long long)hist_pct(h, 0.99),
+               (unsigned long long)hist_pct(h, 0.999), (unsigned long long)h->max);
+    }
+    return 0;
 }
+#endif
@@ -0,0 +1,45 @@
+// Histograma log-linear de latências em microssegundos, usado pelo servidor
+// (REQ_STATS) e pelo loadgen: HIST_SUB faixas por potência de 2 (~6% de erro
+// no percentil). Só funções static: cada programa inclui a sua cópia.
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB      16
+#define HIST_BUCKETS  (40*HIST_SUB)   // até 2^40 us; o que passar cai na última
+typedef struct {
+    uint64_t count;
+    uint64_t errors;     // respostas ERROR(xx)
+    uint64_t max;
+    uint64_t b[HIST_BUCKETS];
+} Hist;
+
+static int hist_idx(uint64_t us){
+    if (us<2*HIST_SUB) return (int)us;
+    int shift = 63-__builtin_clzll(us) - 4;   // 4 = log2(HIST_SUB)
+    int i = shift*HIST_SUB + (int)(us>>shift);
+    return i<HIST_BUCKETS ? i : HIST_BUCKETS-1;
+}
+// Maior valor da faixa i
+static uint64_t hist_top(int i){
+    if (i<2*HIST_SUB) return i;
+    int shift = i/HIST_SUB - 1;
+    return ((uint64_t)(i%HIST_SUB + HIST_SUB + 1)<<shift) - 1;
+}
+static void hist_add(Hist* h, uint64_t us){
+    h->count++;
+    h->b[hist_idx(us)]++;
+    if (us>h->max) h->max = us;
+}
+static uint64_t hist_pct(const Hist* h, double q){
+    if (!h->count) return 0;
+    uint64_t want = (uint64_t)(q*h->count + 0.999999), seen = 0;
+    for (int i=0; i<HIST_BUCKETS; i++) {
+        seen += h->b[i];
+        if (seen>=want) return hist_top(i)<h->max ? hist_top(i) : h->max;
+    }
+    return h->max;
+}
+
+#endif
@@ -1,45 +1,255 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "histogram.h"
+
+// Fora do Linux não há epoll: usa o loop com select()
+#if !defined(__linux__) && !defined(USE_SELECT)
+#define USE_SELECT
+#endif
+
+#ifdef USE_SELECT
+#include <sys/select.h>
+#else
+#include <sys/epoll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_LINKED_FILE   // cabeçalhos >= 6.3: accept/recv multishot e anel de buffers
+#define HAVE_URING               // -U (ver "io_uring" mais abaixo)
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+#endif
 
-#define MAX_CLIENTS   10
-#define MAX_PEERS     1
-#define MAX_USERS     30
+#define MAX_CLIENTS   10   // limite padrão, alterável com -m
+#define MAX_EVENTS    256
+#define MAX_PEERS     16   // SLs ligados a um SU (o SL fala com um SU só)
+#define MAX_REPLICAS  8    // réplicas de leitura ligadas a um SL (-R)
+#define PEER_TIMEOUT  5000 // ms até desistir de uma resposta do peer, alterável com -t
+#define PEER_RETRY    1000 // ms entre tentativas de reconectar ao SU (SL com -L)
+#define MAX_LOC       255  // maior LocId indexado em loc_occ
 #define BUFFER_SIZE   500
+#define RX_INIT_SIZE  4096
+#define RX_MAX_LINE   65536   // linha maior que isso derruba a conexão
+#define PEER_FLUSH    65536   // bytes acumulados para o peer antes de enviar, alterável com -f
+#define TX_HIGH       (1<<20) // fila de saída acima disso => para de ler do cliente
+#define TX_LOW        (1<<16) // ... e volta a ler quando ela cai abaixo disso
+#define MAX_WORKERS   16      // threads no modo -n (cada uma com seu loop e seu shard)
+#define WORKER_BITS   4       // ReqId = (id local << WORKER_BITS) | worker
+#define SNAP_EVERY    1000000 // entradas no WAL antes de um novo snapshot, alterável com -s
+#define REPL_TX_MAX   (256<<20) // réplica com mais que isso na fila é derrubada (ressincroniza ao voltar)
+#define AUTH_CACHE    65536   // entradas do cache de autorização do SL, por worker (potência de 2)
+#define LOG_RING      (1<<20) // bytes do anel de log de cada worker (potência de 2)
+#define LOG_LINE_MAX  4096    // linha de log maior que isso é cortada
+#define LOG_IDLE_MS   5       // a thread de log dorme isso quando não há nada para gravar
+#define SUB_QUEUE     1024    // eventos (UIDs distintos) esperando um assinante lento
+#define SUB_TX_MAX    TX_LOW  // saída do assinante acima disso => os eventos esperam na fila
+#define HIST_MB       64      // MB do histórico de movimentos do SL, alterável com -H
+#define HIST_BLOCK    4096    // transições por bloco do histórico
+#define HIST_BLOOM    32768   // bits do Bloom de UIDs de cada bloco (potência de 2, ~3% de falso positivo)
+#define HIST_HITS_MAX 100000  // transições numa resposta de histórico (mais que isso: " MORE")
+#define UR_ENTRIES    1024    // -U: SQEs do anel de cada worker
+#define UR_BUFS       512     // -U: buffers de recepção do anel de cada worker (potência de 2)
+#define UR_BUF_SIZE   4096
+#define UR_ACCEPT_RETRY 100   // -U: ms até rearmar o accept que falhou (EMFILE...)
 
 static int is_su = 0;  // 1 => Servidor de Usuários (SU), 0 => Servidor de Localização (SL)
 
+// Modo -n N: N threads, cada uma com seu loop de eventos, seus clientes e o
+// shard das tabelas dos UIDs que hash para ela. O que é por thread é __thread.
+// O worker 0 (thread principal) é o único que fala com o peer e lê o teclado.
+static int n_workers = 1;
+static __thread int worker_id = 0;
+
 // ----------------- Estruturas de dados
-// SU: [uid, is_special]
+// UIDs têm sempre 10 dígitos: viram inteiro (< UID_LIMIT) na borda do
+// protocolo e só voltam a ser texto nas respostas.
+#define UID_LIMIT  10000000000ull
+
+// SU: [uid, is_special, loc], um vetor por campo
+static __thread uint64_t* su_uids    = NULL;
+static __thread uint64_t* su_special = NULL;   // bitset, bit i = is_special do usuário i
+static __thread int16_t*  su_loc     = NULL;   // último local pedido ao SL: 0 => desconhecido, -1 => fora
+static __thread int su_count = 0;
+static __thread int su_cap   = 0;              // múltiplo de 64
+
+// SL: [uid, location], um vetor por campo
+static __thread uint64_t* sl_uids    = NULL;
+static __thread uint8_t*  sl_loc     = NULL;   // 0 => sem local, senão [1..MAX_LOC]
+static __thread int32_t*  sl_loc_pos = NULL;   // posição em loc_occ[sl_loc], -1 se não indexado
+static __thread int sl_count = 0;
+static __thread int sl_cap   = 0;
+
+// SL: ocupantes de cada local (posições nos vetores do SL), mantidos pelo REQ_LOCREG.
+// Remoção O(1) trocando com o último, então a ordem não é preservada.
+typedef struct {
+    int* recs;
+    int  count;
+    int  cap;
+} LocOccupants;
+static __thread LocOccupants loc_occ[MAX_LOC+1];
+// Cópia das contagens de loc_occ para o REQ_LOCCOUNT: cada worker só escreve
+// na sua linha, quem responde soma as linhas sem passar pelos shards
+static atomic_int loc_counts[MAX_WORKERS][MAX_LOC+1];
+
+// Índice hash (endereçamento aberto, sondagem linear) uid -> posição no vetor.
+// Cada slot guarda os dois num inteiro: uid << SLOT_IDX_BITS | (posição+1);
+// 0 => slot vazio. A comparação não sai do slot.
+#define SLOT_IDX_BITS  30
+#define SLOT_IDX_MASK  ((1ull<<SLOT_IDX_BITS)-1)
+typedef struct {
+    uint64_t* slots;
+    uint32_t  cap;    // potência de 2
+    uint32_t  count;
+} UidIndex;
+static __thread UidIndex su_index;
+static __thread UidIndex sl_index;
+
+// Buffer circular de recepção por conexão: guarda linhas incompletas
+// entre leituras e cresce quando enche
+typedef struct {
+    char*  data;
+    size_t cap;    // potência de 2
+    size_t head;   // início dos dados válidos
+    size_t len;
+} RxBuf;
+
+// Fila de saída por conexão: acumula mensagens e guarda o que o socket
+// (não bloqueante) ainda não aceitou
 typedef struct {
-    char uid[11];
-    int  is_special; // 0 ou 1
-} SU_User;
-static SU_User su_users[MAX_USERS];
-static int su_count = 0;
+    char*  data;
+    size_t cap;
+    size_t off;    // já enviado
+    size_t len;    // fim dos dados
+} TxBuf;
 
-// SL: [uid, location]
+// Peers: o SU aceita vários SLs, cada um dono de uma faixa de locais (-L);
+// o SL fala com um SU só. Só o worker 0 mexe nesta tabela.
 typedef struct {
-    char uid[11];
-    int  location;   // -1 ou [1..10]
-} SL_Record;
-static SL_Record sl_records[MAX_USERS];
-static int sl_count = 0;
-
-// Peer
-static int peer_sockets[MAX_PEERS];
+    int   sock;          // -1 => slot livre
+    int   id;
+    RxBuf rx;
+    TxBuf tx;            // mensagens da iteração do loop, saem juntas
+    int   want_write;
+    int   rx_bin;        // o peer já manda quadros binários
+    int   tx_bin;        // já mandamos quadros binários
+    int   auth_inv;      // SU: o SL guarda autorizações e quer o AUTHINV
+} Peer;
+static Peer peers[MAX_PEERS];
 static int peer_count = 0;
+static atomic_int peer_up;   // peers conectados, lido pelos outros workers
+#define PEER_ANY  -1         // SL: o SU, seja qual for o slot
+
+// SU: faixa de locais de cada SL, lida pelos outros workers para rotear.
+// 0 => slot sem SL; senão ROUTE_UP | lo<<8 | hi (locais cabem em 8 bits)
+#define ROUTE_UP  (1u<<16)
+static atomic_uint peer_route[MAX_PEERS];
 
-// Clientes
-static int client_sockets[MAX_CLIENTS];
-static int client_ids[MAX_CLIENTS];
-static int client_locs[MAX_CLIENTS];
-static int next_client_id = 2;
+// SL: faixa de locais deste servidor (-L); sem -L atende todos
+static int loc_lo = 1, loc_hi = MAX_LOC;
+static int loc_range_set = 0;
+static int64_t peer_retry_at = 0;   // SL com -L: próxima tentativa de conectar ao SU
+
+// Réplicas de leitura do SL: o primário (-R ReplPort) manda cada mudança de
+// local com um seq; a réplica (-r) aplica e atende REQ_USRLOC. Só o worker 0.
+typedef struct {
+    int      sock;       // -1 => slot livre
+    int      gen;        // muda a cada conexão: partes do estado de uma anterior são descartadas
+    RxBuf    rx;
+    TxBuf    tx;
+    int      want_write;
+    int      syncing;    // primário: partes do estado inicial que faltam (uma por worker)
+    uint64_t sync_seq;   // primário: seq em que o estado inicial foi tirado
+    TxBuf    hold;       // primário: mudanças que chegaram durante a sincronização
+} Replica;
+static Replica  replicas[MAX_REPLICAS];
+static int      repl_count = 0;
+static int      repl_listen_sock = -1;
+static int      is_replica = 0;   // -r: a PeerPort é a porta -R do primário
+static Replica  repl_up;          // réplica: conexão com o primário
+static uint64_t repl_seq = 0;     // primário: última mudança numerada; réplica: última aplicada
+
+static size_t peer_flush_bytes = PEER_FLUSH;
+static int peer_bin_wanted = 0;  // -b: pede o modo binário ao conectar (ver process_peer_line)
+
+// Quadro binário: [len u16][opcode u8][campos], len conta opcode+campos.
+// Inteiros em little-endian; UID como u64, local como i16, ReqId como u32.
+enum {
+    PB_REQ_LOCREG  = 1,   // uid, loc, rid
+    PB_RES_LOCREG  = 2,   // uid, oldLoc, rid, seq u64 (peer antigo não manda)
+    PB_REQ_USRAUTH = 3,   // uid, rid
+    PB_RES_USRAUTH = 4,   // spec u8, rid
+    PB_REQ_DISCPEER= 5,
+    PB_OK_DISC     = 6,
+    PB_AUTH_CACHE  = 7,   // SU: vai mandar AUTHINV
+    PB_AUTH_INV    = 8,   // uid: o is_special mudou
+};
+#define PEER_MSG_MAX  64
+
+// Resposta guardada até as anteriores do mesmo cliente saírem
+typedef struct HeldReply {
+    struct HeldReply* next;
+    uint32_t seq;
+    size_t   len;
+    char     data[];
+} HeldReply;
+
+// Clientes: tabela indexada pelo próprio fd, cresce sob demanda
+typedef struct {
+    int in_use;
+    int id;
+    int loc;
+    int paused;      // fila de saída passou de TX_HIGH: não lê mais
+    int want_write;  // esperando o socket aceitar escrita
+    int dirty;       // tem saída nova para enviar no fim da iteração
+    RxBuf rx;
+    TxBuf tx;
+    // Respostas assíncronas (SU, outros shards) voltam fora de ordem:
+    // cada comando leva um seq e a resposta espera a vez em held
+    uint32_t seq_next;
+    uint32_t seq_out;
+    HeldReply* held;
+    int      closing;    // REQ_DISC: fecha quando sair a última resposta (o OK(01))
+    struct ImportBatch* import;   // REQ_USRIMPORT <N>: linhas de dados ainda chegando
+    int      importing;  // REQ_USRIMPORT <arquivo> em andamento: as linhas seguintes esperam
+    // -U: o recv multishot e o envio em andamento no io_uring
+    uint32_t ur_gen;     // distingue conclusões de uma conexão anterior no mesmo fd
+    int      ur_recv;    // 0 => sem recv no anel, 1 => armado, 2 => cancelando (pausa)
+    struct UrSend* ur_send;
+    // REQ_SUBSCRIBE: eventos que esperam a saída esvaziar
+    int      subs;       // já assinou algo: ao sair, os workers esquecem o cliente
+    uint64_t evt_last;   // id do último evento entregue (o mesmo evento por duas assinaturas)
+    struct SubQueue* subq;
+} Client;
+
+static __thread Client* clients = NULL;
+static __thread int clients_cap = 0;
+static atomic_int client_count;     // somando todos os workers
+static int max_clients = MAX_CLIENTS;
+static atomic_int next_client_id = 2;
+
+// Clientes com saída nova nesta iteração do loop
+static __thread int* dirty_fds = NULL;
+static __thread int  dirty_count = 0;
+static __thread int  dirty_cap   = 0;
 
 // Adiciona variáveis para faixas de ID de clientes e peers
 static int su_next_client_id=2;
@@ -47,497 +257,5324 @@ static int sl_next_client_id=14;
 static int su_next_peer_id=9;
 static int sl_next_peer_id=5;
 static int next_peer_id=0;
-static int peer_id = 0;
 
-static int  g_pending_inspect_in_use = 0;
-static char g_pending_inspect_uid[11];
-static int  g_pending_inspect_loc = -1;
-static int  g_pending_inspect_sock = 0;
+// Para onde vai a resposta de um comando: o cliente pode estar em outro worker
+typedef struct {
+    int worker;
+    int sock;
+    int client_id;       // confere que o socket ainda é do mesmo cliente
+    int loc;             // local do cliente (REQ_CONN)
+    uint32_t seq;        // ordem do comando na conexão (-n)
+    int      kind;       // ST_* do comando (métricas)
+    int64_t  t0;         // ns em que o comando chegou (métricas)
+} ReplyTo;
+
+// Comando de cliente já reconhecido e com os argumentos convertidos
+// (cmd_parse); é isso que vai para o shard dono do UID
+enum {
+    CMD_UNKNOWN, CMD_CONN, CMD_DISC, CMD_STATS, CMD_USRADD, CMD_USRACCESS, CMD_USRLOC,
+    CMD_LOCLIST, CMD_USRIMPORT, CMD_LOCCOUNT, CMD_SUBSCRIBE, CMD_UNSUBSCRIBE,
+    CMD_USRHIST, CMD_LOCHIST, CMD_N
+};
+typedef struct {
+    uint8_t  op;         // CMD_*
+    uint8_t  bad;        // argumentos inválidos: o comando responde seu ERROR
+    uint8_t  has_uid;    // uid válido (decide o shard)
+    uint8_t  flag;       // REQ_USRADD: is_special; REQ_USRACCESS: "in"
+    uint8_t  want_seq;   // REQ_USRACCESS ... seq
+    int32_t  num;        // REQ_CONN/REQ_LOCLIST/REQ_SUBSCRIBE LOC/REQ_LOCHIST: LocId; REQ_USRIMPORT: linhas (-1: arquivo)
+    uint16_t arg;        // posição do primeiro argumento na linha
+    uint64_t uid;
+    uint64_t seq;        // REQ_USRLOC <UID> <Seq>
+    int64_t  t1, t2;     // REQ_USRHIST/REQ_LOCHIST: janela em ms (epoch)
+} Cmd;
+
+// Requisições aguardando resposta do peer, na posição id & (cap-1).
+// Os ids são sequenciais, então só há colisão quando a tabela está cheia.
+// Todas usam o mesmo prazo, então a ordem dos ids é a ordem dos prazos.
+#define PENDING_ID_MASK  (UINT32_MAX>>WORKER_BITS)
+typedef struct {
+    uint32_t id;         // 0 => slot livre
+    ReplyTo  to;
+    uint64_t uid;
+    int      arg;        // SL: local do inspect; SU: SL dono do local novo (-1 => saída)
+    int      op;         // SL: comando que espera a autorização (CMD_LOCLIST, CMD_SUBSCRIBE, CMD_LOCHIST)
+    int64_t  t1, t2;     // SL: janela do REQ_LOCHIST
+    uint32_t peers;      // SU: bit de cada SL que ainda não respondeu
+    int      result;     // SU: local antigo informado pelos SLs
+    int      want_seq;   // SU: o cliente pediu o seq da mudança
+    uint64_t seq;        // SU: seq da mudança no SL dono; réplica: seq que a leitura espera
+    int64_t  deadline;   // ms (relógio monotônico)
+    int64_t  sent;       // ns do pedido (RTT do peer)
+} Pending;
+typedef struct {
+    Pending* slots;
+    uint32_t cap;        // potência de 2
+    uint32_t count;
+    uint32_t next_id;
+    uint32_t first_id;   // nenhum id menor que este está pendente
+} PendingTable;
+typedef void (*PendingFail)(const Pending* p);
+
+static __thread PendingTable su_uar;        // SU: REQ_USRACCESS esperando RES_LOCREG
+static __thread PendingTable sl_inspects;   // SL: REQ_LOCLIST/REQ_SUBSCRIBE LOC esperando RES_USRAUTH
+static __thread PendingTable repl_waits;    // réplica: REQ_USRLOC esperando o seq chegar
+static int peer_timeout_ms = PEER_TIMEOUT;
+
+// Métricas: contadores e histogramas de latência por worker, sem atomics
+// (cada worker só escreve nos seus). stats, REQ_STATS e -S juntam os de
+// todos os workers por mensagem, como o inspect junta os ocupantes.
+enum {
+    ST_CONN, ST_DISC, ST_USRADD, ST_USRACCESS, ST_USRLOC, ST_LOCLIST, ST_STATS, ST_USRIMPORT,
+    ST_LOCCOUNT, ST_SUBSCRIBE, ST_USRHIST, ST_LOCHIST, ST_OTHER,
+    ST_RTT_LOCREG,       // SU: REQ_LOCREG até o último RES_LOCREG
+    ST_RTT_USRAUTH,      // SL: REQ_USRAUTH até o RES_USRAUTH
+    ST_KINDS
+};
+static const char* st_names[ST_KINDS] = {
+    "REQ_CONN", "REQ_DISC", "REQ_USRADD", "REQ_USRACCESS", "REQ_USRLOC", "REQ_LOCLIST",
+    "REQ_STATS", "REQ_USRIMPORT", "REQ_LOCCOUNT", "REQ_SUBSCRIBE",
+    "REQ_USRHIST", "REQ_LOCHIST", "other", "REQ_LOCREG", "REQ_USRAUTH"
+};
+typedef struct {
+    Hist     h[ST_KINDS];
+    uint64_t peer_failures;   // pedidos ao peer sem resposta a tempo (ou o peer caiu)
+    uint64_t repl_timeouts;   // réplica: leituras que desistiram de esperar o seq
+    uint64_t auth_hits;       // SL: inspects autorizados pelo cache
+    uint64_t evt_sent, evt_merged, evt_lost;   // SL: eventos das assinaturas
+    // medidos na hora da coleta
+    int64_t  clients, paused, client_txq, client_txq_max;
+    int64_t  su_uar, inspects, repl_waits;
+    int64_t  peers, peer_txq, replicas, replica_txq;
+    int64_t  hist_events, hist_bytes;
+} Stats;
+static __thread Stats wstats;
+enum { STATS_REPLY, STATS_STDIN, STATS_PERIODIC };   // para onde vão as métricas juntadas
+
+// Log assíncrono: cada worker formata no seu anel (um produtor, um
+// consumidor) e a thread de log grava em lote. Anel cheio => a linha é
+// descartada e contada; o loop nunca espera pelo disco ou pelo pipe.
+enum { LOG_OUT = -1, LOG_ERROR, LOG_INFO, LOG_TRACE };   // LOG_OUT: resposta ao teclado, sempre sai
+static const char* log_names[] = { "error", "info", "trace" };
+typedef struct {
+    char*          buf;
+    _Atomic size_t head;      // só o worker avança
+    _Atomic size_t tail;      // só a thread de log avança
+    atomic_ulong   dropped;
+} LogRing;
+#define LOG_REC_ERR  (1u<<31)   // no cabeçalho (u32 tamanho) da linha: vai para o stderr
+static _Atomic(LogRing*) log_rings[MAX_WORKERS];
+static atomic_int log_level  = LOG_TRACE;   // -v / "log" no teclado
+static atomic_int log_sample = 1;           // "< linha" de 1 a cada log_sample comandos
+static atomic_int log_running;
+static atomic_int log_stop;
+static atomic_ulong log_dropped;            // total de linhas descartadas (anel cheio)
+static int        log_fd = STDOUT_FILENO;   // -o
+static pthread_t  log_tid;
+static __thread unsigned log_trace_n;
+
+// SL: resultados de REQ_USRAUTH, por worker, em mapeamento direto por uid_hash.
+// Entrada = (uid<<1 | spec) + 1; 0 => vazia. Só vale enquanto o SU conectado
+// manda AUTHINV a cada mudança de is_special: auth_cache_gen muda a cada
+// AUTHCACHE (0 => sem cache). O worker só passa para a geração nova quando o
+// AUTHCACHE chega pela sua fila, depois dos RES_USRAUTH que vieram antes dele.
+static __thread uint64_t* auth_cache = NULL;
+static __thread int auth_cache_mine = 0;
+static atomic_int auth_cache_gen;
+static int auth_gen_next = 0;
+
+// Persistência (-d DataDir): WAL e snapshot por worker
+static const char* data_dir = NULL;
+static const char* import_dir = NULL;   // -I: REQ_USRIMPORT <arquivo> só lê daqui
+static long snap_every = SNAP_EVERY;
+static __thread int   wal_fd = -1;
+static __thread TxBuf wal_buf;        // entradas desta iteração (group commit)
+static __thread long  wal_records;    // entradas no WAL desde o último snapshot
+static __thread struct ShardMsg* outbox;       // mensagens para outros workers esperando o fsync
+static __thread struct ShardMsg* outbox_last;
+static atomic_int persist_reshard;    // algum WAL não vazio ou o -n mudou
+static pthread_barrier_t persist_barrier;
+
+// ----------------- Declarações de funções
+int  find_su_user(uint64_t uid);
+int  find_sl_record(uint64_t uid);
+int  su_user_add(uint64_t uid, int is_special);
+int  sl_record_add(uint64_t uid, int location);
+void sl_set_location(int idx, int location);
+
+void handle_client_message(int client_sock);
+static void wal_commit(void);
+void process_client_line(int client_sock, char* line);
+void exec_client_cmd(const ReplyTo* to, const Cmd* c);
+static void sl_authorized(const ReplyTo* to, int spec, int op, int locId, int64_t t1, int64_t t2);
+static void stats_gather_start(const ReplyTo* to, int mode);
+static void import_begin(int c_idx, const ReplyTo* to, const Cmd* c, const char* line);
+static void import_line(int c_idx, const char* line);
+static void import_free(struct ImportBatch* b);
+static void import_step(void);
+static __thread int import_nfiles;   // REQ_USRIMPORT <arquivo> em leitura neste worker
+
+void handle_peer_message(int p);
+void process_peer_line(int p, char* line);
+void process_peer_frame(int p, const uint8_t* f, size_t len);
+
+int  get_client_index_by_socket(int sock);
+int  add_client(int sock);
+void close_and_remove_client(int sock);
+
+void send_req_discpeer_and_exit();  // kill
+
+// io_uring (-U), na seção "io_uring"
+static __thread int ur_on = 0;   // este worker está no io_uring
+static void ur_recv_arm(int sock);
+static void ur_send_start(int sock);
+static void ur_client_close(int sock);
+
+// Assinaturas (REQ_SUBSCRIBE), na seção "Assinaturas"
+static void sub_flush(int sock);
+static void sub_client_gone(int sock);
+
+// ----------------------------------------------------
+// Loop de eventos: epoll edge-triggered ou, com -DUSE_SELECT, select()
+static void ev_init(void);
+static int  ev_add(int fd, int edge);
+static void ev_del(int fd);
+static void ev_set_write(int fd, int on);
+static void ev_set_read(int fd, int on);
+static int  ev_wait(int* ready, int max, int timeout_ms);
+
+#ifdef USE_SELECT
+static __thread fd_set ev_fds;
+static __thread fd_set ev_wfds;
+static __thread fd_set ev_rpaused;   // clientes pausados: fora da leitura
+static __thread int    ev_npaused;
+static __thread int    ev_max_fd = -1;
+
+static void ev_init(void){
+    FD_ZERO(&ev_fds);
+    FD_ZERO(&ev_wfds);
+    FD_ZERO(&ev_rpaused);
+}
+static int ev_add(int fd, int edge){
+    (void)edge;
+    if (fd>=FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+    FD_SET(fd, &ev_fds);
+    if (fd>ev_max_fd) ev_max_fd = fd;
+    return 0;
+}
+static void ev_del(int fd){
+    if (fd<0 || fd>=FD_SETSIZE) return;
+    ev_set_read(fd, 1);
+    FD_CLR(fd, &ev_fds);
+    FD_CLR(fd, &ev_wfds);
+    while (ev_max_fd>=0 && !FD_ISSET(ev_max_fd, &ev_fds)) ev_max_fd--;
+}
+static void ev_set_write(int fd, int on){
+    if (fd<0 || fd>=FD_SETSIZE) return;
+    if (on) FD_SET(fd, &ev_wfds);
+    else    FD_CLR(fd, &ev_wfds);
+}
+// select() é level-triggered: um cliente pausado com entrada não lida
+// faria o loop girar sem parar
+static void ev_set_read(int fd, int on){
+    if (fd<0 || fd>=FD_SETSIZE) return;
+    int paused = FD_ISSET(fd, &ev_rpaused)!=0;
+    if (paused==!on) return;
+    if (on) {
+        FD_CLR(fd, &ev_rpaused);
+        ev_npaused--;
+    } else {
+        FD_SET(fd, &ev_rpaused);
+        ev_npaused++;
+    }
+}
+static int ev_wait(int* ready, int max, int timeout_ms){
+    fd_set readfds  = ev_fds;
+    fd_set writefds = ev_wfds;
+    for (int fd=0; ev_npaused && fd<=ev_max_fd; fd++)
+        if (FD_ISSET(fd, &ev_rpaused)) FD_CLR(fd, &readfds);
+    struct timeval tv = { timeout_ms/1000, (timeout_ms%1000)*1000 };
+    int activity = select(ev_max_fd+1, &readfds, &writefds, NULL, timeout_ms<0 ? NULL : &tv);
+    if (activity<0) return -1;
+    int n = 0;
+    for (int fd=0; fd<=ev_max_fd && n<max; fd++) {
+        if (FD_ISSET(fd, &readfds) || FD_ISSET(fd, &writefds)) ready[n++] = fd;
+    }
+    return n;
+}
+#else
+static __thread int ev_epfd = -1;
+
+static void ev_init(void){
+    ev_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev_epfd<0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+}
+static int ev_add(int fd, int edge){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN | (edge ? EPOLLET|EPOLLRDHUP : 0);
+    ev.data.fd = fd;
+    return epoll_ctl(ev_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+static void ev_del(int fd){
+    epoll_ctl(ev_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+// Só para fds edge-triggered (clientes e peer)
+static void ev_set_write(int fd, int on){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN | EPOLLET | EPOLLRDHUP | (on ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    epoll_ctl(ev_epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+// Edge-triggered: o cliente pausado não volta a ser avisado, nada a fazer
+static void ev_set_read(int fd, int on){
+    (void)fd;
+    (void)on;
+}
+static int ev_wait(int* ready, int max, int timeout_ms){
+    struct epoll_event evs[MAX_EVENTS];
+    if (max>MAX_EVENTS) max = MAX_EVENTS;
+    int n = epoll_wait(ev_epfd, evs, max, timeout_ms);
+    for (int i=0; i<n; i++) ready[i] = evs[i].data.fd;
+    return n;
+}
+#endif
+
+static int64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// ----------------------------------------------------
+// Log assíncrono
+static void ring_copy_in(char* ring, size_t pos, const void* src, size_t n){
+    size_t off = pos & (LOG_RING-1);
+    size_t first = n<LOG_RING-off ? n : LOG_RING-off;
+    memcpy(ring+off, src, first);
+    memcpy(ring, (const char*)src+first, n-first);
+}
+static void ring_copy_out(void* dst, const char* ring, size_t pos, size_t n){
+    size_t off = pos & (LOG_RING-1);
+    size_t first = n<LOG_RING-off ? n : LOG_RING-off;
+    memcpy(dst, ring+off, first);
+    memcpy((char*)dst+first, ring, n-first);
+}
+
+static int write_all(int fd, const void* buf, size_t len){
+    const char* p = buf;
+    while (len) {
+        ssize_t w = write(fd, p, len);
+        if (w<0) {
+            if (errno==EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+// Põe a linha (já com \n) no anel do worker; sem a thread de log (partida, bench) grava direto
+static void log_put(int to_err, const char* s, size_t n){
+    if (!atomic_load_explicit(&log_running, memory_order_acquire) || n>LOG_RING/2) {
+        write_all(to_err ? STDERR_FILENO : log_fd, s, n);
+        return;
+    }
+    LogRing* r = atomic_load_explicit(&log_rings[worker_id], memory_order_relaxed);
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r || !(r->buf = malloc(LOG_RING))) {
+            free(r);
+            return;
+        }
+        atomic_store_explicit(&log_rings[worker_id], r, memory_order_release);
+    }
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (LOG_RING-(head-tail) < 4+n) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    uint32_t h = (uint32_t)n | (to_err ? LOG_REC_ERR : 0);
+    ring_copy_in(r->buf, head, &h, 4);
+    ring_copy_in(r->buf, head+4, s, n);
+    atomic_store_explicit(&r->head, head+4+n, memory_order_release);
+}
+
+__attribute__((format(printf, 2, 3)))
+static void log_msg(int level, const char* fmt, ...){
+    if (level>atomic_load_explicit(&log_level, memory_order_relaxed)) return;
+    char m[LOG_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(m, sizeof(m), fmt, ap);
+    va_end(ap);
+    if (n<0) return;
+    if ((size_t)n>=sizeof(m)) {
+        n = sizeof(m)-1;
+        m[n-1] = '\n';
+    }
+    log_put(level==LOG_ERROR, m, n);
+}
+
+// "< linha" de cada comando do cliente (LOG_TRACE), 1 a cada log_sample
+static void log_trace_cmd(const char* line){
+    if (atomic_load_explicit(&log_level, memory_order_relaxed)<LOG_TRACE) return;
+    int every = atomic_load_explicit(&log_sample, memory_order_relaxed);
+    if (every>1 && ++log_trace_n % every) return;
+    // sem printf: é o caminho de todo comando
+    char m[LOG_LINE_MAX];
+    size_t n = strnlen(line, sizeof(m)-3);
+    m[0] = '<';
+    m[1] = ' ';
+    memcpy(m+2, line, n);
+    m[n+2] = '\n';
+    log_put(0, m, n+3);
+}
+
+// Thread de log: esvazia os anéis em lotes de até 64 KiB por destino
+static int log_drain(void){
+    static char out[2][65536];
+    static unsigned long dropped;
+    static int64_t dropped_at;
+    size_t len[2] = {0, 0};
+    int any = 0;
+    for (int w=0; w<MAX_WORKERS; w++) {
+        LogRing* r = atomic_load_explicit(&log_rings[w], memory_order_acquire);
+        if (!r) continue;
+        unsigned long d = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        dropped += d;
+        atomic_fetch_add_explicit(&log_dropped, d, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail!=head) any = 1;
+        while (tail!=head) {
+            uint32_t h;
+            ring_copy_out(&h, r->buf, tail, 4);
+            int e = (h & LOG_REC_ERR)!=0;
+            size_t n = h & ~LOG_REC_ERR;
+            if (len[e]+n>sizeof(out[e])) {
+                write_all(e ? STDERR_FILENO : log_fd, out[e], len[e]);
+                len[e] = 0;
+            }
+            ring_copy_out(out[e]+len[e], r->buf, tail+4, n);
+            len[e] += n;
+            tail += 4+n;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    if (len[0]) write_all(log_fd, out[0], len[0]);
+    if (len[1]) write_all(STDERR_FILENO, out[1], len[1]);
+    // descartes: no máximo um aviso por segundo
+    if (dropped && (now_ms()-dropped_at>=1000 || atomic_load(&log_stop))) {
+        char m[64];
+        int n = snprintf(m, sizeof(m), "[log] %lu lines dropped\n", dropped);
+        write_all(STDERR_FILENO, m, n);
+        dropped = 0;
+        dropped_at = now_ms();
+    }
+    return any;
+}
+
+static void* log_thread(void* arg){
+    (void)arg;
+    while (1) {
+        int stop = atomic_load(&log_stop);
+        if (log_drain()) continue;
+        if (stop) return NULL;
+        struct timespec ts = { 0, LOG_IDLE_MS*1000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// No exit(): grava o que ficou nos anéis
+static void log_shutdown(void){
+    if (!atomic_load(&log_running)) return;
+    atomic_store(&log_stop, 1);
+    pthread_join(log_tid, NULL);
+    atomic_store(&log_running, 0);
+}
+
+static void log_start(void){
+    if (pthread_create(&log_tid, NULL, log_thread, NULL)!=0) {
+        perror("pthread_create log");   // segue gravando direto
+        return;
+    }
+    atomic_store(&log_running, 1);
+    atexit(log_shutdown);
+}
+
+// "error|info|trace[:N]" (N: 1 a cada N comandos no trace); -1 se inválido
+static int log_set(const char* spec){
+    int n = (int)strcspn(spec, ": \n");
+    for (int l=LOG_ERROR; l<=LOG_TRACE; l++) {
+        if ((int)strlen(log_names[l])!=n || strncmp(spec, log_names[l], n)!=0) continue;
+        int every = spec[n]==':' ? atoi(spec+n+1) : 1;
+        if (every<1) return -1;
+        atomic_store(&log_level, l);
+        atomic_store(&log_sample, every);
+        return 0;
+    }
+    return -1;
+}
+
+// ----------------------------------------------------
+// Métricas (o histograma está em histogram.h)
+
+// Comando do cliente respondido (msg NULL => resposta montada direto na fila)
+static void stat_done(int kind, int64_t t0, const char* msg){
+    Hist* h = &wstats.h[kind];
+    if (msg && strncmp(msg, "ERROR(", 6)==0) h->errors++;
+    int64_t d = now_ns()-t0;
+    hist_add(h, d>0 ? (uint64_t)d/1000 : 0);
+}
+
+static int set_nonblocking(int fd){
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl<0) return -1;
+    return fcntl(fd, F_SETFL, fl|O_NONBLOCK);
+}
+
+// ----------------------------------------------------
+// Índice hash de UIDs
+static uint32_t uid_hash(uint64_t uid){
+    // hash multiplicativo (Fibonacci): os bits altos do produto
+    return (uint32_t)((uid * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static int uid_index_resize(UidIndex* ix, uint32_t ncap){
+    uint64_t* ns = calloc(ncap, sizeof(uint64_t));
+    if (!ns) return -1;
+    for (uint32_t i=0; i<ix->cap; i++) {
+        if (!ix->slots[i]) continue;
+        uint32_t j = uid_hash(ix->slots[i]>>SLOT_IDX_BITS) & (ncap-1);
+        while (ns[j]) j = (j+1) & (ncap-1);
+        ns[j] = ix->slots[i];
+    }
+    free(ix->slots);
+    ix->slots = ns;
+    ix->cap   = ncap;
+    return 0;
+}
+
+// Garante espaço para n chaves mantendo fator de carga <= 1/2
+static int uid_index_reserve(UidIndex* ix, uint32_t n){
+    uint32_t ncap = ix->cap ? ix->cap : 64;
+    while (ncap/2 < n) ncap *= 2;
+    if (ncap==ix->cap) return 0;
+    return uid_index_resize(ix, ncap);
+}
+
+static int uid_index_find(const UidIndex* ix, uint64_t uid){
+    if (ix->count==0) return -1;
+    uint32_t j = uid_hash(uid) & (ix->cap-1);
+    uint64_t s;
+    while ((s = ix->slots[j])) {
+        if ((s>>SLOT_IDX_BITS)==uid) return (int)(s & SLOT_IDX_MASK) - 1;
+        j = (j+1) & (ix->cap-1);
+    }
+    return -1;
+}
+
+// Slot do uid, para trocar a posição guardada; NULL se não está
+static uint64_t* uid_index_ref(UidIndex* ix, uint64_t uid){
+    if (ix->count==0) return NULL;
+    uint32_t j = uid_hash(uid) & (ix->cap-1);
+    while (ix->slots[j]) {
+        if ((ix->slots[j]>>SLOT_IDX_BITS)==uid) return &ix->slots[j];
+        j = (j+1) & (ix->cap-1);
+    }
+    return NULL;
+}
+
+// Supõe que o uid ainda não está no índice
+static int uid_index_insert(UidIndex* ix, uint64_t uid, int idx){
+    if ((uint64_t)idx+1>SLOT_IDX_MASK) return -1;
+    if (uid_index_reserve(ix, ix->count+1)<0) return -1;
+    uint32_t j = uid_hash(uid) & (ix->cap-1);
+    while (ix->slots[j]) j = (j+1) & (ix->cap-1);
+    ix->slots[j] = uid<<SLOT_IDX_BITS | (uint64_t)(idx+1);
+    ix->count++;
+    return 0;
+}
+
+// ----------------------------------------------------
+// Cache de autorização do SL
+// Geração atual do cache deste worker; 0 => cache desligado ou ainda da
+// geração anterior (o AUTHCACHE não chegou aqui)
+static int auth_cache_ready(void){
+    int g = atomic_load(&auth_cache_gen);
+    return g==auth_cache_mine ? g : 0;
+}
+// AUTHCACHE chegou a este worker: esvazia e passa para a geração g
+static void auth_cache_reset(int g){
+    if (auth_cache) memset(auth_cache, 0, AUTH_CACHE*sizeof(uint64_t));
+    auth_cache_mine = g;
+}
+// is_special guardado do uid; -1 se não está no cache
+static int auth_cache_get(uint64_t uid){
+    if (!auth_cache_ready() || !auth_cache) return -1;
+    uint64_t e = auth_cache[uid_hash(uid) & (AUTH_CACHE-1)];
+    if (!e || (e-1)>>1!=uid) return -1;
+    return (int)((e-1) & 1);
+}
+static void auth_cache_put(uint64_t uid, int spec){
+    if (!auth_cache_ready()) return;
+    if (!auth_cache && !(auth_cache = calloc(AUTH_CACHE, sizeof(uint64_t)))) return;
+    auth_cache[uid_hash(uid) & (AUTH_CACHE-1)] = (uid<<1 | (uint64_t)(spec!=0)) + 1;
+}
+static void auth_cache_drop(uint64_t uid){
+    if (auth_cache_get(uid)>=0) auth_cache[uid_hash(uid) & (AUTH_CACHE-1)] = 0;
+}
+
+// Cresce um vetor de registros (dobra a capacidade)
+static int grow_array(void** arr, int* cap, int need, size_t elem){
+    if (need<=*cap) return 0;
+    int ncap = *cap ? *cap : 64;
+    while (ncap<need) ncap *= 2;
+    void* n = realloc(*arr, (size_t)ncap*elem);
+    if (!n) return -1;
+    *arr = n;
+    *cap = ncap;
+    return 0;
+}
+
+// ----------------------------------------------------
+// Tabela de requisições pendentes
+static int pending_resize(PendingTable* pt, uint32_t ncap){
+    while (1) {
+        Pending* ns = calloc(ncap, sizeof(Pending));
+        if (!ns) return -1;
+        uint32_t i;
+        for (i=0; i<pt->cap; i++) {
+            Pending* p = &pt->slots[i];
+            if (!p->id) continue;
+            if (ns[p->id & (ncap-1)].id) break;
+            ns[p->id & (ncap-1)] = *p;
+        }
+        if (i<pt->cap) {
+            // dois ids ainda colidem: tenta o dobro
+            free(ns);
+            ncap *= 2;
+            continue;
+        }
+        free(pt->slots);
+        pt->slots = ns;
+        pt->cap   = ncap;
+        return 0;
+    }
+}
+
+// Registra uma requisição cuja resposta vai para to, esperando os SLs do
+// bitmask peers; retorna o ReqId que vai no protocolo, com o worker nos
+// bits baixos (0 => sem memória)
+static uint32_t pending_add(PendingTable* pt, const ReplyTo* to, uint64_t uid, int arg, uint32_t peers){
+    if (!pt->next_id) pt->next_id = pt->first_id = 1;
+    uint32_t id = pt->next_id;
+    if (!pt->cap || pt->slots[id & (pt->cap-1)].id) {
+        if (pending_resize(pt, pt->cap ? pt->cap*2 : 64)<0) return 0;
+    }
+    Pending* p = &pt->slots[id & (pt->cap-1)];
+    p->id        = id;
+    p->to        = *to;
+    p->uid       = uid;
+    p->arg       = arg;
+    p->peers     = peers;
+    p->result    = -1;
+    p->want_seq  = 0;
+    p->seq       = 0;
+    p->sent      = now_ns();
+    p->deadline  = p->sent/1000000 + peer_timeout_ms;
+    pt->count++;
+    if (!(pt->next_id = (pt->next_id+1) & PENDING_ID_MASK)) pt->next_id = 1;
+    return id<<WORKER_BITS | worker_id;
+}
+
+// Remove a requisição id (local) e copia para *out; -1 se não existe
+static int pending_take_id(PendingTable* pt, uint32_t id, Pending* out){
+    if (!id || !pt->cap) return -1;
+    Pending* p = &pt->slots[id & (pt->cap-1)];
+    if (p->id!=id) return -1;
+    *out = *p;
+    p->id = 0;
+    pt->count--;
+    return 0;
+}
+// O mesmo, pelo ReqId do protocolo
+static int pending_take(PendingTable* pt, uint32_t rid, Pending* out){
+    return pending_take_id(pt, rid>>WORKER_BITS, out);
+}
+// Requisição do ReqId sem removê-la; NULL se não existe
+static Pending* pending_find(PendingTable* pt, uint32_t rid){
+    uint32_t id = rid>>WORKER_BITS;
+    if (!id || !pt->cap) return NULL;
+    Pending* p = &pt->slots[id & (pt->cap-1)];
+    return p->id==id ? p : NULL;
+}
+
+// Avança first_id até o pedido pendente mais antigo; NULL se não há nenhum
+static Pending* pending_oldest(PendingTable* pt){
+    while (pt->count && pt->first_id!=pt->next_id) {
+        Pending* p = &pt->slots[pt->first_id & (pt->cap-1)];
+        if (p->id==pt->first_id) return p;
+        if (!(pt->first_id = (pt->first_id+1) & PENDING_ID_MASK)) pt->first_id = 1;
+    }
+    return NULL;
+}
+
+// Peer antigo responde sem id: as respostas chegam na ordem dos pedidos
+static int pending_take_oldest(PendingTable* pt, Pending* out){
+    Pending* p = pending_oldest(pt);
+    return p ? pending_take_id(pt, p->id, out) : -1;
+}
+
+// Falha os pedidos com prazo vencido (ou todos, com now<0)
+static void pending_expire(PendingTable* pt, int64_t now, PendingFail fail){
+    Pending* p;
+    while ((p = pending_oldest(pt)) && (now<0 || p->deadline<=now)) {
+        Pending old;
+        pending_take_id(pt, p->id, &old);
+        fail(&old);
+    }
+}
+
+// Falha os pedidos que esperam o SL p (que caiu)
+static void pending_fail_peer(PendingTable* pt, int p, PendingFail fail){
+    for (uint32_t i=0; i<pt->cap && pt->count; i++) {
+        Pending old;
+        if (!pt->slots[i].id || !(pt->slots[i].peers & 1u<<p)) continue;
+        pending_take_id(pt, pt->slots[i].id, &old);
+        fail(&old);
+    }
+}
+
+// ms até o próximo prazo vencer; -1 se não há pedido pendente
+static int pending_next_timeout(PendingTable* pt, int64_t now){
+    Pending* p = pending_oldest(pt);
+    if (!p) return -1;
+    return p->deadline>now ? (int)(p->deadline-now) : 0;
+}
+
+// ----------------------------------------------------
+// Buffer de recepção
+static void rx_free(RxBuf* rb){
+    free(rb->data);
+    memset(rb, 0, sizeof(*rb));
+}
+
+// Copia os dados para um buffer novo de capacidade ncap, já linearizados
+static int rx_realloc(RxBuf* rb, size_t ncap){
+    char* nd = malloc(ncap);
+    if (!nd) return -1;
+    size_t first = rb->cap - rb->head;
+    if (first>rb->len) first = rb->len;
+    if (rb->len) {
+        memcpy(nd, rb->data+rb->head, first);
+        memcpy(nd+first, rb->data, rb->len-first);
+    }
+    free(rb->data);
+    rb->data = nd;
+    rb->cap  = ncap;
+    rb->head = 0;
+    return 0;
+}
+
+// Lê do socket para o espaço livre; dobra o buffer se estiver cheio.
+// Retorna como recv(): bytes lidos, 0 (fechou) ou -1 (errno)
+static ssize_t rx_recv(int fd, RxBuf* rb){
+    if (rb->len==rb->cap) {
+        size_t ncap = rb->cap ? rb->cap*2 : RX_INIT_SIZE;
+        if (ncap>2*RX_MAX_LINE || rx_realloc(rb, ncap)<0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+    size_t tail  = (rb->head + rb->len) & (rb->cap-1);
+    size_t space = (tail>=rb->head) ? rb->cap-tail : rb->head-tail;
+    if (rb->len==0) {
+        // vazio: recomeça do início, evitando linhas partidas na volta do anel
+        rb->head = tail = 0;
+        space = rb->cap;
+    }
+    ssize_t n = recv(fd, rb->data+tail, space, MSG_DONTWAIT);
+    if (n>0) rb->len += n;
+    return n;
+}
+
+static void rx_consume(RxBuf* rb, size_t n){
+    rb->head = (rb->head+n) & (rb->cap-1);
+    rb->len -= n;
+    if (rb->len==0) rb->head = 0;
+}
+
+// Próxima linha completa, terminada em '\0' dentro do próprio buffer.
+// *used recebe quantos bytes consumir depois de processar a linha.
+// NULL se não há linha completa (ou linha grande demais: *used = 0 e errno).
+static char* rx_line(RxBuf* rb, size_t* used){
+    *used = 0;
+    while (rb->len) {
+        size_t first = rb->cap - rb->head;
+        if (first>rb->len) first = rb->len;
+        char* nl = memchr(rb->data+rb->head, '\n', first);
+        if (!nl && first<rb->len) {
+            // linha atravessa o fim do anel: procura no trecho do começo
+            if (!memchr(rb->data, '\n', rb->len-first)) break;
+            if (rx_realloc(rb, rb->cap)<0) return NULL;
+            continue;
+        }
+        if (!nl) break;
+        char* line = rb->data+rb->head;
+        size_t n = nl-line;
+        *nl = '\0';
+        if (n>0 && line[n-1]=='\r') line[n-1] = '\0';
+        if (line[0]=='\0') {
+            // linha vazia
+            rx_consume(rb, n+1);
+            continue;
+        }
+        *used = n+1;
+        return line;
+    }
+    if (rb->len>=RX_MAX_LINE) errno = EMSGSIZE;
+    return NULL;
+}
+
+// ----------------------------------------------------
+// Fila de saída
+static void tx_free(TxBuf* tb){
+    free(tb->data);
+    memset(tb, 0, sizeof(*tb));
+}
+
+static size_t tx_pending(const TxBuf* tb){
+    return tb->len - tb->off;
+}
+
+// Espaço para mais n bytes no fim da fila; NULL sem memória.
+// Quem escreve confirma com tb->len += n.
+static char* tx_reserve(TxBuf* tb, size_t n){
+    if (tb->len+n>tb->cap && tb->off) {
+        // descarta o que já foi enviado antes de crescer
+        memmove(tb->data, tb->data+tb->off, tb->len-tb->off);
+        tb->len -= tb->off;
+        tb->off  = 0;
+    }
+    if (tb->len+n>tb->cap) {
+        size_t ncap = tb->cap ? tb->cap : 4096;
+        while (ncap<tb->len+n) ncap *= 2;
+        char* nd = realloc(tb->data, ncap);
+        if (!nd) return NULL;
+        tb->data = nd;
+        tb->cap  = ncap;
+    }
+    return tb->data+tb->len;
+}
+
+static int tx_append(TxBuf* tb, const void* msg, size_t len){
+    char* p = tx_reserve(tb, len);
+    if (!p) return -1;
+    memcpy(p, msg, len);
+    tb->len += len;
+    return 0;
+}
+
+// Envia o que o socket aceitar sem bloquear.
+// 0 => fila vazia, 1 => sobrou dado (esperar escrita), -1 => socket falhou
+static int tx_flush(int fd, TxBuf* tb){
+    while (tb->off<tb->len) {
+        ssize_t n = send(fd, tb->data+tb->off, tb->len-tb->off, MSG_NOSIGNAL);
+        if (n<0 && errno==EINTR) continue;
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return 1;
+        if (n<=0) {
+            tb->off = tb->len = 0;
+            return -1;
+        }
+        tb->off += n;
+    }
+    tb->off = tb->len = 0;
+    return 0;
+}
+
+// Próximo quadro binário completo (sem o campo de tamanho), contíguo no buffer.
+// *flen recebe o tamanho do quadro e *used quantos bytes consumir depois.
+static uint8_t* rx_frame(RxBuf* rb, size_t* flen, size_t* used){
+    *used = 0;
+    if (rb->len<2) return NULL;
+    const uint8_t* d = (const uint8_t*)rb->data;
+    size_t n = d[rb->head] | (size_t)d[(rb->head+1) & (rb->cap-1)]<<8;
+    if (rb->len<2+n) return NULL;
+    if (rb->head+2+n>rb->cap && rx_realloc(rb, rb->cap)<0) return NULL;
+    *flen = n;
+    *used = 2+n;
+    return (uint8_t*)rb->data+rb->head+2;
+}
+
+// ----------------------------------------------------
+// UIDs: 10 dígitos no texto, inteiro em todo o resto
+// Converte os 10 dígitos em s; -1 se algum não é dígito
+static int uid_scan(const char* s, uint64_t* uid){
+    uint64_t v = 0;
+    for (int i=0; i<10; i++) {
+        if (s[i]<'0' || s[i]>'9') return -1;
+        v = v*10 + (s[i]-'0');
+    }
+    *uid = v;
+    return 0;
+}
+// Como uid_scan, mas s tem que ser só o UID
+static int uid_parse(const char* s, uint64_t* uid){
+    return (uid_scan(s, uid)<0 || s[10]!='\0') ? -1 : 0;
+}
+// Escreve os 10 dígitos (sem '\0'), dois por vez
+static void uid_digits(uint64_t v, char* out){
+    static const char d2[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    for (int i=8; i>=0; i-=2) {
+        memcpy(out+i, d2+2*(v%100), 2);
+        v /= 100;
+    }
+}
+
+// Escreve v em decimal a partir de p; retorna o fim
+static char* put_dec(char* p, uint64_t v){
+    char tmp[20];
+    int n = 0;
+    do { tmp[n++] = '0' + v%10; v /= 10; } while (v);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+static uint8_t* put_u16(uint8_t* p, uint16_t v){
+    p[0] = v; p[1] = v>>8;
+    return p+2;
+}
+static uint8_t* put_u32(uint8_t* p, uint32_t v){
+    for (int i=0; i<4; i++) p[i] = v>>(8*i);
+    return p+4;
+}
+static uint8_t* put_u64(uint8_t* p, uint64_t v){
+    for (int i=0; i<8; i++) p[i] = v>>(8*i);
+    return p+8;
+}
+static uint16_t get_u16(const uint8_t* p){
+    return p[0] | p[1]<<8;
+}
+static uint32_t get_u32(const uint8_t* p){
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+static uint64_t get_u64(const uint8_t* p){
+    return get_u32(p) | (uint64_t)get_u32(p+4)<<32;
+}
+
+// ----------------------------------------------------
+// Reconhecimento de comandos: a palavra do comando (até ' ', '(' ou o fim)
+// é lida uma vez, já calculando o hash; o hash é perfeito para cada tabela
+// (kw_init confere) e dá a única entrada candidata, que um strncmp confirma.
+#define KW_SLOTS 64
+#define KW_MULT  13      // trocar se kw_init acusar colisão
+typedef struct {
+    const char* kw;      // com o separador: "REQ_CONN(", "REQ_USRADD ", "REQ_STATS"
+    int      id;         // CMD_* ou PL_*; 0 é desconhecido
+    uint8_t  len;        // strlen(kw)
+    uint8_t  wlen;       // tamanho da palavra
+} Keyword;
+typedef struct {
+    Keyword* kws;
+    uint8_t  slot[KW_SLOTS];   // índice+1 em kws, 0 = vazio
+} KwTable;
+
+// Linhas de peer no modo texto
+enum {
+    PL_UNKNOWN, PL_DISCPEER, PL_OK_DISC, PL_PEER_LIMIT, PL_REQ_BINPEER, PL_BINPEER,
+    PL_LOCRANGE, PL_REQ_AUTHCACHE, PL_RES_LOCREG, PL_REQ_USRAUTH, PL_REQ_LOCREG,
+    PL_RES_USRAUTH, PL_AUTHCACHE, PL_AUTHINV, PL_N
+};
+
+static Keyword client_kws[] = {
+    { "REQ_CONN(", CMD_CONN },            { "REQ_DISC(", CMD_DISC },
+    { "REQ_STATS", CMD_STATS },           { "REQ_USRADD ", CMD_USRADD },
+    { "REQ_USRACCESS ", CMD_USRACCESS },  { "REQ_USRLOC ", CMD_USRLOC },
+    { "REQ_LOCLIST ", CMD_LOCLIST },      { "REQ_USRIMPORT ", CMD_USRIMPORT },
+    { "REQ_LOCCOUNT", CMD_LOCCOUNT },      { "REQ_SUBSCRIBE ", CMD_SUBSCRIBE },
+    { "REQ_UNSUBSCRIBE ", CMD_UNSUBSCRIBE },{ "REQ_USRHIST ", CMD_USRHIST },
+    { "REQ_LOCHIST ", CMD_LOCHIST },
+    { NULL, 0 }
+};
+static Keyword peer_kws[] = {
+    { "REQ_DISCPEER(", PL_DISCPEER },     { "OK(01)", PL_OK_DISC },
+    { "ERROR(01)", PL_PEER_LIMIT },       { "REQ_BINPEER", PL_REQ_BINPEER },
+    { "BINPEER", PL_BINPEER },            { "REQ_LOCRANGE ", PL_LOCRANGE },
+    { "REQ_AUTHCACHE", PL_REQ_AUTHCACHE },{ "RES_LOCREG ", PL_RES_LOCREG },
+    { "REQ_USRAUTH ", PL_REQ_USRAUTH },   { "REQ_LOCREG ", PL_REQ_LOCREG },
+    { "RES_USRAUTH(", PL_RES_USRAUTH },   { "AUTHCACHE", PL_AUTHCACHE },
+    { "AUTHINV ", PL_AUTHINV },           { NULL, 0 }
+};
+static KwTable client_kw, peer_kw;
+
+// Tamanho da palavra em s; *hash recebe o hash dela
+static size_t kw_word(const char* s, unsigned* hash){
+    unsigned h = 0;
+    size_t n = 0;
+    for (; s[n] && s[n]!=' ' && s[n]!='('; n++) h = h*KW_MULT + (unsigned char)s[n];
+    *hash = (h ^ h>>7) & (KW_SLOTS-1);
+    return n;
+}
+
+static void kw_build(KwTable* t, Keyword* kws){
+    t->kws = kws;
+    for (int i=0; kws[i].kw; i++) {
+        unsigned h;
+        kws[i].len  = strlen(kws[i].kw);
+        kws[i].wlen = kw_word(kws[i].kw, &h);
+        if (t->slot[h]) {
+            log_msg(LOG_ERROR, "Keyword hash collision: %s / %s\n", kws[i].kw, kws[t->slot[h]-1].kw);
+            exit(EXIT_FAILURE);
+        }
+        t->slot[h] = i+1;
+    }
+}
+
+static void kw_init(void){
+    kw_build(&client_kw, client_kws);
+    kw_build(&peer_kw, peer_kws);
+}
+
+// id do comando em s (0 se nenhum); *args fica logo depois do separador.
+// Palavra sem separador na tabela ("REQ_STATS") tem que ser a linha toda.
+static int kw_find(const KwTable* t, const char* s, const char** args){
+    unsigned h;
+    size_t n = kw_word(s, &h);
+    int i = t->slot[h];
+    if (!i) return 0;
+    const Keyword* k = &t->kws[i-1];
+    if (k->wlen!=n || memcmp(s, k->kw, n)!=0) return 0;
+    // separador (sem separador, kw[n] é o '\0': a palavra é a linha toda)
+    // e o que mais a palavra-chave fixa, como o "01)" de "OK(01)"
+    if (s[n]!=k->kw[n]) return 0;
+    if (k->len>n+1 && strncmp(s+n+1, k->kw+n+1, k->len-n-1)!=0) return 0;
+    *args = s+k->len;
+    return k->id;
+}
+
+// Próximo argumento (separado por espaços) a partir de *s; tamanho em *n, NULL se acabou
+static const char* arg_next(const char** s, size_t* n){
+    const char* p = *s;
+    while (*p==' ') p++;
+    if (!*p) return NULL;
+    size_t k = 0;
+    while (p[k] && p[k]!=' ') k++;
+    *n = k;
+    *s = p+k;
+    return p;
+}
+// UID (exatamente 10 dígitos) como próximo argumento
+static int arg_uid(const char** s, uint64_t* uid){
+    const char* p = *s;
+    while (*p==' ') p++;
+    if (uid_scan(p, uid)<0 || (p[10]!='\0' && p[10]!=' ')) return -1;
+    *s = p+10;
+    return 0;
+}
+// Inteiro com sinal; -1 se não há um
+static int arg_long(const char** s, long* v){
+    char* end;
+    *v = strtol(*s, &end, 10);
+    if (end==*s) return -1;
+    *s = end;
+    return 0;
+}
+static int arg_u64(const char** s, uint64_t* v){
+    char* end;
+    while (**s==' ') (*s)++;
+    if (**s<'0' || **s>'9') return -1;
+    *v = strtoull(*s, &end, 10);
+    *s = end;
+    return 0;
+}
+
+// "<t1> <t2>" de uma janela de histórico
+static int arg_window(const char** s, Cmd* c){
+    uint64_t t1, t2;
+    if (arg_u64(s, &t1)<0 || arg_u64(s, &t2)<0 || t1>t2 || t2>INT64_MAX) return -1;
+    c->t1 = (int64_t)t1;
+    c->t2 = (int64_t)t2;
+    return 0;
+}
+
+// Reconhece a linha de cliente e converte os argumentos; erro de argumento
+// não é erro aqui: c->bad faz o comando responder o seu ERROR(nn)
+static void cmd_parse(const char* line, Cmd* c){
+    const char* s;
+    const char* a;
+    size_t n;
+    memset(c, 0, sizeof(*c));
+    c->op = kw_find(&client_kw, line, &s);
+    if (c->op) c->arg = (uint16_t)(s-line);
+    switch (c->op) {
+    case CMD_CONN:
+        c->num = atoi(s);
+        break;
+    case CMD_USRADD:          // <UID> <is_spec>
+        c->has_uid = arg_uid(&s, &c->uid)==0;
+        a = arg_next(&s, &n);
+        c->bad = !c->has_uid || !a;
+        if (a) c->flag = atoi(a)!=0;
+        break;
+    case CMD_USRACCESS:       // <UID> in|out [seq]
+        c->has_uid = arg_uid(&s, &c->uid)==0;
+        a = arg_next(&s, &n);
+        c->bad = !c->has_uid || !a;
+        if (a) c->flag = n==2 && memcmp(a, "in", 2)==0;
+        a = arg_next(&s, &n);
+        c->want_seq = a && n==3 && memcmp(a, "seq", 3)==0;
+        break;
+    case CMD_USRLOC:          // <UID> [Seq]
+        c->has_uid = arg_uid(&s, &c->uid)==0;
+        c->bad = !c->has_uid;
+        if (c->has_uid && arg_u64(&s, &c->seq)<0) c->seq = 0;
+        break;
+    case CMD_LOCLIST:         // <UID> <LocId>
+        c->has_uid = arg_uid(&s, &c->uid)==0;
+        a = arg_next(&s, &n);
+        c->bad = !c->has_uid || !a;
+        if (a) c->num = atoi(a);
+        break;
+    case CMD_USRIMPORT:       // <N> | <arquivo em -I>
+        a = arg_next(&s, &n);
+        if (a && *a>='0' && *a<='9') c->num = atoi(a);
+        else if (a) c->num = -1;
+        else c->bad = 1;
+        c->arg = a ? (uint16_t)(a-line) : 0;
+        break;
+    case CMD_SUBSCRIBE:       // <UID> | <UID> LOC <LocId> (o UID autoriza, como no REQ_LOCLIST)
+    case CMD_UNSUBSCRIBE: {   // <UID> | [<UID>] LOC <LocId>
+        const char* p = s;
+        a = arg_next(&p, &n);
+        if (!a || n!=3 || memcmp(a, "LOC", 3)!=0) {
+            if (arg_uid(&s, &c->uid)<0) {
+                c->bad = 1;
+                break;
+            }
+            c->has_uid = 1;
+            p = s;
+            if (!(a = arg_next(&p, &n))) break;
+            if (n!=3 || memcmp(a, "LOC", 3)!=0) {
+                c->bad = 1;
+                break;
+            }
+        }
+        a = arg_next(&p, &n);
+        c->num = a ? atoi(a) : 0;
+        c->bad = c->num<1 || c->num>MAX_LOC || (c->op==CMD_SUBSCRIBE && !c->has_uid);
+        break;
+    }
+    case CMD_USRHIST:         // <UID> <t1> <t2>
+        c->has_uid = arg_uid(&s, &c->uid)==0;
+        c->bad = !c->has_uid || arg_window(&s, c)<0;
+        break;
+    case CMD_LOCHIST:         // <UID> <LocId> <t1> <t2>
+        c->has_uid = arg_uid(&s, &c->uid)==0;
+        a = arg_next(&s, &n);
+        c->num = a ? atoi(a) : 0;
+        c->bad = !c->has_uid || c->num<1 || c->num>MAX_LOC || arg_window(&s, c)<0;
+        break;
+    }
+}
+
+// ----------------------------------------------------
+// Funções auxiliares
+int find_su_user(uint64_t uid) {
+    return uid_index_find(&su_index, uid);
+}
+int find_sl_record(uint64_t uid) {
+    return uid_index_find(&sl_index, uid);
+}
+
+static int su_is_special(int idx){
+    return (su_special[idx>>6] >> (idx&63)) & 1;
+}
+static void su_set_special(int idx, int v){
+    if (v) su_special[idx>>6] |=  1ull<<(idx&63);
+    else   su_special[idx>>6] &= ~(1ull<<(idx&63));
+}
+// Local do registro, -1 se não está em nenhum
+static int sl_location(int idx){
+    return sl_loc[idx] ? sl_loc[idx] : -1;
+}
+
+// Cresce os vetores do SU/SL juntos (mesma capacidade, dobrando)
+static int su_reserve(int need){
+    if (need<=su_cap) return 0;
+    int ncap = su_cap ? su_cap : 64;
+    while (ncap<need) ncap *= 2;
+    uint64_t* u = realloc(su_uids, (size_t)ncap*sizeof(uint64_t));
+    if (!u) return -1;
+    su_uids = u;
+    uint64_t* b = realloc(su_special, (size_t)ncap/64*sizeof(uint64_t));
+    if (!b) return -1;
+    memset(b+su_cap/64, 0, (size_t)(ncap-su_cap)/64*sizeof(uint64_t));
+    su_special = b;
+    int16_t* l = realloc(su_loc, (size_t)ncap*sizeof(int16_t));
+    if (!l) return -1;
+    su_loc = l;
+    su_cap = ncap;
+    return 0;
+}
+static int sl_reserve(int need){
+    if (need<=sl_cap) return 0;
+    int ncap = sl_cap ? sl_cap : 64;
+    while (ncap<need) ncap *= 2;
+    uint64_t* u = realloc(sl_uids, (size_t)ncap*sizeof(uint64_t));
+    if (!u) return -1;
+    sl_uids = u;
+    uint8_t* l = realloc(sl_loc, (size_t)ncap);
+    if (!l) return -1;
+    sl_loc = l;
+    int32_t* p = realloc(sl_loc_pos, (size_t)ncap*sizeof(int32_t));
+    if (!p) return -1;
+    sl_loc_pos = p;
+    sl_cap = ncap;
+    return 0;
+}
+
+// Retorna a posição do novo usuário ou -1 (sem memória)
+int su_user_add(uint64_t uid, int is_special) {
+    if (su_reserve(su_count+1)<0) return -1;
+    if (uid_index_insert(&su_index, uid, su_count)<0) return -1;
+    su_uids[su_count] = uid;
+    su_loc[su_count]  = 0;
+    su_set_special(su_count, is_special);
+    return su_count++;
+}
+int sl_record_add(uint64_t uid, int location) {
+    if (sl_reserve(sl_count+1)<0) return -1;
+    if (uid_index_insert(&sl_index, uid, sl_count)<0) return -1;
+    sl_uids[sl_count]    = uid;
+    sl_loc[sl_count]     = 0;
+    sl_loc_pos[sl_count] = -1;
+    sl_set_location(sl_count, location);
+    return sl_count++;
+}
+
+// Atualiza a localização do registro e os conjuntos de ocupantes.
+// Locais fora de [1..MAX_LOC] contam como "sem local".
+static void loc_count_publish(int loc){
+    atomic_store_explicit(&loc_counts[worker_id][loc], loc_occ[loc].count, memory_order_relaxed);
+}
+void sl_set_location(int idx, int location) {
+    if (sl_loc_pos[idx]>=0) {
+        LocOccupants* o = &loc_occ[sl_loc[idx]];
+        int last = o->recs[--o->count];
+        o->recs[sl_loc_pos[idx]] = last;
+        sl_loc_pos[last] = sl_loc_pos[idx];
+        sl_loc_pos[idx] = -1;
+        loc_count_publish(sl_loc[idx]);
+    }
+    sl_loc[idx] = 0;
+    if (location>=1 && location<=MAX_LOC) {
+        LocOccupants* o = &loc_occ[location];
+        if (grow_array((void**)&o->recs, &o->cap, o->count+1, sizeof(int))<0) return;
+        sl_loc[idx] = (uint8_t)location;
+        sl_loc_pos[idx] = o->count;
+        o->recs[o->count++] = idx;
+        loc_count_publish(location);
+    }
+}
+int get_client_index_by_socket(int sock) {
+    if (sock>=0 && sock<clients_cap && clients[sock].in_use) {
+        return sock;
+    }
+    return -1;
+}
+
+// Marca a saída do cliente para envio no fim da iteração do loop
+static void client_mark_dirty(int sock){
+    Client* c = &clients[sock];
+    if (c->dirty) return;
+    if (grow_array((void**)&dirty_fds, &dirty_cap, dirty_count+1, sizeof(int))<0) return;
+    c->dirty = 1;
+    dirty_fds[dirty_count++] = sock;
+}
+
+// Enfileira uma resposta; a fila cheia demais pausa a leitura do cliente
+static void client_send(int sock, const char* msg, size_t len){
+    Client* c = &clients[sock];
+    if (tx_append(&c->tx, msg, len)<0) return;
+    if (tx_pending(&c->tx)>TX_HIGH) c->paused = 1;
+    client_mark_dirty(sock);
+}
+
+// Envia o que der da fila do cliente; acompanha o socket para escrita
+// enquanto sobrar dado. Retorna 1 se a leitura foi retomada, -1 se o
+// cliente caiu (já removido), 0 senão.
+static int client_flush(int sock){
+    wal_commit();   // respostas só saem com as mudanças no disco
+    Client* c = &clients[sock];
+    c->dirty = 0;
+    if (ur_on) {
+        // vai no próximo io_uring_enter(); a conclusão retoma a leitura
+        ur_send_start(sock);
+        return 0;
+    }
+    int r = tx_flush(sock, &c->tx);
+    if (r<0) {
+        close_and_remove_client(sock);
+        return -1;
+    }
+    if (r!=c->want_write) {
+        ev_set_write(sock, r);
+        c->want_write = r;
+    }
+    if (r==0 && c->subq) sub_flush(sock);
+    if (c->paused && tx_pending(&c->tx)<=TX_LOW) {
+        c->paused = 0;
+        if (c->importing) return 0;
+        ev_set_read(sock, 1);
+        return 1;
+    }
+    return 0;
+}
+// ----------------------------------------------------
+// Mensagens entre workers: uma fila MPSC sem trava (Vyukov) por worker,
+// mais um pipe que acorda o loop de quem recebe
+typedef struct MsgNode {
+    _Atomic(struct MsgNode*) next;
+} MsgNode;
+
+enum {
+    SM_CMD,          // comando de cliente para o shard dono do UID (data = Cmd)
+    SM_REPLY,        // resposta para o cliente em to (data)
+    SM_PEER_OUT,     // para o worker 0 mandar ao peer: peer, op, uid, a, has_rid, rid
+    SM_PEER_IN,      // mensagem do peer para o shard dono: peer, op, uid, a, has_rid, rid
+    SM_LOC_COLLECT,  // pede os ocupantes do local a (inspect com vários shards)
+    SM_LOC_PART,     // ocupantes de um shard (data), de volta para quem pediu; op = 1: sem memória
+    SM_PEER_LOST,    // peer caiu: falha os pedidos do worker que esperam por ele
+    SM_REPL_DUMP,    // pede os registros do shard para a réplica a (rid = gen)
+    SM_REPL_PART,    // registros de um shard (data), de volta para o worker 0; op = 1: sem memória
+    SM_STATS_COLLECT,// pede as métricas do worker
+    SM_STATS_PART,   // métricas de um worker (data = Stats), de volta para quem pediu; op = 1: sem memória
+    SM_IMPORT,       // parte de um REQ_USRIMPORT do shard (data = uid<<1|is_special)
+    SM_IMPORT_PART,  // contagem do shard (data = ImportCount), de volta para quem pediu; op = 1: sem memória
+    SM_SUB,          // REQ_(UN)SUBSCRIBE LOC a para to; op = 1 assina, 0 cancela
+    SM_UNSUB_ALL,    // o cliente to saiu: esquece suas assinaturas
+    SM_EVENT,        // mudança de local para o assinante to: uid, a = de, op = para, seq = id
+    SM_HIST_COLLECT, // pede as entradas no local a na janela (data = int64 t1, t2)
+    SM_HIST_PART,    // entradas de um shard (data = HistHit), a = janela antes do retido; op = 1: sem memória
+};
+typedef struct ShardMsg {
+    MsgNode  node;
+    struct ShardMsg* next_out;   // outbox
+    int      dest;
+    int      type;
+    int      op;         // PB_* nas SM_PEER_*; 1 => parte perdida nas SM_*_PART
+    int      peer;       // slot do peer nas SM_PEER_*
+    ReplyTo  to;
+    uint64_t uid;
+    int      a;          // loc, oldLoc ou spec
+    int      has_rid;
+    uint32_t rid;
+    uint64_t seq;        // SM_PEER_*: seq da mudança (REQ_LOCREG/RES_LOCREG)
+    void*    ctx;        // SM_LOC_*/SM_STATS_*/SM_IMPORT*/SM_HIST_*: *Gather de quem pediu
+    size_t   len;
+    char     data[];
+} ShardMsg;
+
+typedef struct {
+    _Atomic(MsgNode*) head;     // produtores inserem aqui
+    MsgNode*          tail;     // só o worker dono consome
+    MsgNode           stub;
+    atomic_int        signaled; // já há um byte no pipe
+    int               wake[2];
+} MsgQueue;
+static MsgQueue shard_q[MAX_WORKERS];
+
+static int q_init(MsgQueue* q){
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_init(&q->signaled, 0);
+    if (pipe(q->wake)<0) return -1;
+    set_nonblocking(q->wake[0]);
+    set_nonblocking(q->wake[1]);
+    return 0;
+}
+
+static void q_push(MsgQueue* q, MsgNode* n){
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    MsgNode* prev = atomic_exchange(&q->head, n);
+    atomic_store(&prev->next, n);
+}
+
+// Próxima mensagem da fila; NULL se está vazia
+static ShardMsg* q_pop(MsgQueue* q){
+    MsgNode* tail = q->tail;
+    MsgNode* next = atomic_load(&tail->next);
+    if (tail==&q->stub) {
+        if (!next) return NULL;
+        q->tail = tail = next;
+        next = atomic_load(&next->next);
+    }
+    while (!next) {
+        if (tail==atomic_load(&q->head)) {
+            // último nó: recoloca o stub atrás dele para poder soltá-lo
+            q_push(q, &q->stub);
+        } else {
+            // um produtor ainda está ligando o próximo nó
+            sched_yield();
+        }
+        next = atomic_load(&tail->next);
+    }
+    q->tail = next;
+    return (ShardMsg*)tail;
+}
+
+static ShardMsg* msg_new(int type, size_t len){
+    ShardMsg* m = calloc(1, sizeof(ShardMsg)+len+1);
+    if (m) {
+        m->type = type;
+        m->len  = len;
+    }
+    return m;
+}
+
+// Entrega m ao worker w; só escreve no pipe se ele ainda não foi acordado
+static void shard_deliver(int w, ShardMsg* m){
+    MsgQueue* q = &shard_q[w];
+    q_push(q, &m->node);
+    if (!atomic_exchange(&q->signaled, 1)) {
+        char c = 0;
+        if (write(q->wake[1], &c, 1)<0) { /* pipe cheio: já há aviso pendente */ }
+    }
+}
+
+// Com mudanças ainda fora do disco a mensagem (que pode ser a confirmação
+// delas) só sai depois do fsync; a ordem entre as mensagens se mantém
+static void shard_post(int w, ShardMsg* m){
+    if (outbox || tx_pending(&wal_buf)) {
+        m->dest = w;
+        m->next_out = NULL;
+        if (outbox) outbox_last->next_out = m;
+        else        outbox = m;
+        outbox_last = m;
+        return;
+    }
+    shard_deliver(w, m);
+}
+
+// Worker dono do shard do UID. Usa outro multiplicador que o índice:
+// com os mesmos bits, cada shard só ocuparia uma fração do seu índice.
+#define SHARD_HASH  2   // muda quando a divisão muda (gravado no snapshot)
+static int shard_of(uint64_t uid){
+    if (n_workers==1) return 0;
+    uint32_t h = (uint32_t)((uid * 0xC2B2AE3D27D4EB4Full) >> 32);
+    return (int)(((uint64_t)h * n_workers) >> 32);
+}
+
+// O cliente da resposta ainda está conectado (e o fd não foi reusado)?
+static int reply_client_ok(const ReplyTo* to){
+    return get_client_index_by_socket(to->sock)>=0 && clients[to->sock].id==to->client_id;
+}
+
+// A resposta da vez saiu: solta as seguintes que já chegaram. Depois do
+// REQ_DISC, a última resposta fecha a conexão.
+static void reply_advance(int sock){
+    Client* c = &clients[sock];
+    c->seq_out++;
+    while (c->held && c->held->seq==c->seq_out) {
+        HeldReply* h = c->held;
+        c->held = h->next;
+        client_send(sock, h->data, h->len);
+        c->seq_out++;
+        free(h);
+    }
+    if (c->closing && c->seq_out==c->seq_next) {
+        client_flush(sock);
+        close_and_remove_client(sock);
+    }
+}
+
+// Resposta para um cliente deste worker, na ordem dos comandos
+static void reply_local(const ReplyTo* to, const char* msg, size_t len){
+    stat_done(to->kind, to->t0, msg);
+    if (!reply_client_ok(to)) return;
+    Client* c = &clients[to->sock];
+    if (to->seq!=c->seq_out) {
+        HeldReply* h = malloc(sizeof(HeldReply)+len);
+        if (!h) return;
+        h->seq = to->seq;
+        h->len = len;
+        memcpy(h->data, msg, len);
+        HeldReply** pp = &c->held;
+        while (*pp && (int32_t)((*pp)->seq - h->seq)<0) pp = &(*pp)->next;
+        h->next = *pp;
+        *pp = h;
+        return;
+    }
+    client_send(to->sock, msg, len);
+    reply_advance(to->sock);
+}
+
+// Responde ao cliente, que pode estar em outro worker
+static void reply_send(const ReplyTo* to, const char* msg, size_t len){
+    if (to->worker==worker_id) {
+        reply_local(to, msg, len);
+        return;
+    }
+    ShardMsg* m = msg_new(SM_REPLY, len);
+    if (!m) return;
+    m->to = *to;
+    memcpy(m->data, msg, len);
+    shard_post(to->worker, m);
+}
+
+// ----------------------------------------------------
+// Persistência: cada worker grava as mudanças do seu shard em
+// <dir>/su-<w>.wal (ou sl-) e, a cada snap_every entradas, um snapshot
+// <dir>/su-<w>.snap que substitui o WAL. Na partida carrega os dois.
+//
+// Registro do snapshot: UID + valor (is_special no SU, local no SL)
+typedef struct {
+    char    uid[10];
+    int16_t val;
+} DiskRec;
+// Entrada do WAL; o checksum descarta a cauda de uma escrita interrompida
+typedef struct {
+    DiskRec  rec;
+    uint32_t sum;
+} WalRec;
+#define SNAP_MAGIC  "CAPSNAP1"
+typedef struct {
+    char     magic[8];
+    uint32_t is_su;
+    uint32_t n_workers;  // shards de quando foi gravado
+    uint32_t count;
+    uint32_t shard_hash; // SHARD_HASH de quando foi gravado
+} SnapHdr;
+
+static uint32_t wal_sum(const DiskRec* r){
+    const unsigned char* p = (const unsigned char*)r;
+    uint32_t h = 2166136261u;
+    for (size_t i=0; i<sizeof(*r); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void persist_path(char* out, size_t n, int w, const char* ext){
+    snprintf(out, n, "%s/%s-%d.%s", data_dir, is_su ? "su" : "sl", w, ext);
+}
+
+// Registra a mudança; vai para o disco no wal_commit antes da resposta sair
+static void wal_log(uint64_t uid, int val){
+    if (wal_fd<0) return;
+    WalRec e;
+    uid_digits(uid, e.rec.uid);
+    e.rec.val = (int16_t)val;
+    e.sum = wal_sum(&e.rec);
+    tx_append(&wal_buf, &e, sizeof(e));
+}
+
+// Grava o shard inteiro em .snap (tmp + rename) e esvazia o WAL
+static void snapshot_write(void){
+    char path[PATH_MAX], tmp[PATH_MAX+4];
+    persist_path(path, sizeof(path), worker_id, "snap");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd<0) {
+        perror("snapshot");
+        return;
+    }
+    int count = is_su ? su_count : sl_count;
+    SnapHdr h = { SNAP_MAGIC, (uint32_t)is_su, (uint32_t)n_workers, (uint32_t)count, SHARD_HASH };
+    int err = write_all(fd, &h, sizeof(h));
+    DiskRec chunk[1024];
+    for (int i=0; i<count && !err; ) {
+        int k = 0;
+        for (; k<1024 && i<count; k++, i++) {
+            if (is_su) {
+                uid_digits(su_uids[i], chunk[k].uid);
+                chunk[k].val = (int16_t)su_is_special(i);
+            } else {
+                uid_digits(sl_uids[i], chunk[k].uid);
+                chunk[k].val = (int16_t)sl_location(i);
+            }
+        }
+        err = write_all(fd, chunk, k*sizeof(DiskRec));
+    }
+    if (err || fsync(fd)<0) {
+        perror("snapshot");
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+    if (rename(tmp, path)<0) {
+        perror("snapshot");
+        return;
+    }
+    // o rename precisa estar no disco antes de o WAL sumir
+    int dfd = open(data_dir, O_RDONLY);
+    if (dfd>=0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    if (wal_fd>=0 && ftruncate(wal_fd, 0)<0) perror("wal");
+    wal_records = 0;
+}
+
+// Group commit: um write + fdatasync para tudo que mudou desde o último,
+// depois libera as mensagens para outros workers que esperavam por ele
+static void wal_commit(void){
+    size_t len = tx_pending(&wal_buf);
+    if (len) {
+        if (write_all(wal_fd, wal_buf.data+wal_buf.off, len)<0 || fdatasync(wal_fd)<0)
+            perror("wal");
+        wal_records += len/sizeof(WalRec);
+        wal_buf.off = wal_buf.len = 0;
+        if (wal_records>=snap_every) snapshot_write();
+    }
+    while (outbox) {
+        ShardMsg* m = outbox;
+        outbox = m->next_out;
+        shard_deliver(m->dest, m);
+    }
+}
+
+// Aplica um registro (carga ou replay) se o UID é deste shard.
+// fresh: o UID com certeza ainda não está na tabela (pula a busca).
+static void persist_apply(const DiskRec* r, int fresh){
+    uint64_t uid;
+    if (uid_scan(r->uid, &uid)<0 || shard_of(uid)!=worker_id) return;
+    if (is_su) {
+        int idx = fresh ? -1 : find_su_user(uid);
+        if (idx>=0) su_set_special(idx, r->val);
+        else        su_user_add(uid, r->val);
+    } else {
+        int idx = fresh ? -1 : find_sl_record(uid);
+        if (idx>=0) sl_set_location(idx, r->val);
+        else        sl_record_add(uid, r->val);
+    }
+}
+
+// Mapeia o arquivo inteiro; NULL se não existe ou está vazio
+static void* map_file(const char* path, size_t* size){
+    int fd = open(path, O_RDONLY);
+    if (fd<0) return NULL;
+    struct stat st;
+    void* m = NULL;
+    if (fstat(fd, &st)==0 && st.st_size>0) {
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m==MAP_FAILED) m = NULL;
+        else {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return m;
+}
+
+// Snapshot + WAL do shard w. Retorna 1 se havia algum dos dois.
+static int persist_load(int w){
+    char path[PATH_MAX];
+    size_t size;
+    int found = 0;
+    persist_path(path, sizeof(path), w, "snap");
+    const SnapHdr* h = map_file(path, &size);
+    if (h) {
+        found = 1;
+        if (size<sizeof(*h) || memcmp(h->magic, SNAP_MAGIC, 8)!=0 || h->is_su!=(uint32_t)is_su
+            || size!=sizeof(*h)+(size_t)h->count*sizeof(DiskRec)) {
+            log_msg(LOG_ERROR, "%s: snapshot inválido, ignorado\n", path);
+        } else {
+            if (h->n_workers!=(uint32_t)n_workers || h->shard_hash!=SHARD_HASH)
+                atomic_store(&persist_reshard, 1);
+            // reserva de uma vez para o shard (em média count/n_workers)
+            int fresh = (is_su ? su_count : sl_count)==0;
+            uint32_t need = (is_su ? su_count : sl_count) + h->count/n_workers + 1;
+            if (is_su) {
+                su_reserve(need);
+                uid_index_reserve(&su_index, need);
+            } else {
+                sl_reserve(need);
+                uid_index_reserve(&sl_index, need);
+            }
+            // UIDs de um snapshot são únicos; com a tabela vazia não há o que buscar.
+            // As inserções caem em posições aleatórias do índice: busca o slot
+            // de alguns registros à frente para esconder a falta de cache.
+            UidIndex* ix = is_su ? &su_index : &sl_index;
+            const DiskRec* r = (const DiskRec*)(h+1);
+            for (uint32_t i=0; i<h->count; i++) {
+                uint64_t ahead;
+                if (i+8<h->count && uid_scan(r[i+8].uid, &ahead)==0)
+                    __builtin_prefetch(&ix->slots[uid_hash(ahead) & (ix->cap-1)], 1);
+                persist_apply(&r[i], fresh);
+            }
+        }
+        munmap((void*)h, size);
+    }
+    persist_path(path, sizeof(path), w, "wal");
+    const WalRec* e = map_file(path, &size);
+    if (e) {
+        found = 1;
+        atomic_store(&persist_reshard, 1);
+        size_t n = size/sizeof(WalRec);
+        for (size_t i=0; i<n && e[i].sum==wal_sum(&e[i].rec); i++) persist_apply(&e[i].rec, 0);
+        munmap((void*)e, size);
+    }
+    return found;
+}
+
+// Partida: cada worker lê os arquivos de todos os shards (o -n pode ter
+// mudado) e fica com os seus UIDs. Se havia WAL ou os shards mudaram, todos
+// gravam snapshots novos e só então os arquivos que sobraram são apagados.
+static void persist_open(void){
+    if (!data_dir) return;
+    int extra = 0;
+    for (int w=0; w<MAX_WORKERS; w++) {
+        if (persist_load(w) && w>=n_workers) extra = 1;
+    }
+    if (extra) atomic_store(&persist_reshard, 1);
+    char path[PATH_MAX];
+    persist_path(path, sizeof(path), worker_id, "wal");
+    wal_fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (wal_fd<0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (n_workers>1) pthread_barrier_wait(&persist_barrier);
+    if (atomic_load(&persist_reshard)) snapshot_write();
+    if (n_workers>1) pthread_barrier_wait(&persist_barrier);
+    if (worker_id==0 && extra) {
+        for (int w=n_workers; w<MAX_WORKERS; w++) {
+            persist_path(path, sizeof(path), w, "snap");
+            unlink(path);
+            persist_path(path, sizeof(path), w, "wal");
+            unlink(path);
+        }
+    }
+    log_msg(LOG_INFO, "Worker %d: %d %s loaded\n", worker_id, is_su ? su_count : sl_count,
+                      is_su ? "users" : "records");
+}
+
+// Registra o cliente na posição do fd; -1 se o limite foi atingido
+int add_client(int sock) {
+    if (atomic_fetch_add(&client_count, 1)>=max_clients) {
+        atomic_fetch_sub(&client_count, 1);
+        return -1;
+    }
+    if (sock>=clients_cap) {
+        int ncap = clients_cap ? clients_cap : 64;
+        while (ncap<=sock) ncap*=2;
+        Client* n = realloc(clients, ncap*sizeof(Client));
+        if (!n) {
+            atomic_fetch_sub(&client_count, 1);
+            return -1;
+        }
+        memset(n+clients_cap, 0, (ncap-clients_cap)*sizeof(Client));
+        clients = n;
+        clients_cap = ncap;
+    }
+    clients[sock].in_use = 1;
+    clients[sock].id     = atomic_fetch_add(&next_client_id, 1);
+    clients[sock].loc    = 0;
+    return sock;
+}
+void close_and_remove_client(int sock) {
+    int idx = get_client_index_by_socket(sock);
+    if (idx>=0){
+        int c_id = clients[idx].id;
+        int loc  = clients[idx].loc;
+        log_msg(LOG_INFO, "Client %d removed (Loc %d)\n", c_id, loc);
+
+        ur_client_close(sock);   // antes do close(): o anel ainda pode usar o fd
+        ev_del(sock);
+        close(sock);
+        rx_free(&clients[idx].rx);
+        tx_free(&clients[idx].tx);
+        while (clients[idx].held) {
+            HeldReply* h = clients[idx].held;
+            clients[idx].held = h->next;
+            free(h);
+        }
+        import_free(clients[idx].import);
+        sub_client_gone(idx);
+        memset(&clients[idx], 0, sizeof(Client));
+        atomic_fetch_sub(&client_count, 1);
+
+        if (is_su) {
+            log_msg(LOG_INFO, "SU Successful disconnect\n");
+        } else {
+            log_msg(LOG_INFO, "SL Successful disconnect\n");
+        }
+    }
+}
+
+// ----------------------------------------------------
+// io_uring (-U): os sockets de clientes saem do epoll. O socket de escuta
+// tem um accept multishot, cada cliente um recv multishot que escolhe
+// buffers de um anel registrado (copiados para o rx da conexão e
+// devolvidos na hora) e os envios da iteração entram todos no mesmo
+// io_uring_enter() que espera as próximas conclusões. O resto (stdin,
+// wake, peers, réplicas) continua no epoll: um POLL_ADD multishot no
+// próprio epfd avisa quando ele tem eventos.
+// Enquanto um envio está no kernel a fila dele fica parada num UrSend; o
+// cliente continua enchendo a sua e as duas trocam quando ele termina.
+typedef struct UrSend {
+    int    fd;      // -1 => o cliente saiu: a conclusão libera
+    int    busy;    // no kernel
+    TxBuf  buf;
+} UrSend;
+static __thread uint32_t ur_gen_next;
+
+#ifdef HAVE_URING
+// user_data: UR_SEND é o próprio UrSend*; os outros levam op, gen e fd
+enum { UR_SEND, UR_ACCEPT, UR_RECV, UR_EPOLL, UR_CANCEL };
+#define UR_UD(op, gen, fd)  ((uint64_t)(op)<<56 | (uint64_t)((gen)&0xffffff)<<32 | (uint32_t)(fd))
+
+typedef struct {
+    int       fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned  sq_entries;
+    unsigned  tail;          // SQEs preparadas (publicadas no io_uring_enter)
+    struct io_uring_buf_ring* br;
+    char*     bufs;
+    uint16_t  br_tail;
+    int       listen_sock;
+    int       accept_on;     // accept multishot armado
+    int64_t   accept_at;     // o accept falhou: só rearma a partir daqui (ms)
+    int       ep_on;         // POLL_ADD do epfd armado
+    int       ep_ready;      // o epfd tem eventos a ler
+} Uring;
+static __thread Uring ur;
+
+static int ur_fail(const char* what){
+    log_msg(LOG_ERROR, "io_uring unavailable (%s: %s), using epoll\n", what, strerror(errno));
+    if (ur.fd>0) close(ur.fd);
+    memset(&ur, 0, sizeof(ur));
+    return -1;
+}
+
+static void ur_buf_put(unsigned bid){
+    struct io_uring_buf* b = &ur.br->bufs[ur.br_tail & (UR_BUFS-1)];
+    b->addr = (uintptr_t)(ur.bufs + (size_t)bid*UR_BUF_SIZE);
+    b->len  = UR_BUF_SIZE;
+    b->bid  = bid;
+    __atomic_store_n(&ur.br->tail, ++ur.br_tail, __ATOMIC_RELEASE);
+}
+
+// Anel do worker; precisa de accept/recv multishot e do anel de buffers
+// (FEAT_LINKED_FILE => kernel >= 6.3, que tem os dois)
+static int ur_setup(void){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    int fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (fd<0 && errno==EINVAL) {
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    }
+    if (fd<0) return ur_fail("io_uring_setup");
+    ur.fd = fd;
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_LINKED_FILE;
+    if ((p.features & need)!=need) {
+        errno = ENOTSUP;
+        return ur_fail("kernel features");
+    }
+    size_t sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (cq_sz>sq_sz) sq_sz = cq_sz;
+    char* sq = mmap(NULL, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq==MAP_FAILED) return ur_fail("mmap");
+    ur.sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ur.sqes==MAP_FAILED) return ur_fail("mmap");
+    ur.sq_head = (unsigned*)(sq+p.sq_off.head);
+    ur.sq_tail = (unsigned*)(sq+p.sq_off.tail);
+    ur.sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+    ur.cq_head = (unsigned*)(sq+p.cq_off.head);
+    ur.cq_tail = (unsigned*)(sq+p.cq_off.tail);
+    ur.cq_mask = (unsigned*)(sq+p.cq_off.ring_mask);
+    ur.cqes    = (struct io_uring_cqe*)(sq+p.cq_off.cqes);
+    ur.sq_entries = p.sq_entries;
+    ur.tail = *ur.sq_tail;
+    unsigned* array = (unsigned*)(sq+p.sq_off.array);
+    for (unsigned i=0; i<p.sq_entries; i++) array[i] = i;
+
+    if (posix_memalign((void**)&ur.br, 4096, UR_BUFS*sizeof(struct io_uring_buf)) ||
+        !(ur.bufs = malloc((size_t)UR_BUFS*UR_BUF_SIZE))) {
+        errno = ENOMEM;
+        return ur_fail("buffers");
+    }
+    memset(ur.br, 0, UR_BUFS*sizeof(struct io_uring_buf));
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uintptr_t)ur.br;
+    reg.ring_entries = UR_BUFS;
+    reg.bgid         = 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1)<0)
+        return ur_fail("IORING_REGISTER_PBUF_RING");
+    for (unsigned i=0; i<UR_BUFS; i++) ur_buf_put(i);
+    return 0;
+}
+
+// Publica as SQEs preparadas e, com wait, espera ao menos uma conclusão
+// (timeout_ms<0 => sem limite). -1 com errno; ETIME/EINTR não são erro.
+static int ur_enter(int wait, int timeout_ms){
+    __atomic_store_n(ur.sq_tail, ur.tail, __ATOMIC_RELEASE);
+    unsigned n = ur.tail - __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts = { timeout_ms/1000, (long long)(timeout_ms%1000)*1000000 };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeout_ms>=0) arg.ts = (uintptr_t)&ts;
+    int r = syscall(__NR_io_uring_enter, ur.fd, n, wait ? 1 : 0,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (r<0 && (errno==ETIME || errno==EINTR)) return 0;
+    return r;
+}
+static void ur_submit(void){
+    if (ur.tail!=*ur.sq_tail && ur_enter(0, 0)<0) log_msg(LOG_ERROR, "io_uring_enter: %s\n", strerror(errno));
+}
+
+static struct io_uring_sqe* ur_sqe(void){
+    if (ur.tail - __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE) >= ur.sq_entries) ur_submit();
+    struct io_uring_sqe* sqe = &ur.sqes[ur.tail & *ur.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ur.tail++;
+    return sqe;
+}
+
+static void ur_accept_arm(int listen_sock){
+    struct io_uring_sqe* sqe = ur_sqe();
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = listen_sock;
+    sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UR_UD(UR_ACCEPT, 0, listen_sock);
+    ur.listen_sock = listen_sock;
+    ur.accept_on   = 1;
+}
+static void ur_recv_arm(int sock){
+    Client* c = &clients[sock];
+    if (!ur_on || c->ur_recv) return;
+    struct io_uring_sqe* sqe = ur_sqe();
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = sock;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = UR_UD(UR_RECV, c->ur_gen, sock);
+    c->ur_recv = 1;
+}
+static void ur_cancel(uint64_t ud){
+    struct io_uring_sqe* sqe = ur_sqe();
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = ud;
+    sqe->user_data = UR_UD(UR_CANCEL, 0, 0);
+}
+static void ur_send_prep(UrSend* s){
+    struct io_uring_sqe* sqe = ur_sqe();
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = s->fd;
+    sqe->addr      = (uintptr_t)(s->buf.data + s->buf.off);
+    sqe->len       = s->buf.len - s->buf.off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)s;
+    s->busy = 1;
+}
+
+// A fila do cliente vai para o kernel; ele segue com o buffer (vazio) do envio anterior
+static void ur_send_start(int sock){
+    Client* c = &clients[sock];
+    UrSend* s = c->ur_send;
+    if (!tx_pending(&c->tx) || (s && s->busy)) return;   // a conclusão manda o resto
+    if (!s) {
+        s = calloc(1, sizeof(*s));
+        if (!s) return;
+        s->fd = sock;
+        c->ur_send = s;
+    }
+    TxBuf t = s->buf;
+    s->buf = c->tx;
+    c->tx  = t;
+    ur_send_prep(s);
+}
+
+// Cliente saindo: cancela o que ele tem no anel e já entrega ao kernel
+// tudo que cita o fd, antes do close() (o número pode ser reusado logo)
+static void ur_client_close(int sock){
+    if (!ur_on) return;
+    Client* c = &clients[sock];
+    if (c->ur_recv) ur_cancel(UR_UD(UR_RECV, c->ur_gen, sock));
+    UrSend* s = c->ur_send;
+    if (s && s->busy) {
+        ur_cancel((uintptr_t)s);
+        s->fd = -1;
+    } else if (s) {
+        tx_free(&s->buf);
+        free(s);
+    }
+    c->ur_send = NULL;
+    ur_submit();
+}
+
+// Como rx_recv, com dados que o kernel já leu. Passa do limite do rx_recv:
+// um cliente pausado ainda recebe o que estava a caminho até o cancelamento.
+static int rx_put(RxBuf* rb, const char* src, size_t n){
+    if (rb->len+n>rb->cap) {
+        size_t ncap = rb->cap ? rb->cap : RX_INIT_SIZE;
+        while (ncap<rb->len+n) ncap *= 2;
+        if (ncap>2*RX_MAX_LINE+(size_t)UR_BUFS*UR_BUF_SIZE || rx_realloc(rb, ncap)<0) return -1;
+    }
+    size_t tail  = (rb->head+rb->len) & (rb->cap-1);
+    size_t first = n<rb->cap-tail ? n : rb->cap-tail;
+    memcpy(rb->data+tail, src, first);
+    memcpy(rb->data, src+first, n-first);
+    rb->len += n;
+    return 0;
+}
+
+static void client_open(int newc);
+
+static void ur_on_recv(int sock, uint32_t gen, int res, unsigned flags){
+    const char* data = NULL;
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (flags & IORING_CQE_F_BUFFER) data = ur.bufs + (size_t)bid*UR_BUF_SIZE;
+    Client* c = (get_client_index_by_socket(sock)>=0 && (clients[sock].ur_gen&0xffffff)==gen) ? &clients[sock] : NULL;
+    if (!c) {
+        if (data) ur_buf_put(bid);
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) c->ur_recv = 0;
+    if (res>0 && data) {
+        int r = rx_put(&c->rx, data, res);
+        ur_buf_put(bid);
+        if (r<0) {
+            close_and_remove_client(sock);
+            return;
+        }
+    } else {
+        if (data) ur_buf_put(bid);
+        // ENOBUFS (anel de buffers vazio) ou o cancelamento da pausa: rearma
+        if (res!=-ENOBUFS && res!=-ECANCELED) {
+            close_and_remove_client(sock);
+            return;
+        }
+    }
+    handle_client_message(sock);
+    if (get_client_index_by_socket(sock)>=0 && (c->paused || c->importing) && c->ur_recv==1) {
+        ur_cancel(UR_UD(UR_RECV, c->ur_gen, sock));
+        c->ur_recv = 2;
+    }
+}
+
+static void ur_on_send(UrSend* s, int res){
+    s->busy = 0;
+    if (s->fd<0) {
+        tx_free(&s->buf);
+        free(s);
+        return;
+    }
+    int sock = s->fd;
+    Client* c = &clients[sock];
+    if (res<=0) {
+        close_and_remove_client(sock);
+        return;
+    }
+    s->buf.off += res;
+    if (s->buf.off<s->buf.len) {
+        ur_send_prep(s);
+        return;
+    }
+    s->buf.off = s->buf.len = 0;
+    if (c->subq) sub_flush(sock);
+    ur_send_start(sock);
+    if (c->paused && tx_pending(&c->tx)<=TX_LOW) {
+        c->paused = 0;
+        if (!c->importing) handle_client_message(sock);
+    }
+}
+
+// No lugar do ev_wait(): trata as conclusões dos clientes e devolve os fds
+// prontos do epoll
+static int ur_wait(int* ready, int max, int timeout_ms){
+    if (!ur.ep_on) {
+        struct io_uring_sqe* sqe = ur_sqe();
+        sqe->opcode       = IORING_OP_POLL_ADD;
+        sqe->fd           = ev_epfd;
+        sqe->poll32_events = EPOLLIN;
+        sqe->len          = IORING_POLL_ADD_MULTI;
+        sqe->user_data    = UR_UD(UR_EPOLL, 0, ev_epfd);
+        ur.ep_on = 1;
+    }
+    if (!ur.accept_on) {
+        int64_t now = now_ms();
+        if (now>=ur.accept_at) ur_accept_arm(ur.listen_sock);
+        else if (timeout_ms<0 || ur.accept_at-now<timeout_ms) timeout_ms = (int)(ur.accept_at-now);
+    }
+    if (ur_enter(!ur.ep_ready, timeout_ms)<0) return -1;
+    unsigned head = *ur.cq_head;
+    while (head!=__atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ur.cqes[head & *ur.cq_mask];
+        __atomic_store_n(ur.cq_head, ++head, __ATOMIC_RELEASE);
+        int more = cqe.flags & IORING_CQE_F_MORE;
+        int op   = cqe.user_data>>56;
+        int fd   = (int)(uint32_t)cqe.user_data;
+        switch (op) {
+        case UR_SEND:
+            ur_on_send((UrSend*)(uintptr_t)cqe.user_data, cqe.res);
+            break;
+        case UR_RECV:
+            ur_on_recv(fd, (cqe.user_data>>32) & 0xffffff, cqe.res, cqe.flags);
+            break;
+        case UR_ACCEPT:
+            if (!more) ur.accept_on = 0;
+            if (cqe.res>=0) {
+                client_open(cqe.res);
+                break;
+            }
+            // o erro encerra o multishot; rearmar já falharia de novo (o epoll
+            // também só tenta outra vez quando chega outra conexão)
+            log_msg(LOG_ERROR, "accept client: %s\n", strerror(-cqe.res));
+            if (!more) ur.accept_at = now_ms() + UR_ACCEPT_RETRY;
+            break;
+        case UR_EPOLL:
+            if (!more) ur.ep_on = 0;
+            ur.ep_ready = 1;
+            break;
+        }
+    }
+    if (!ur.ep_ready) return 0;
+    int n = ev_wait(ready, max, 0);
+    ur.ep_ready = (n==max);   // sobrou evento: a próxima volta não espera
+    return n;
+}
+#else
+static int  ur_setup(void){ log_msg(LOG_ERROR, "io_uring not built in, ignoring -U\n"); return -1; }
+static void ur_accept_arm(int listen_sock){ (void)listen_sock; }
+static void ur_recv_arm(int sock){ (void)sock; }
+static void ur_send_start(int sock){ (void)sock; }
+static void ur_client_close(int sock){ (void)sock; }
+static int  ur_wait(int* ready, int max, int timeout_ms){ return ev_wait(ready, max, timeout_ms); }
+#endif
+
+// ----------------------------------------------------
+// Assinaturas (SL e réplica): "REQ_SUBSCRIBE <UID>" ou "REQ_SUBSCRIBE <UID>
+// LOC <n>", esta só para UID especial, autorizado como no REQ_LOCLIST (sem SU,
+// como na réplica, é ERROR(19)); "REQ_UNSUBSCRIBE [<UID>] LOC <n>" não pede
+// autorização. A cada mudança de local que interessa sai "EVT_LOC <UID> <de>
+// <para>" (-1 = fora) na conexão, sem o cliente perguntar. A assinatura de um
+// UID fica no shard dono dele; a de um local, em todos os workers (SM_SUB),
+// porque qualquer shard pode ter alguém entrando nele. Quem detecta a mudança manda
+// uma SM_EVENT por worker de destino com os assinantes de lá.
+//
+// Assinante lento (saída acima de SUB_TX_MAX) não acumula texto: o evento
+// espera numa fila de tamanho fixo com um evento por UID (o novo atualiza o
+// "para" do que já está lá). Com a fila cheia o evento se perde e, quando ela
+// esvazia, sai "EVT_LOST <n>": o cliente relê o que precisar.
+typedef struct {
+    int worker, sock, client_id;
+} SubTarget;
+typedef struct {
+    SubTarget* t;
+    int count, cap;
+} SubList;
+typedef struct {
+    uint64_t uid;
+    int16_t  from, to;
+} SubEvent;
+typedef struct SubQueue {
+    SubEvent ev[SUB_QUEUE];     // anel
+    uint32_t head, count;
+    uint64_t lost;
+    UidIndex ix;                // uid => posição no anel (pode apontar para evento que já saiu)
+} SubQueue;
+typedef struct {
+    int sock, client_id;
+} SubRef;                       // assinante no corpo da SM_EVENT
+
+static __thread SubList  sub_loc[MAX_LOC+1];
+static __thread SubList* sub_uid;       // listas por UID, na posição do sub_uid_ix
+static __thread int      sub_uid_count, sub_uid_cap;
+static __thread UidIndex sub_uid_ix;    // sem remoção: a lista de quem cancelou fica vazia
+static __thread int      sub_total;     // assinaturas neste worker: 0 => nada a notificar
+static __thread uint64_t sub_evt_next;
+
+static int sub_same(const SubTarget* a, const SubTarget* b){
+    return a->worker==b->worker && a->sock==b->sock && a->client_id==b->client_id;
+}
+static int sub_add(SubList* l, const SubTarget* t){
+    for (int i=0; i<l->count; i++) {
+        if (sub_same(&l->t[i], t)) return 0;
+    }
+    if (grow_array((void**)&l->t, &l->cap, l->count+1, sizeof(SubTarget))<0) return -1;
+    l->t[l->count++] = *t;
+    sub_total++;
+    return 0;
+}
+static void sub_del(SubList* l, const SubTarget* t){
+    for (int i=0; i<l->count; i++) {
+        if (!sub_same(&l->t[i], t)) continue;
+        l->t[i] = l->t[--l->count];
+        sub_total--;
+        return;
+    }
+}
+// Lista do uid; NULL se não há (e create=0 ou sem memória)
+static SubList* sub_uid_list(uint64_t uid, int create){
+    int i = uid_index_find(&sub_uid_ix, uid);
+    if (i>=0) return &sub_uid[i];
+    if (!create) return NULL;
+    if (grow_array((void**)&sub_uid, &sub_uid_cap, sub_uid_count+1, sizeof(SubList))<0) return NULL;
+    if (uid_index_insert(&sub_uid_ix, uid, sub_uid_count)<0) return NULL;
+    memset(&sub_uid[sub_uid_count], 0, sizeof(SubList));
+    return &sub_uid[sub_uid_count++];
+}
+// O cliente saiu: tira ele de todas as listas deste worker
+static void sub_forget(const SubTarget* t){
+    if (!sub_total) return;
+    for (int l=1; l<=MAX_LOC; l++) sub_del(&sub_loc[l], t);
+    for (int k=0; k<sub_uid_count; k++) sub_del(&sub_uid[k], t);
+}
+
+// "EVT_LOC <UID> <de> <para>\n" na saída do cliente
+static void sub_write(int sock, uint64_t uid, int from, int to){
+    char m[48];
+    char* p = m;
+    memcpy(p, "EVT_LOC ", 8);
+    uid_digits(uid, p+8);
+    p += 18;
+    for (int k=0, v=from; k<2; k++, v=to) {
+        *p++ = ' ';
+        if (v<0) {
+            *p++ = '-';
+            v = -v;
+        }
+        p = put_dec(p, (uint64_t)v);
+    }
+    *p++ = '\n';
+    client_send(sock, m, p-m);
+    wstats.evt_sent++;
+}
+
+// Saída ainda não enviada do cliente (com -U, também a que está no anel)
+static size_t sub_backlog(const Client* c){
+    size_t q = tx_pending(&c->tx);
+    if (c->ur_send) q += tx_pending(&c->ur_send->buf);
+    return q;
+}
+
+static void sub_queue_free(SubQueue* q){
+    if (!q) return;
+    free(q->ix.slots);
+    free(q);
+}
+
+// Evento para a fila do assinante lento: junta com o do mesmo UID, se ainda na fila
+static void sub_enqueue(Client* c, uint64_t uid, int from, int to){
+    SubQueue* q = c->subq;
+    if (!q) {
+        q = c->subq = calloc(1, sizeof(SubQueue));
+        if (!q) return;
+    }
+    uint64_t* slot = uid_index_ref(&q->ix, uid);
+    if (slot) {
+        uint32_t pos = (uint32_t)(*slot & SLOT_IDX_MASK) - 1;
+        if ((pos-q->head) % SUB_QUEUE < q->count && q->ev[pos].uid==uid) {
+            q->ev[pos].to = (int16_t)to;
+            wstats.evt_merged++;
+            return;
+        }
+    }
+    if (q->count==SUB_QUEUE) {
+        q->lost++;
+        wstats.evt_lost++;
+        return;
+    }
+    uint32_t pos = (q->head+q->count) % SUB_QUEUE;
+    q->ev[pos] = (SubEvent){ uid, (int16_t)from, (int16_t)to };
+    q->count++;
+    if (slot) {
+        *slot = uid<<SLOT_IDX_BITS | (uint64_t)(pos+1);
+        return;
+    }
+    // sem remoção no índice: refaz só com os eventos da fila quando cresce demais
+    if (q->ix.count>=2*SUB_QUEUE) {
+        memset(q->ix.slots, 0, (size_t)q->ix.cap*sizeof(uint64_t));
+        q->ix.count = 0;
+        for (uint32_t k=0; k<q->count; k++) {
+            uint32_t p = (q->head+k) % SUB_QUEUE;
+            uid_index_insert(&q->ix, q->ev[p].uid, (int)p);
+        }
+        return;
+    }
+    uid_index_insert(&q->ix, uid, (int)pos);
+}
+
+// Saída do cliente esvaziou: manda o que der da fila
+static void sub_flush(int sock){
+    Client* c = &clients[sock];
+    SubQueue* q = c->subq;
+    while (q->count && sub_backlog(c)<SUB_TX_MAX) {
+        SubEvent e = q->ev[q->head];
+        q->head = (q->head+1) % SUB_QUEUE;
+        q->count--;
+        // foi e voltou enquanto esperava
+        if (e.from!=e.to) sub_write(sock, e.uid, e.from, e.to);
+    }
+    if (q->count) return;
+    if (q->lost) {
+        char m[32] = "EVT_LOST ";
+        char* p = put_dec(m+9, q->lost);
+        *p++ = '\n';
+        client_send(sock, m, p-m);
+    }
+    sub_queue_free(q);
+    c->subq = NULL;
+}
+
+// Evento id para o cliente deste worker; o mesmo id pode vir por mais de uma assinatura
+static void sub_deliver(int sock, int client_id, uint64_t id, uint64_t uid, int from, int to){
+    if (get_client_index_by_socket(sock)<0 || clients[sock].id!=client_id) return;
+    Client* c = &clients[sock];
+    if (c->evt_last==id) return;
+    c->evt_last = id;
+    if (!c->subq && sub_backlog(c)<SUB_TX_MAX) sub_write(sock, uid, from, to);
+    else sub_enqueue(c, uid, from, to);
+}
+
+// O uid foi de from para to (-1 = fora) neste shard
+static void sub_notify(uint64_t uid, int from, int to){
+    if (!sub_total || from==to) return;
+    SubList* ls[3];
+    int nl = 0;
+    SubList* u = sub_uid_list(uid, 0);
+    if (u && u->count) ls[nl++] = u;
+    if (from>0 && sub_loc[from].count) ls[nl++] = &sub_loc[from];
+    if (to>0 && sub_loc[to].count) ls[nl++] = &sub_loc[to];
+    if (!nl) return;
+    uint64_t id = ++sub_evt_next<<WORKER_BITS | (uint64_t)worker_id;
+    // os dos outros workers vão juntos, uma mensagem por worker
+    int per[MAX_WORKERS] = {0};
+    for (int k=0; k<nl; k++) {
+        for (int i=0; i<ls[k]->count; i++) {
+            const SubTarget* t = &ls[k]->t[i];
+            if (t->worker==worker_id) sub_deliver(t->sock, t->client_id, id, uid, from, to);
+            else per[t->worker]++;
+        }
+    }
+    ShardMsg* out[MAX_WORKERS] = {0};
+    for (int w=0; w<n_workers; w++) {
+        if (!per[w] || !(out[w] = msg_new(SM_EVENT, per[w]*sizeof(SubRef)))) continue;
+        out[w]->uid = uid;
+        out[w]->a   = from;
+        out[w]->op  = to;
+        out[w]->seq = id;
+        out[w]->len = 0;
+    }
+    for (int k=0; k<nl; k++) {
+        for (int i=0; i<ls[k]->count; i++) {
+            const SubTarget* t = &ls[k]->t[i];
+            ShardMsg* m = out[t->worker];
+            if (t->worker==worker_id || !m) continue;
+            SubRef r = { t->sock, t->client_id };
+            memcpy(m->data+m->len, &r, sizeof(r));
+            m->len += sizeof(r);
+        }
+    }
+    for (int w=0; w<n_workers; w++) {
+        if (out[w]) shard_post(w, out[w]);
+    }
+}
+
+// SM_EVENT: assinantes deste worker
+static void sub_event_in(const ShardMsg* m){
+    const SubRef* r = (const SubRef*)m->data;
+    for (size_t i=0; i<m->len/sizeof(SubRef); i++) {
+        sub_deliver(r[i].sock, r[i].client_id, m->seq, m->uid, m->a, m->op);
+    }
+}
+
+// Assinatura de local: aqui e em todos os outros workers
+static void sub_loc_set(const ReplyTo* to, int loc, int on){
+    SubTarget t = { to->worker, to->sock, to->client_id };
+    if (on) sub_add(&sub_loc[loc], &t);
+    else    sub_del(&sub_loc[loc], &t);
+    for (int w=0; w<n_workers; w++) {
+        if (w==worker_id) continue;
+        ShardMsg* m = msg_new(SM_SUB, 0);
+        if (!m) continue;
+        m->to = *to;
+        m->a  = loc;
+        m->op = on;
+        shard_post(w, m);
+    }
+}
+
+// close_and_remove_client(): os workers esquecem o cliente
+static void sub_client_gone(int sock){
+    Client* c = &clients[sock];
+    sub_queue_free(c->subq);
+    c->subq = NULL;
+    if (!c->subs) return;
+    ReplyTo to = { worker_id, sock, c->id, 0, 0, 0, 0 };
+    SubTarget t = { worker_id, sock, c->id };
+    sub_forget(&t);
+    for (int w=0; w<n_workers; w++) {
+        if (w==worker_id) continue;
+        ShardMsg* m = msg_new(SM_UNSUB_ALL, 0);
+        if (!m) continue;
+        m->to = to;
+        shard_post(w, m);
+    }
+}
+
+// ----------------------------------------------------
+// Histórico de movimentos (SL e réplica): cada mudança de local vira uma
+// transição (ms, UID, de, para) no shard dono do UID. O bloco aberto guarda
+// HIST_BLOCK transições em colunas largas; cheio, é selado em colunas com
+// referência (ts - t_min e uid - uid_min na menor largura em bytes que cabe,
+// de e para com 1 byte, 0 = fora). O índice de cada bloco (intervalo de
+// tempo, faixa e Bloom dos UIDs, locais de destino) pula os blocos que não
+// interessam, e dentro do bloco o ts ordenado dá o começo por busca binária.
+// -H limita a memória (e a idade, conferida ao selar): os blocos mais
+// antigos saem primeiro, e janela que começa antes do que ficou (ou antes de
+// o worker subir) é ERROR(24); falta de memória na resposta é ERROR(25).
+// Só em memória: não passa pelo WAL nem pela sincronização das réplicas.
+typedef struct {
+    int64_t  t_min, t_max;
+    uint64_t uid_min, uid_max;
+    uint32_t count;
+    int64_t  t_base;                 // somado às colunas: t_min/uid_min, 0 no bloco aberto
+    uint64_t uid_base;
+    uint8_t  tw, uw;                 // largura em bytes das colunas ts e uid
+    uint64_t locs[(MAX_LOC+64)/64];  // locais de destino presentes no bloco
+    uint64_t* bloom;                 // HIST_BLOOM bits dos UIDs
+    uint8_t* ts;                     // colunas em data
+    uint8_t* uid;
+    uint8_t* from;
+    uint8_t* to;
+    uint8_t* data;
+} HistBlock;
+typedef struct {
+    int64_t  ts;
+    uint64_t uid;
+} HistHit;
+
+static size_t  hist_budget = HIST_MB<<20;   // -H: bytes de todos os workers; 0 desliga
+static int64_t hist_max_age = 0;            // -H MB:Secs, em ms; 0 => sem limite de idade
+static __thread HistBlock  hist_cur;        // bloco aberto: ts e uid com 8 bytes
+static __thread HistBlock* hist_blocks;     // selados, do mais antigo, a partir de hist_first
+static __thread int        hist_first, hist_nblocks, hist_cap;
+static __thread size_t     hist_bytes;      // memória dos selados
+static __thread int64_t    hist_events;     // transições guardadas
+static __thread int64_t    hist_horizon;    // transições até aqui podem ter saído
+static __thread int64_t    hist_last;       // ts da última: o relógio pode voltar
+
+static int64_t wall_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// O que houve até agora não está no histórico (início do worker, carga da réplica)
+static void hist_gap(void){
+    int64_t t = wall_ms();
+    if (t>hist_horizon) hist_horizon = t;
+}
+
+// Inteiros little-endian de w bytes (0..8)
+static uint64_t hist_get(const uint8_t* p, int w){
+    uint64_t v = 0;
+    memcpy(&v, p, w);
+    return v;
+}
+static void hist_put(uint8_t* p, uint64_t v, int w){
+    memcpy(p, &v, w);
+}
+static int hist_width(uint64_t range){
+    int w = 0;
+    while (w<8 && range>>(8*w)) w++;
+    return w;
+}
+
+static int64_t hb_ts(const HistBlock* b, uint32_t i){
+    return b->t_base + (int64_t)hist_get(b->ts + (size_t)i*b->tw, b->tw);
+}
+static uint64_t hb_uid(const HistBlock* b, uint32_t i){
+    return b->uid_base + hist_get(b->uid + (size_t)i*b->uw, b->uw);
+}
+static int hb_loc(uint8_t v){
+    return v ? v : -1;
+}
+// Primeira transição do bloco com ts >= t (count se nenhuma)
+static uint32_t hb_first(const HistBlock* b, int64_t t){
+    uint32_t lo = 0, hi = b->count;
+    while (lo<hi) {
+        uint32_t mid = (lo+hi)/2;
+        if (hb_ts(b, mid)<t) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Bloom com 3 posições de 15 bits tiradas de um produto (outro multiplicador que o do índice)
+static uint32_t hist_bloom_bit(uint64_t uid, int k){
+    return (uint32_t)((uid * 0xD6E8FEB86659FD93ull) >> (49-15*k)) & (HIST_BLOOM-1);
+}
+static void hist_bloom_add(uint64_t* bloom, uint64_t uid){
+    for (int k=0; k<3; k++) {
+        uint32_t bit = hist_bloom_bit(uid, k);
+        bloom[bit>>6] |= 1ull<<(bit&63);
+    }
+}
+static int hb_may_have(const HistBlock* b, uint64_t uid){
+    if (!b->count || uid<b->uid_min || uid>b->uid_max) return 0;
+    for (int k=0; k<3; k++) {
+        uint32_t bit = hist_bloom_bit(uid, k);
+        if (!(b->bloom[bit>>6]>>(bit&63) & 1)) return 0;
+    }
+    return 1;
+}
+
+static int hist_open(void){
+    HistBlock* c = &hist_cur;
+    if (!c->data) {
+        c->data = malloc((size_t)HIST_BLOCK*18);
+        if (!c->data) return -1;
+        c->tw = c->uw = 8;
+        c->ts   = c->data;
+        c->uid  = c->ts + (size_t)HIST_BLOCK*8;
+        c->from = c->uid + (size_t)HIST_BLOCK*8;
+        c->to   = c->from + HIST_BLOCK;
+    }
+    if (!c->bloom && !(c->bloom = calloc(HIST_BLOOM/64, sizeof(uint64_t)))) return -1;
+    return 0;
+}
+
+static void hist_drop_oldest(void){
+    HistBlock* b = &hist_blocks[hist_first];
+    if (b->t_max>hist_horizon) hist_horizon = b->t_max;
+    hist_bytes  -= sizeof(HistBlock) + HIST_BLOOM/8 + (size_t)b->count*(b->tw+b->uw+2);
+    hist_events -= b->count;
+    free(b->data);
+    free(b->bloom);
+    hist_first++;
+    hist_nblocks--;
+}
+
+// Sem memória para selar: o bloco aberto é descartado como se tivesse saído
+static void hist_discard_open(void){
+    HistBlock* c = &hist_cur;
+    if (c->t_max>hist_horizon) hist_horizon = c->t_max;
+    hist_events -= c->count;
+    c->count = 0;
+    memset(c->locs, 0, sizeof(c->locs));
+    memset(c->bloom, 0, HIST_BLOOM/8);
+}
+
+// Bloco aberto cheio => selado, na menor largura; depois aplica a retenção
+static void hist_seal(void){
+    HistBlock* c = &hist_cur;
+    HistBlock s = *c;
+    uint32_t n = c->count;
+    s.t_base   = c->t_min;
+    s.uid_base = c->uid_min;
+    s.tw = (uint8_t)hist_width((uint64_t)(c->t_max - c->t_min));
+    s.uw = (uint8_t)hist_width(c->uid_max - c->uid_min);
+    size_t size = (size_t)n*(s.tw+s.uw+2);
+    if (hist_first+hist_nblocks==hist_cap && hist_first>0) {
+        memmove(hist_blocks, hist_blocks+hist_first, (size_t)hist_nblocks*sizeof(HistBlock));
+        hist_first = 0;
+    }
+    s.data = malloc(size);
+    if (!s.data || grow_array((void**)&hist_blocks, &hist_cap, hist_first+hist_nblocks+1, sizeof(HistBlock))<0) {
+        free(s.data);
+        hist_discard_open();
+        return;
+    }
+    s.ts   = s.data;
+    s.uid  = s.ts + (size_t)n*s.tw;
+    s.from = s.uid + (size_t)n*s.uw;
+    s.to   = s.from + n;
+    for (uint32_t i=0; i<n; i++) {
+        hist_put(s.ts + (size_t)i*s.tw, hist_get(c->ts + (size_t)i*8, 8) - (uint64_t)c->t_min, s.tw);
+        hist_put(s.uid + (size_t)i*s.uw, hist_get(c->uid + (size_t)i*8, 8) - c->uid_min, s.uw);
+    }
+    memcpy(s.from, c->from, n);
+    memcpy(s.to, c->to, n);
+    hist_blocks[hist_first + hist_nblocks++] = s;
+    hist_bytes += sizeof(HistBlock) + HIST_BLOOM/8 + size;
+    // o aberto recomeça com um Bloom novo (o antigo foi com o selado)
+    c->bloom = NULL;
+    c->count = 0;
+    memset(c->locs, 0, sizeof(c->locs));
+    size_t budget = hist_budget/n_workers;
+    int64_t oldest = hist_max_age ? wall_ms() - hist_max_age : INT64_MIN;
+    while (hist_nblocks && (hist_bytes>budget || hist_blocks[hist_first].t_max<oldest)) hist_drop_oldest();
+}
+
+// O uid foi de from para to (-1 = fora) neste shard
+static void hist_append(uint64_t uid, int from, int to){
+    if (!hist_budget || from==to || hist_open()<0) return;
+    HistBlock* c = &hist_cur;
+    int64_t t = wall_ms();
+    if (t<hist_last) t = hist_last;
+    hist_last = t;
+    uint32_t i = c->count;
+    if (i==0) {
+        c->t_min = t;
+        c->uid_min = c->uid_max = uid;
+    }
+    c->t_max = t;
+    if (uid<c->uid_min) c->uid_min = uid;
+    if (uid>c->uid_max) c->uid_max = uid;
+    hist_put(c->ts + (size_t)i*8, (uint64_t)t, 8);
+    hist_put(c->uid + (size_t)i*8, uid, 8);
+    c->from[i] = (uint8_t)(from>0 ? from : 0);
+    c->to[i]   = (uint8_t)(to>0 ? to : 0);
+    if (to>0) c->locs[to>>6] |= 1ull<<(to&63);
+    hist_bloom_add(c->bloom, uid);
+    c->count++;
+    hist_events++;
+    if (c->count==HIST_BLOCK) hist_seal();
+}
+
+// Bloco k em ordem de tempo: os selados e, por último, o aberto
+static const HistBlock* hist_block(int k){
+    return k<hist_nblocks ? &hist_blocks[hist_first+k] : &hist_cur;
+}
+
+// "RES_USRHIST <loc em t1>[ <ts>:<loc> ...]" com as mudanças em (t1, t2].
+// O local em t1 é o "de" da primeira mudança depois de t1; sem nenhuma, o atual.
+static void hist_usr_reply(const ReplyTo* to, uint64_t uid, int64_t t1, int64_t t2){
+    if (!hist_budget || t1<hist_horizon) {
+        reply_send(to, "ERROR(24)\n", 10);
+        return;
+    }
+    TxBuf out = {0};
+    int at = -2;   // ainda não se sabe
+    int n = 0;
+    for (int k=0; k<=hist_nblocks; k++) {
+        const HistBlock* b = hist_block(k);
+        if (!b->count || b->t_max<=t1) continue;
+        if (at!=-2 && b->t_min>t2) break;
+        if (!hb_may_have(b, uid)) continue;
+        uint64_t key = uid - b->uid_base;
+        for (uint32_t i=hb_first(b, t1+1); i<b->count; i++) {
+            if (hist_get(b->uid + (size_t)i*b->uw, b->uw)!=key) continue;
+            int64_t ts = hb_ts(b, i);
+            if (at==-2) at = hb_loc(b->from[i]);
+            if (ts>t2) goto done;
+            if (n++==HIST_HITS_MAX) {
+                tx_append(&out, " MORE", 5);
+                goto done;
+            }
+            char* p = tx_reserve(&out, 48);
+            if (!p) goto done;
+            char* q = p;
+            *q++ = ' ';
+            q = put_dec(q, (uint64_t)ts);
+            *q++ = ':';
+            int l = hb_loc(b->to[i]);
+            if (l<0) {
+                *q++ = '-';
+                l = -l;
+            }
+            q = put_dec(q, (uint64_t)l);
+            out.len += q-p;
+        }
+    }
+done:
+    if (at==-2) {
+        int idx = find_sl_record(uid);
+        if (idx<0) {
+            tx_free(&out);
+            reply_send(to, "ERROR(18)\n", 10);
+            return;
+        }
+        at = sl_location(idx);
+    }
+    char head[32];
+    int hl = snprintf(head, sizeof(head), "RES_USRHIST %d", at);
+    TxBuf r = {0};
+    tx_append(&r, head, hl);
+    if (tx_pending(&out)) tx_append(&r, out.data+out.off, tx_pending(&out));
+    tx_append(&r, "\n", 1);
+    reply_send(to, r.data+r.off, tx_pending(&r));
+    tx_free(&r);
+    tx_free(&out);
+}
+
+// Entradas em loc com ts em [t1, t2] neste shard, em ordem, até HIST_HITS_MAX+1;
+// -1 se a janela começa antes do que ficou, -2 sem memória
+static int hist_entered(TxBuf* out, int loc, int64_t t1, int64_t t2){
+    if (!hist_budget || t1<hist_horizon) return -1;
+    int n = 0;
+    for (int k=0; k<=hist_nblocks && n<=HIST_HITS_MAX; k++) {
+        const HistBlock* b = hist_block(k);
+        if (!b->count || b->t_max<t1) continue;
+        if (b->t_min>t2) break;
+        if (!(b->locs[loc>>6]>>(loc&63) & 1)) continue;
+        const uint8_t* p   = b->to + hb_first(b, t1);
+        const uint8_t* end = b->to + b->count;
+        while (n<=HIST_HITS_MAX && (p = memchr(p, loc, end-p))) {
+            uint32_t i = (uint32_t)(p - b->to);
+            HistHit h = { hb_ts(b, i), hb_uid(b, i) };
+            if (h.ts>t2) break;
+            if (tx_append(out, &h, sizeof(h))<0) return -2;
+            n++;
+            p++;
+        }
+    }
+    return 0;
+}
+
+// REQ_LOCHIST junta as entradas de todos os shards, como o inspect
+typedef struct {
+    ReplyTo to;
+    int     remaining;
+    int     too_old;
+    int     nomem;       // algum shard ficou de fora
+    TxBuf   acc;         // HistHit
+} HistGather;
+
+static int hist_hit_cmp(const void* a, const void* b){
+    const HistHit* x = a;
+    const HistHit* y = b;
+    if (x->ts!=y->ts) return x->ts<y->ts ? -1 : 1;
+    return x->uid<y->uid ? -1 : x->uid>y->uid;
+}
+
+static void hist_gather_part(HistGather* g, int too_old, int lost, const char* part, size_t len){
+    g->too_old |= too_old;
+    g->nomem |= lost;
+    if (len && tx_append(&g->acc, part, len)<0) g->nomem = 1;
+    if (--g->remaining>0) return;
+    if (g->too_old) {
+        reply_local(&g->to, "ERROR(24)\n", 10);
+    } else if (g->nomem) {
+        reply_local(&g->to, "ERROR(25)\n", 10);
+    } else if (!tx_pending(&g->acc)) {
+        reply_local(&g->to, "RES_LOCHIST EMPTY\n", 18);
+    } else {
+        HistHit* h = (HistHit*)(g->acc.data+g->acc.off);
+        size_t n = tx_pending(&g->acc)/sizeof(HistHit);
+        qsort(h, n, sizeof(HistHit), hist_hit_cmp);
+        size_t shown = n>HIST_HITS_MAX ? HIST_HITS_MAX : n;
+        TxBuf r = {0};
+        char* p = tx_reserve(&r, 12 + shown*32 + 6);
+        if (p) {
+            char* q = p;
+            memcpy(q, "RES_LOCHIST", 11);
+            q += 11;
+            for (size_t i=0; i<shown; i++) {
+                *q++ = ' ';
+                q = put_dec(q, (uint64_t)h[i].ts);
+                *q++ = ':';
+                uid_digits(h[i].uid, q);
+                q += 10;
+            }
+            if (n>shown) {
+                memcpy(q, " MORE", 5);
+                q += 5;
+            }
+            *q++ = '\n';
+            reply_local(&g->to, p, q-p);
+        } else {
+            reply_local(&g->to, "ERROR(25)\n", 10);
+        }
+        tx_free(&r);
+    }
+    tx_free(&g->acc);
+    free(g);
+}
+
+static void hist_gather_start(const ReplyTo* to, int loc, int64_t t1, int64_t t2){
+    HistGather* g = calloc(1, sizeof(*g));
+    if (!g) {
+        reply_send(to, "ERROR(25)\n", 10);
+        return;
+    }
+    g->to = *to;
+    g->remaining = n_workers;
+    int64_t win[2] = { t1, t2 };
+    for (int w=0; w<n_workers; w++) {
+        if (w==worker_id) continue;
+        ShardMsg* m = msg_new(SM_HIST_COLLECT, sizeof(win));
+        if (!m) {
+            g->remaining--;
+            g->nomem = 1;
+            continue;
+        }
+        memcpy(m->data, win, sizeof(win));
+        m->to = *to;
+        m->a = loc;
+        m->ctx = g;
+        shard_post(w, m);
+    }
+    TxBuf mine = {0};
+    int r = hist_entered(&mine, loc, t1, t2);
+    hist_gather_part(g, r==-1, r==-2, mine.data ? mine.data+mine.off : NULL, tx_pending(&mine));
+    tx_free(&mine);
+}
+
+// ----------------------------------------------------
+// Envio para o peer: texto por padrão, quadros binários depois da negociação
+// Só acumula; peer_flush() no fim da iteração do loop (ou ao passar de -f bytes).
+// O que o socket não aceitar fica na fila até ele poder ser escrito.
+static void peer_flush_one(int p){
+    Peer* pr = &peers[p];
+    if (pr->sock==-1) return;
+    int r = tx_flush(pr->sock, &pr->tx);
+    // erro: a leitura vai perceber a queda do peer
+    if (r<0) r = 0;
+    if (r!=pr->want_write) {
+        ev_set_write(pr->sock, r);
+        pr->want_write = r;
+    }
+}
+static void peer_flush(void){
+    wal_commit();
+    for (int p=0; p<MAX_PEERS; p++) peer_flush_one(p);
+}
+// SL: slot do SU; -1 se não está conectado
+static int peer_first(void){
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (peers[p].sock!=-1) return p;
+    }
+    return -1;
+}
+static void peer_send(int p, const void* msg, size_t len){
+    if (p==PEER_ANY) p = peer_first();
+    if (p<0 || peers[p].sock==-1) return;
+    tx_append(&peers[p].tx, msg, len);
+    if (tx_pending(&peers[p].tx)>=peer_flush_bytes) {
+        wal_commit();
+        peer_flush_one(p);
+    }
+}
+
+// Preenche o tamanho no início do quadro; retorna o tamanho total
+static size_t frame_end(uint8_t* out, const uint8_t* end){
+    put_u16(out, (uint16_t)(end-out-2));
+    return end-out;
+}
+
+// Texto: "<CMD> <UID>" seguido do resto formatado por fmt
+static size_t enc_text(char* out, const char* cmd, uint64_t uid, const char* fmt, ...){
+    size_t n = strlen(cmd);
+    memcpy(out, cmd, n);
+    out[n++] = ' ';
+    uid_digits(uid, out+n);
+    n += 10;
+    va_list ap;
+    va_start(ap, fmt);
+    n += vsnprintf(out+n, PEER_MSG_MAX-n, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+// Codificadores: escrevem em out (PEER_MSG_MAX bytes) e retornam o tamanho
+static size_t enc_req_locreg(char* out, int bin, uint64_t uid, int loc, uint32_t rid){
+    if (!bin) return enc_text(out, "REQ_LOCREG", uid, " %d %u\n", loc, rid);
+    uint8_t* p = (uint8_t*)out+2;
+    *p++ = PB_REQ_LOCREG;
+    p = put_u64(p, uid);
+    p = put_u16(p, (uint16_t)loc);
+    p = put_u32(p, rid);
+    return frame_end((uint8_t*)out, p);
+}
+static size_t enc_res_locreg(char* out, int bin, uint64_t uid, int oldLoc, int has_rid, uint32_t rid, uint64_t seq){
+    if (!bin) {
+        if (!has_rid) return enc_text(out, "RES_LOCREG", uid, " %d\n", oldLoc);
+        return enc_text(out, "RES_LOCREG", uid, " %d %u %llu\n", oldLoc, rid, (unsigned long long)seq);
+    }
+    uint8_t* p = (uint8_t*)out+2;
+    *p++ = PB_RES_LOCREG;
+    p = put_u64(p, uid);
+    p = put_u16(p, (uint16_t)oldLoc);
+    p = put_u32(p, rid);
+    p = put_u64(p, seq);
+    return frame_end((uint8_t*)out, p);
+}
+static size_t enc_req_usrauth(char* out, int bin, uint64_t uid, uint32_t rid){
+    if (!bin) return enc_text(out, "REQ_USRAUTH", uid, " %u\n", rid);
+    uint8_t* p = (uint8_t*)out+2;
+    *p++ = PB_REQ_USRAUTH;
+    p = put_u64(p, uid);
+    p = put_u32(p, rid);
+    return frame_end((uint8_t*)out, p);
+}
+static size_t enc_res_usrauth(char* out, int bin, int spec, int has_rid, uint32_t rid){
+    if (!bin) {
+        if (!has_rid) return snprintf(out, PEER_MSG_MAX, "RES_USRAUTH(%d)\n", spec);
+        return snprintf(out, PEER_MSG_MAX, "RES_USRAUTH(%d) %u\n", spec, rid);
+    }
+    uint8_t* p = (uint8_t*)out+2;
+    *p++ = PB_RES_USRAUTH;
+    *p++ = (uint8_t)spec;
+    p = put_u32(p, rid);
+    return frame_end((uint8_t*)out, p);
+}
+
+static size_t enc_auth_inv(char* out, int bin, uint64_t uid){
+    if (!bin) return enc_text(out, "AUTHINV", uid, "\n");
+    uint8_t* p = (uint8_t*)out+2;
+    *p++ = PB_AUTH_INV;
+    p = put_u64(p, uid);
+    return frame_end((uint8_t*)out, p);
+}
+
+// Nos outros workers a mensagem vai para o worker 0, que é quem fala com o peer
+static int peer_post(int p, int op, uint64_t uid, int a, int has_rid, uint32_t rid, uint64_t seq){
+    if (worker_id==0) return 0;
+    ShardMsg* m = msg_new(SM_PEER_OUT, 0);
+    if (!m) return 1;
+    m->peer = p;
+    m->op = op;
+    m->uid = uid;
+    m->a = a;
+    m->has_rid = has_rid;
+    m->rid = rid;
+    m->seq = seq;
+    shard_post(0, m);
+    return 1;
+}
+// Modo de envio do peer p (PEER_ANY => o SU)
+static int peer_bin(int p){
+    if (p==PEER_ANY) p = peer_first();
+    return p>=0 && peers[p].tx_bin;
+}
+
+static void peer_send_req_locreg(int p, uint64_t uid, int loc, uint32_t rid){
+    if (peer_post(p, PB_REQ_LOCREG, uid, loc, 1, rid, 0)) return;
+    char m[PEER_MSG_MAX];
+    peer_send(p, m, enc_req_locreg(m, peer_bin(p), uid, loc, rid));
+}
+static void peer_send_res_locreg(int p, uint64_t uid, int oldLoc, int has_rid, uint32_t rid, uint64_t seq){
+    if (peer_post(p, PB_RES_LOCREG, uid, oldLoc, has_rid, rid, seq)) return;
+    char m[PEER_MSG_MAX];
+    peer_send(p, m, enc_res_locreg(m, peer_bin(p), uid, oldLoc, has_rid, rid, seq));
+}
+static void peer_send_req_usrauth(int p, uint64_t uid, uint32_t rid){
+    if (peer_post(p, PB_REQ_USRAUTH, uid, 0, 1, rid, 0)) return;
+    char m[PEER_MSG_MAX];
+    peer_send(p, m, enc_req_usrauth(m, peer_bin(p), uid, rid));
+}
+static void peer_send_res_usrauth(int p, int spec, int has_rid, uint32_t rid){
+    if (peer_post(p, PB_RES_USRAUTH, 0, spec, has_rid, rid, 0)) return;
+    char m[PEER_MSG_MAX];
+    peer_send(p, m, enc_res_usrauth(m, peer_bin(p), spec, has_rid, rid));
+}
+// SU: o is_special do uid mudou; avisa os SLs que guardam autorizações
+static void peer_send_auth_inv(uint64_t uid){
+    if (peer_post(PEER_ANY, PB_AUTH_INV, uid, 0, 0, 0, 0)) return;
+    char m[PEER_MSG_MAX];
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (peers[p].sock==-1 || !peers[p].auth_inv) continue;
+        peer_send(p, m, enc_auth_inv(m, peers[p].tx_bin, uid));
+    }
+}
+static void peer_send_op(int p, int op, const char* text){
+    if (!peers[p].tx_bin) {
+        peer_send(p, text, strlen(text));
+        return;
+    }
+    uint8_t f[3];
+    frame_end(f, f+3);
+    f[2] = op;
+    peer_send(p, f, 3);
+}
+// SU: muitas mudanças de uma vez (REQ_USRIMPORT); o SL esvazia o cache todo
+static void peer_send_auth_flush(void){
+    if (peer_post(PEER_ANY, PB_AUTH_CACHE, 0, 0, 0, 0, 0)) return;
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (peers[p].sock==-1 || !peers[p].auth_inv) continue;
+        peer_send_op(p, PB_AUTH_CACHE, "AUTHCACHE\n");
+    }
+}
+static void peer_send_discpeer(int p){
+    char m[PEER_MSG_MAX];
+    snprintf(m, sizeof(m), "REQ_DISCPEER(%d)\n", peers[p].id);
+    peer_send_op(p, PB_REQ_DISCPEER, m);
+}
+
+// A partir desta linha tudo que mandamos é binário
+static void peer_start_tx_bin(int p){
+    if (peers[p].tx_bin) return;
+    peer_send(p, "BINPEER\n", 8);
+    peers[p].tx_bin = 1;
+}
+
+// kill
+void send_req_discpeer_and_exit(){
+    wal_commit();
+    for (int p=0; p<MAX_PEERS; p++){
+        if (peers[p].sock==-1) continue;
+        peer_send_discpeer(p);
+        peer_flush_one(p);
+    }
+    for (int i=0; i<clients_cap; i++){
+        if (clients[i].in_use){
+            close(i);
+            clients[i].in_use=0;
+        }
+    }
+    log_msg(LOG_INFO, "Successful disconnect\n");
+    for (int p=0; p<MAX_PEERS; p++){
+        if (peers[p].sock==-1) continue;
+        close(peers[p].sock);
+        peers[p].sock=-1;
+        log_msg(LOG_INFO, "Peer %d disconnected\n", peers[p].id);
+    }
+    exit(0);
+}
+
+// ----------------------------------------------------
+// Mensagens de cliente
+// Edge-triggered: lê até esvaziar o socket (EAGAIN). Linhas incompletas
+// ficam no buffer da conexão até a próxima leitura. Cliente pausado (fila
+// de saída cheia) não é lido; client_flush() retoma quando ela esvazia.
+// O mesmo vale enquanto o SU lê o arquivo de um REQ_USRIMPORT (importing).
+void handle_client_message(int client_sock){
+    while (get_client_index_by_socket(client_sock)>=0) {
+        RxBuf* rx = &clients[client_sock].rx;
+        size_t used;
+        char* line;
+        errno = 0;
+        while (!clients[client_sock].paused && !clients[client_sock].importing && (line = rx_line(rx, &used))) {
+            process_client_line(client_sock, line);
+            // o cliente pode ter saído (REQ_DISC)
+            if (get_client_index_by_socket(client_sock)<0) return;
+            rx_consume(rx, used);
+        }
+        if (errno==EMSGSIZE) {
+            close_and_remove_client(client_sock);
+            return;
+        }
+        if (clients[client_sock].paused || clients[client_sock].importing) {
+            ev_set_read(client_sock, 0);
+            return;
+        }
+        if (ur_on) {
+            // os dados chegam pelas conclusões do recv multishot
+            ur_recv_arm(client_sock);
+            return;
+        }
+        ssize_t valread = rx_recv(client_sock, rx);
+        if (valread<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+        if (valread<0 && errno==EINTR) continue;
+        if (valread<=0) {
+            // desconectar
+            close_and_remove_client(client_sock);
+            return;
+        }
+    }
+}
+
+// Pedido sem resposta do peer a tempo (ou peer caiu). No SU o local do
+// usuário fica desconhecido: o próximo acesso tira ele de todos os SLs.
+static void su_uar_fail(const Pending* p){
+    wstats.peer_failures++;
+    int idx = find_su_user(p->uid);
+    if (idx>=0) su_loc[idx] = 0;
+    reply_send(&p->to, "RES_USRACCESS(-1)\n",18);
+}
+static void sl_inspect_fail(const Pending* p){
+    wstats.peer_failures++;
+    reply_send(&p->to, "ERROR(19)\n",10);
+}
+
+// SL: "RES_USRLOC(loc)" ou ERROR(18) se o usuário não está em nenhum local
+static void sl_reply_usrloc(const ReplyTo* to, uint64_t u){
+    int idx = find_sl_record(u);
+    if (idx<0 || sl_location(idx)==-1) {
+        reply_send(to, "ERROR(18)\n",10);
+    } else {
+        char r[BUFFER_SIZE];
+        snprintf(r,sizeof(r),"RES_USRLOC(%d)\n", sl_location(idx));
+        reply_send(to, r,strlen(r));
+    }
+}
+// Réplica: a mudança esperada não chegou a tempo
+static void repl_wait_fail(const Pending* p){
+    wstats.repl_timeouts++;
+    reply_send(&p->to, "ERROR(21)\n",10);
+}
+
+// SU: SL dono do local; -1 se nenhum SL conectado atende o local
+static int route_owner(int loc){
+    for (int p=0; p<MAX_PEERS; p++) {
+        unsigned r = atomic_load(&peer_route[p]);
+        if (r && loc>=(int)(r>>8 & 0xff) && loc<=(int)(r & 0xff)) return p;
+    }
+    return -1;
+}
+// SU: SLs que recebem o REQ_LOCREG de um usuário que vai de old para loc
+// (-1 => fora, 0 => desconhecido): o dono do local novo e o do antigo, que
+// recebe a saída. Sem saber o antigo, todos os SLs recebem a saída.
+static uint32_t route_access(int loc, int old){
+    uint32_t targets = 0;
+    if (old==0) {
+        for (int p=0; p<MAX_PEERS; p++) {
+            if (atomic_load(&peer_route[p])) targets |= 1u<<p;
+        }
+    } else if (old>0 && route_owner(old)>=0) {
+        targets |= 1u<<route_owner(old);
+    }
+    return targets;
+}
+
+static const uint8_t cmd_stat[CMD_N] = {
+    [CMD_UNKNOWN] = ST_OTHER,         [CMD_CONN] = ST_CONN,       [CMD_DISC] = ST_DISC,
+    [CMD_STATS] = ST_STATS,           [CMD_USRADD] = ST_USRADD,   [CMD_USRACCESS] = ST_USRACCESS,
+    [CMD_USRLOC] = ST_USRLOC,         [CMD_LOCLIST] = ST_LOCLIST, [CMD_USRIMPORT] = ST_USRIMPORT,
+    [CMD_LOCCOUNT] = ST_LOCCOUNT,     [CMD_SUBSCRIBE] = ST_SUBSCRIBE, [CMD_UNSUBSCRIBE] = ST_SUBSCRIBE,
+    [CMD_USRHIST] = ST_USRHIST,       [CMD_LOCHIST] = ST_LOCHIST,
+};
+
+// SL: comandos com UID que não vão para o shard dono
+static int sl_cmd_here(const Cmd* c){
+    return c->op==CMD_LOCLIST || c->op==CMD_LOCHIST || ((c->op==CMD_SUBSCRIBE || c->op==CMD_UNSUBSCRIBE) && c->num>0);
+}
+
+void process_client_line(int client_sock, char* line){
+    int c_idx = get_client_index_by_socket(client_sock);
+    if (c_idx<0) return;
+    int c_id = clients[c_idx].id;
+    if (clients[c_idx].import) {
+        import_line(c_idx, line);
+        return;
+    }
+    // depois do REQ_DISC não há mais comandos
+    if (clients[c_idx].closing) return;
+    Cmd c;
+    cmd_parse(line, &c);
+    ReplyTo to = { worker_id, client_sock, c_id, clients[c_idx].loc, clients[c_idx].seq_next++,
+                   cmd_stat[c.op], now_ns() };
+
+    log_trace_cmd(line);
+
+    // REQ_CONN(LocId)
+    if (c.op==CMD_CONN) {
+        clients[c_idx].loc = c.num;
+        log_msg(LOG_INFO, "Client %d added (Loc %d)\n", c_id, c.num);
+        char resp[BUFFER_SIZE];
+        snprintf(resp,sizeof(resp),"RES_CONN(%d)\n", c_id);
+        reply_local(&to, resp, strlen(resp));
+        return;
+    }
+    // REQ_DISC(...): o OK(01) sai depois das respostas pendentes e fecha
+    if (c.op==CMD_DISC) {
+        clients[c_idx].closing = 1;
+        reply_local(&to, "OK(01)\n", 7);
+        return;
+    }
+
+    to.loc = clients[c_idx].loc;
+    // ao sair, os workers precisam esquecer as assinaturas do cliente
+    if (c.op==CMD_SUBSCRIBE && !is_su && !c.bad) clients[c_idx].subs = 1;
+    // REQ_USRIMPORT: as linhas de dados vêm em seguida, nesta conexão
+    if (c.op==CMD_USRIMPORT && is_su) {
+        import_begin(c_idx, &to, &c, line);
+        return;
+    }
+    // O resto roda no shard dono do UID, já convertido. REQ_LOCLIST no SL
+    // fica aqui: junta os ocupantes de todos os shards depois da autorização.
+    // A assinatura de local também: o worker do cliente avisa os outros.
+    if (n_workers>1 && c.has_uid && (is_su || !sl_cmd_here(&c))) {
+        int owner = shard_of(c.uid);
+        if (owner!=worker_id) {
+            ShardMsg* m = msg_new(SM_CMD, sizeof(c));
+            if (!m) return;
+            m->to = to;
+            memcpy(m->data, &c, sizeof(c));
+            shard_post(owner, m);
+            return;
+        }
+    }
+    exec_client_cmd(&to, &c);
+}
+
+// "OK(02) <UID>" (novo) ou "OK(03) <UID>" (atualizado)
+static void reply_usradd(const ReplyTo* to, char code, uint64_t u){
+    char r[] = "OK(0x) 0123456789\n";
+    r[4] = code;
+    uid_digits(u, r+7);
+    reply_send(to, r, sizeof(r)-1);
+}
+
+// Comandos que usam as tabelas: um handler por comando em cada papel,
+// rodando no worker dono do UID e respondendo para to
+typedef void (*CmdFn)(const ReplyTo* to, const Cmd* c);
+
+static void cmd_unknown(const ReplyTo* to, const Cmd* c){
+    (void)c;
+    reply_send(to, "UNKNOWN_CMD\n",12);
+}
+
+// REQ_STATS => "RES_STATS {json}", métricas de todos os workers
+static void cmd_stats(const ReplyTo* to, const Cmd* c){
+    (void)c;
+    stats_gather_start(to, STATS_REPLY);
+}
+
+// SU: REQ_USRADD UID is_spec
+static void su_cmd_usradd(const ReplyTo* to, const Cmd* c){
+    if (c->bad) {
+        reply_send(to, "ERROR(17)\n",10);
+        return;
+    }
+    uint64_t u = c->uid;
+    int isSpec = c->flag;
+    int idx = find_su_user(u);
+    if (idx>=0) {
+        // update
+        if (su_is_special(idx)!=isSpec) peer_send_auth_inv(u);
+        su_set_special(idx, isSpec);
+        wal_log(u, isSpec);
+        reply_usradd(to, '3', u);
+    } else {
+        if (su_user_add(u, isSpec)<0) {
+            reply_send(to, "ERROR(17)\n",10);
+        } else {
+            // usuário desconhecido valia 0 no REQ_USRAUTH
+            if (isSpec) peer_send_auth_inv(u);
+            wal_log(u, isSpec);
+            reply_usradd(to, '2', u);
+        }
+    }
+}
+
+// SU: REQ_USRACCESS UID in/out [seq]: com "seq" a resposta leva o seq da
+// mudança no SL, para ler da réplica (REQ_USRLOC UID Seq)
+static void su_cmd_usraccess(const ReplyTo* to, const Cmd* c){
+    uint64_t u = c->uid;
+    int idx = c->bad ? -1 : find_su_user(u);
+    if (idx<0) {
+        reply_send(to, "ERROR(18)\n",10);
+        return;
+    }
+    int loc = c->flag ? to->loc : -1;
+    // local fora de [1..MAX_LOC] o SL trata como saída
+    if (loc<1 || loc>MAX_LOC) loc = -1;
+    int owner = loc>0 ? route_owner(loc) : -1;
+    uint32_t targets = route_access(loc, su_loc[idx]);
+    if (owner>=0) targets |= 1u<<owner;
+
+    if (!atomic_load(&peer_up) || (loc>0 && owner<0) || !targets) {
+        // sem peer (ou sem SL para o local, ou já estava fora)
+        reply_send(to, "RES_USRACCESS(-1)\n",18);
+        return;
+    }
+    // Cada pedido tem seu id: duas portas com o mesmo UID não se sobrescrevem.
+    // O local muda já no envio: um acesso seguinte do mesmo UID sai
+    // depois deste na conexão de cada SL.
+    uint32_t rid = pending_add(&su_uar, to, u, owner, targets);
+    if (!rid) {
+        reply_send(to, "RES_USRACCESS(-1)\n",18);
+        return;
+    }
+    if (c->want_seq) pending_find(&su_uar, rid)->want_seq = 1;
+    su_loc[idx] = (int16_t)loc;
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (targets & 1u<<p) peer_send_req_locreg(p, u, p==owner ? loc : -1, rid);
+    }
+}
+
+// SL: REQ_USRLOC <UID> [Seq]: na réplica, com Seq a resposta espera essa mudança chegar
+static void sl_cmd_usrloc(const ReplyTo* to, const Cmd* c){
+    if (c->bad) {
+        reply_send(to, "ERROR(18)\n",10);
+        return;
+    }
+    if (is_replica && c->seq>repl_seq) {
+        uint32_t rid = pending_add(&repl_waits, to, c->uid, 0, 0);
+        if (!rid) {
+            reply_send(to, "ERROR(21)\n",10);
+            return;
+        }
+        pending_find(&repl_waits, rid)->seq = c->seq;
+        return;
+    }
+    sl_reply_usrloc(to, c->uid);
+}
+
+// SL: só usuário especial vê quem está num local (REQ_LOCLIST, REQ_SUBSCRIBE
+// LOC, REQ_LOCHIST): o cache ou um REQ_USRAUTH ao SU decide, e sl_authorized() segue
+static void sl_auth_start(const ReplyTo* to, const Cmd* c){
+    if (!atomic_load(&peer_up)) {
+        // sem SU => permission denied
+        reply_send(to, "ERROR(19)\n",10);
+        return;
+    }
+    int spec = auth_cache_get(c->uid);
+    if (spec>=0) {
+        wstats.auth_hits++;
+        sl_authorized(to, spec, c->op, c->num, c->t1, c->t2);
+        return;
+    }
+    // Vários inspects podem estar em andamento; o id casa a resposta
+    uint32_t rid = pending_add(&sl_inspects, to, c->uid, c->num, 0);
+    if (!rid) {
+        reply_send(to, "ERROR(19)\n",10);
+        return;
+    }
+    Pending* p = pending_find(&sl_inspects, rid);
+    p->op = c->op;
+    p->t1 = c->t1;
+    p->t2 = c->t2;
+    peer_send_req_usrauth(PEER_ANY, c->uid, rid);
+}
+
+// SL: REQ_LOCLIST <UID> <locId> => "inspect"
+static void sl_cmd_loclist(const ReplyTo* to, const Cmd* c){
+    if (c->bad) {
+        reply_send(to, "ERROR(19)\n",10);
+        return;
+    }
+    int locId = c->num;
+
+    if (loc_range_set && (locId<loc_lo || locId>loc_hi)) {
+        // local de outro SL: o inspect vai direto a ele
+        reply_send(to, "ERROR(20)\n",10);
+        return;
+    }
+    sl_auth_start(to, c);
+}
+
+// "RES_LOCCOUNT loc:n loc:n ..." só com os locais ocupados, em ordem, ou
+// "RES_LOCCOUNT EMPTY". Soma as linhas de loc_counts: O(locais), sem shards.
+#define LOCCOUNT_MAX  (32 + MAX_LOC*16)   // " 255:" + contagem de até 10 dígitos
+static size_t loccount_reply(char* out){
+    char* p = out;
+    memcpy(p, "RES_LOCCOUNT", 12);
+    p += 12;
+    for (int l=1; l<=MAX_LOC; l++) {
+        int k = 0;
+        for (int w=0; w<n_workers; w++) k += atomic_load_explicit(&loc_counts[w][l], memory_order_relaxed);
+        if (k<=0) continue;
+        *p++ = ' ';
+        p = put_dec(p, l);
+        *p++ = ':';
+        p = put_dec(p, k);
+    }
+    if (p==out+12) {
+        memcpy(p, " EMPTY", 6);
+        p += 6;
+    }
+    *p++ = '\n';
+    return p-out;
+}
+
+// SL: REQ_LOCCOUNT => ocupação de todos os locais
+static void sl_cmd_loccount(const ReplyTo* to, const Cmd* c){
+    (void)c;
+    char out[LOCCOUNT_MAX];
+    reply_send(to, out, loccount_reply(out));
+}
+
+// SL: REQ_SUBSCRIBE / REQ_UNSUBSCRIBE <UID> | <UID> LOC <n>. A de UID roda no
+// shard dono, aberta como o REQ_USRLOC; a de local, no worker do cliente, que
+// avisa os outros, e só para usuário especial, como o REQ_LOCLIST.
+static void sl_cmd_subscribe(const ReplyTo* to, const Cmd* c){
+    int on = c->op==CMD_SUBSCRIBE;
+    if (c->bad) {
+        reply_send(to, "ERROR(22)\n",10);
+        return;
+    }
+    if (!c->num) {
+        SubTarget t = { to->worker, to->sock, to->client_id };
+        SubList* l = sub_uid_list(c->uid, on);
+        if (on && (!l || sub_add(l, &t)<0)) {
+            reply_send(to, "ERROR(22)\n",10);
+            return;
+        }
+        if (!on && l) sub_del(l, &t);
+    } else {
+        if (loc_range_set && (c->num<loc_lo || c->num>loc_hi)) {
+            // local de outro SL: as mudanças dele não passam por aqui
+            reply_send(to, "ERROR(20)\n",10);
+            return;
+        }
+        if (on) {
+            sl_auth_start(to, c);
+            return;
+        }
+        sub_loc_set(to, c->num, 0);
+    }
+    reply_send(to, on ? "OK(04)\n" : "OK(05)\n", 7);
+}
+
+// SL: REQ_USRHIST <UID> <t1> <t2> => onde o UID esteve na janela (shard dono)
+static void sl_cmd_usrhist(const ReplyTo* to, const Cmd* c){
+    if (c->bad) {
+        reply_send(to, "ERROR(23)\n",10);
+        return;
+    }
+    hist_usr_reply(to, c->uid, c->t1, c->t2);
+}
+
+// SL: REQ_LOCHIST <UID> <LocId> <t1> <t2> => quem entrou no local na janela
+// (UID especial, como no inspect)
+static void sl_cmd_lochist(const ReplyTo* to, const Cmd* c){
+    if (c->bad) {
+        reply_send(to, "ERROR(23)\n",10);
+        return;
+    }
+    if (loc_range_set && (c->num<loc_lo || c->num>loc_hi)) {
+        reply_send(to, "ERROR(20)\n",10);
+        return;
+    }
+    sl_auth_start(to, c);
+}
+
+// Tabela de cada papel (is_su: 0 = SL, 1 = SU); o que falta é UNKNOWN_CMD
+static const CmdFn cmd_fns[2][CMD_N] = {
+    { [CMD_STATS] = cmd_stats, [CMD_USRLOC] = sl_cmd_usrloc, [CMD_LOCLIST] = sl_cmd_loclist,
+      [CMD_LOCCOUNT] = sl_cmd_loccount, [CMD_SUBSCRIBE] = sl_cmd_subscribe,
+      [CMD_UNSUBSCRIBE] = sl_cmd_subscribe, [CMD_USRHIST] = sl_cmd_usrhist,
+      [CMD_LOCHIST] = sl_cmd_lochist },
+    { [CMD_STATS] = cmd_stats, [CMD_USRADD] = su_cmd_usradd, [CMD_USRACCESS] = su_cmd_usraccess },
+};
+
+void exec_client_cmd(const ReplyTo* to, const Cmd* c){
+    CmdFn f = cmd_fns[is_su][c->op];
+    (f ? f : cmd_unknown)(to, c);
+}
+
+// ----------------------------------------------------
+// Importação em lote (SU): "REQ_USRIMPORT <N>" seguido de N linhas
+// "<UID> <is_special>", ou "REQ_USRIMPORT <arquivo>" com as mesmas linhas
+// num arquivo comum do diretório -I, que o SU lê IMPORT_CHUNK linhas por
+// volta do loop (as linhas seguintes do cliente esperam). Cada shard aplica
+// a sua parte de uma vez, com as tabelas já no tamanho final, e o cliente
+// recebe uma só resposta: "RES_USRIMPORT <novos> <atualizados> <rejeitados>".
+#define IMPORT_MAX      (1<<24)   // linhas por importação
+#define IMPORT_CHUNK    4096      // linhas do arquivo por volta do loop
+#define AUTH_INV_BATCH  256       // mais mudanças de is_special: esvazia o cache do SL
+
+typedef struct ImportBatch {
+    ReplyTo   to;
+    uint64_t* e;         // uid<<1 | is_special
+    int       n, cap;
+    int       left;      // linhas de dados ainda por vir
+    int       rejected;  // linhas inválidas
+    FILE*     f;         // REQ_USRIMPORT <arquivo>: ainda lendo
+    int       lines;     // lidas do arquivo, vazias inclusive
+} ImportBatch;
+
+static __thread ImportBatch** import_files;   // import_nfiles arquivos em leitura
+static __thread int           import_files_cap;
+
+typedef struct {
+    int added, updated, failed;
+} ImportCount;
+
+typedef struct {
+    ReplyTo     to;
+    int         remaining;
+    int         rejected;
+    int         lost;        // a contagem de algum shard não voltou
+    ImportCount acc;
+} ImportGather;
+
+static void import_free(ImportBatch* b){
+    if (!b) return;
+    if (b->f) {
+        fclose(b->f);
+        for (int i=0; i<import_nfiles; i++) {
+            if (import_files[i]!=b) continue;
+            import_files[i] = import_files[--import_nfiles];
+            break;
+        }
+    }
+    free(b->e);
+    free(b);
+}
+
+// "<UID> <is_special>" no lote; linha inválida só conta
+static void import_add(ImportBatch* b, const char* line){
+    const char* s = line;
+    const char* a;
+    size_t n;
+    uint64_t u;
+    if (arg_uid(&s, &u)<0 || !(a = arg_next(&s, &n))) {
+        b->rejected++;
+        return;
+    }
+    if (b->n==b->cap && grow_array((void**)&b->e, &b->cap, b->n+1, sizeof(uint64_t))<0) {
+        b->rejected++;
+        return;
+    }
+    b->e[b->n++] = u<<1 | (uint64_t)(atoi(a)!=0);
+}
+
+// Aplica as entradas do shard: reserva o tamanho final antes (no pior caso
+// todas são novas) e grava cada uma no WAL, que vai para o disco de uma vez
+static void su_import_apply(const uint64_t* e, int n, ImportCount* c){
+    uint64_t inv[AUTH_INV_BATCH];
+    int n_inv = 0;
+    su_reserve(su_count+n);
+    uid_index_reserve(&su_index, su_index.count+n);
+    for (int i=0; i<n; i++) {
+        uint64_t u = e[i]>>1;
+        int spec = (int)(e[i] & 1);
+        int idx = find_su_user(u);
+        int changed;
+        if (idx>=0) {
+            changed = su_is_special(idx)!=spec;
+            su_set_special(idx, spec);
+            c->updated++;
+        } else if (su_user_add(u, spec)<0) {
+            c->failed++;
+            continue;
+        } else {
+            // usuário desconhecido valia 0 no REQ_USRAUTH
+            changed = spec;
+            c->added++;
+        }
+        wal_log(u, spec);
+        if (changed && n_inv<=AUTH_INV_BATCH) {
+            if (n_inv<AUTH_INV_BATCH) inv[n_inv] = u;
+            n_inv++;
+        }
+    }
+    if (n_inv>AUTH_INV_BATCH) {
+        peer_send_auth_flush();
+        return;
+    }
+    for (int i=0; i<n_inv; i++) peer_send_auth_inv(inv[i]);
+}
+
+static void import_reply(const ReplyTo* to, const ImportCount* c, int rejected){
+    char r[96];
+    int len = snprintf(r, sizeof(r), "RES_USRIMPORT %d %d %d\n", c->added, c->updated, c->failed+rejected);
+    reply_local(to, r, len);
+    log_msg(LOG_INFO, "Imported %d users (%d new, %d updated, %d rejected)\n",
+            c->added+c->updated, c->added, c->updated, c->failed+rejected);
+}
+
+// c NULL: a contagem do shard se perdeu (as mudanças dele valeram)
+static void import_gather_part(ImportGather* g, const ImportCount* c){
+    if (c) {
+        g->acc.added   += c->added;
+        g->acc.updated += c->updated;
+        g->acc.failed  += c->failed;
+    } else {
+        g->lost = 1;
+    }
+    if (--g->remaining>0) return;
+    if (g->lost) reply_local(&g->to, "ERROR(17)\n", 10);
+    else         import_reply(&g->to, &g->acc, g->rejected);
+    free(g);
+}
+
+// Lote completo, no worker do cliente: cada shard recebe a sua parte
+static void import_run(ImportBatch* b){
+    if (n_workers==1) {
+        ImportCount c = {0};
+        su_import_apply(b->e, b->n, &c);
+        import_reply(&b->to, &c, b->rejected);
+        return;
+    }
+    ImportGather* g = calloc(1, sizeof(*g));
+    int count[MAX_WORKERS] = {0};
+    ShardMsg* part[MAX_WORKERS] = {0};
+    for (int i=0; i<b->n; i++) count[shard_of(b->e[i]>>1)]++;
+    for (int w=0; w<n_workers; w++) {
+        part[w] = g ? msg_new(SM_IMPORT, (size_t)count[w]*sizeof(uint64_t)) : NULL;
+        if (!part[w]) {
+            for (int k=0; k<w; k++) free(part[k]);
+            free(g);
+            reply_local(&b->to, "ERROR(17)\n", 10);
+            return;
+        }
+        part[w]->len = 0;
+    }
+    for (int i=0; i<b->n; i++) {
+        ShardMsg* m = part[shard_of(b->e[i]>>1)];
+        memcpy(m->data+m->len, &b->e[i], sizeof(uint64_t));
+        m->len += sizeof(uint64_t);
+    }
+    g->to = b->to;
+    g->remaining = n_workers;
+    g->rejected = b->rejected;
+    for (int w=0; w<n_workers; w++) {
+        ShardMsg* m = part[w];
+        if (w==worker_id) continue;
+        m->to = b->to;
+        m->ctx = g;
+        shard_post(w, m);
+    }
+    ImportCount mine = {0};
+    ShardMsg* m = part[worker_id];
+    su_import_apply((const uint64_t*)m->data, (int)(m->len/sizeof(uint64_t)), &mine);
+    free(m);
+    import_gather_part(g, &mine);
+}
+
+// O N do pedido não reserva nada além de um pedaço: o lote cresce com as
+// linhas que chegam de fato
+static ImportBatch* import_new(const ReplyTo* to, int n){
+    ImportBatch* b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->to = *to;
+    if (n>IMPORT_CHUNK) n = IMPORT_CHUNK;
+    if (n>0 && grow_array((void**)&b->e, &b->cap, n, sizeof(uint64_t))<0) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+// Abre o arquivo do REQ_USRIMPORT: só um nome dentro de -I (sem '/', sem
+// seguir link) e só arquivo comum, nada de /dev/zero ou fifo
+static FILE* import_open(const char* arg){
+    char name[NAME_MAX+1], path[PATH_MAX];
+    size_t n = strcspn(arg, " \t\r\n");
+    if (!import_dir) {
+        errno = EACCES;
+        return NULL;
+    }
+    if (n==0 || n>NAME_MAX || memchr(arg, '/', n) || arg[0]=='.') {
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(name, arg, n);
+    name[n] = '\0';
+    if (snprintf(path, sizeof(path), "%s/%s", import_dir, name)>=(int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+    if (fd<0) return NULL;
+    struct stat st;
+    int ok = fstat(fd, &st)==0;
+    if (!ok || !S_ISREG(st.st_mode)) {
+        if (ok) errno = EINVAL;
+        close(fd);
+        return NULL;
+    }
+    FILE* f = fdopen(fd, "r");
+    if (!f) close(fd);
+    return f;
+}
+
+// Até IMPORT_CHUNK linhas; 1 se ainda há mais, 0 no fim, -1 em erro ou
+// passando de IMPORT_MAX (toda linha conta, vazia ou não)
+static int import_read(ImportBatch* b){
+    char line[256];
+    for (int k=0; k<IMPORT_CHUNK; k++) {
+        if (!fgets(line, sizeof(line), b->f)) return ferror(b->f) ? -1 : 0;
+        if (++b->lines>IMPORT_MAX) {
+            errno = EFBIG;
+            return -1;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0]) import_add(b, line);
+    }
+    return 1;
+}
+
+// Arquivo lido (ou com erro): responde e volta a ler o cliente
+static void import_file_done(ImportBatch* b, int r){
+    int sock = b->to.sock;
+    Client* c = &clients[sock];
+    c->import = NULL;
+    c->importing = 0;
+    if (r<0) {
+        log_msg(LOG_ERROR, "Import: %s\n", strerror(errno));
+        reply_local(&b->to, "ERROR(17)\n", 10);
+    } else {
+        import_run(b);
+    }
+    import_free(b);
+    if (!c->paused) {
+        ev_set_read(sock, 1);
+        handle_client_message(sock);
+    }
+}
+
+// Uma volta do loop: um pedaço de cada arquivo em leitura
+static void import_step(void){
+    for (int i=0; i<import_nfiles; ) {
+        ImportBatch* b = import_files[i];
+        int r = import_read(b);
+        if (r>0) {
+            i++;
+            continue;
+        }
+        int err = errno;
+        import_files[i] = import_files[--import_nfiles];
+        fclose(b->f);
+        b->f = NULL;
+        errno = err;
+        import_file_done(b, r);
+    }
+}
+
+static void import_begin(int c_idx, const ReplyTo* to, const Cmd* c, const char* line){
+    if (c->bad || c->num>IMPORT_MAX) {
+        reply_local(to, "ERROR(17)\n", 10);
+        return;
+    }
+    ImportBatch* b = import_new(to, c->num);
+    if (!b) {
+        reply_local(to, "ERROR(17)\n", 10);
+        return;
+    }
+    if (c->num<0) {
+        b->f = import_open(line+c->arg);
+        if (!b->f || grow_array((void**)&import_files, &import_files_cap, import_nfiles+1, sizeof(*import_files))<0) {
+            log_msg(LOG_ERROR, "Import %.*s: %s\n", (int)strcspn(line+c->arg, " \r\n"), line+c->arg,
+                    strerror(b->f ? ENOMEM : errno));
+            reply_local(to, "ERROR(17)\n", 10);
+            import_free(b);
+            return;
+        }
+        import_files[import_nfiles++] = b;
+        clients[c_idx].import = b;
+        clients[c_idx].importing = 1;
+        return;
+    }
+    if (c->num==0) {
+        import_run(b);
+        import_free(b);
+        return;
+    }
+    b->left = c->num;
+    clients[c_idx].import = b;
+}
+
+static void import_line(int c_idx, const char* line){
+    ImportBatch* b = clients[c_idx].import;
+    import_add(b, line);
+    if (--b->left>0) return;
+    clients[c_idx].import = NULL;
+    import_run(b);
+    import_free(b);
+}
+
+// ----------------------------------------------------
+// Mensagens de peer
+static int peer_listen_sock = -1;
+static int peer_listening   = 0;
+static int peer_port        = 0;
+
+// Passa a escutar na porta de peer (se ainda não estiver escutando)
+static int peer_listen_start(void){
+    if (peer_listening) return 0;
+    if (peer_listen_sock<0) {
+        peer_listen_sock = socket(AF_INET6, SOCK_STREAM,0);
+        if (peer_listen_sock<0) return -1;
+        int opt=1, no=0;
+        setsockopt(peer_listen_sock,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+        setsockopt(peer_listen_sock,IPPROTO_IPV6,IPV6_V6ONLY,&no,sizeof(no));
+    }
+    struct sockaddr_in6 addr6;
+    memset(&addr6,0,sizeof(addr6));
+    addr6.sin6_family=AF_INET6;
+    addr6.sin6_addr  = in6addr_any;
+    addr6.sin6_port  = htons(peer_port);
+    if (bind(peer_listen_sock,(struct sockaddr*)&addr6,sizeof(addr6))<0) return -1;
+    if (listen(peer_listen_sock,MAX_PEERS)<0) return -1;
+    set_nonblocking(peer_listen_sock);
+    if (ev_add(peer_listen_sock, 1)<0) return -1;
+    peer_listening = 1;
+    return 0;
+}
+
+// Conecta (bloqueante) a uma porta local; -1 se ninguém escuta nela
+static int connect_local(int port){
+    int sock = socket(AF_INET6, SOCK_STREAM,0);
+    if (sock<0) return -1;
+    struct sockaddr_in6 tmp;
+    memset(&tmp,0,sizeof(tmp));
+    tmp.sin6_family=AF_INET6;
+    inet_pton(AF_INET6,"::1",&tmp.sin6_addr);
+    tmp.sin6_port=htons(port);
+    if (connect(sock,(struct sockaddr*)&tmp,sizeof(tmp))<0) {
+        close(sock);
+        return -1;
+    }
+    set_nonblocking(sock);
+    return sock;
+}
+
+// ----------------------------------------------------
+// Réplicas de leitura. O primário manda "REPL_BEGIN", o estado atual
+// ("REPL_SET <UID> <loc>" por registro com local), "REPL_SYNC <seq>" e daí em
+// diante "REPL_SET <UID> <loc> <seq>" a cada REQ_LOCREG. O seq começa no
+// relógio: um primário reiniciado não volta a números que um cliente já viu.
+
+static void repl_drop(Replica* r){
+    ev_del(r->sock);
+    close(r->sock);
+    r->sock = -1;
+    r->gen++;
+    rx_free(&r->rx);
+    tx_free(&r->tx);
+    tx_free(&r->hold);
+    r->want_write = 0;
+    r->syncing = 0;
+    repl_count--;
+    log_msg(LOG_INFO, "Replica %d disconnected\n", (int)(r-replicas));
+}
+
+static void repl_flush_one(Replica* r){
+    if (r->sock==-1) return;
+    int w = tx_flush(r->sock, &r->tx);
+    if (w<0) {
+        repl_drop(r);
+        return;
+    }
+    if (w!=r->want_write) {
+        ev_set_write(r->sock, w);
+        r->want_write = w;
+    }
+}
+static void repl_flush(void){
+    for (int i=0; i<MAX_REPLICAS; i++) repl_flush_one(&replicas[i]);
+}
+
+// Mudança ao vivo; durante a sincronização espera atrás do estado inicial
+static void repl_append(Replica* r, const char* msg, size_t len){
+    TxBuf* b = r->syncing ? &r->hold : &r->tx;
+    tx_append(b, msg, len);
+    if (tx_pending(b)>REPL_TX_MAX) {
+        log_msg(LOG_ERROR, "Replica %d too slow, dropped\n", (int)(r-replicas));
+        repl_drop(r);
+    }
+}
+
+// "REPL_SET <UID> <loc>[ <seq>]\n" em p (até 52 bytes); retorna o tamanho
+static size_t enc_repl_set(char* p, uint64_t uid, int loc, uint64_t seq){
+    char* q = p;
+    memcpy(q, "REPL_SET ", 9);
+    uid_digits(uid, q+9);
+    q += 19;
+    *q++ = ' ';
+    if (loc<0) {
+        *q++ = '-';
+        loc = -loc;
+    }
+    q = put_dec(q, (uint64_t)loc);
+    if (seq) {
+        *q++ = ' ';
+        q = put_dec(q, seq);
+    }
+    *q++ = '\n';
+    return q-p;
+}
+
+// Registros deste shard que estão em algum local; -1 sem memória
+static int repl_dump(TxBuf* tx){
+    for (int i=0; i<sl_count; i++) {
+        if (!sl_loc[i]) continue;
+        char* p = tx_reserve(tx, 52);
+        if (!p) return -1;
+        tx->len += enc_repl_set(p, sl_uids[i], sl_loc[i], 0);
+    }
+    return 0;
+}
+
+// Primário (worker 0): numera a mudança e manda às réplicas
+static uint64_t repl_log(uint64_t uid, int loc){
+    uint64_t seq = ++repl_seq;
+    if (!repl_count) return seq;
+    char m[PEER_MSG_MAX];
+    size_t len = enc_repl_set(m, uid, loc, seq);
+    for (int i=0; i<MAX_REPLICAS; i++) {
+        if (replicas[i].sock!=-1) repl_append(&replicas[i], m, len);
+    }
+    return seq;
+}
+
+// Parte do estado inicial de um shard; a última libera as mudanças retidas
+static void repl_part(int slot, int gen, int lost, const char* data, size_t len){
+    Replica* r = &replicas[slot];
+    if (r->sock==-1 || r->gen!=gen) return;
+    if (lost || (len && tx_append(&r->tx, data, len)<0)) {
+        // estado incompleto: a réplica reconecta e carrega de novo
+        repl_drop(r);
+        return;
+    }
+    if (--r->syncing>0) return;
+    char m[PEER_MSG_MAX];
+    int n = snprintf(m, sizeof(m), "REPL_SYNC %llu\n", (unsigned long long)r->sync_seq);
+    tx_append(&r->tx, m, n);
+    if (tx_pending(&r->hold)) tx_append(&r->tx, r->hold.data+r->hold.off, tx_pending(&r->hold));
+    tx_free(&r->hold);
+}
+
+static void accept_replicas(void){
+    while(1){
+        int s = accept(repl_listen_sock,NULL,NULL);
+        if(s<0){
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK) perror("accept replica");
+            return;
+        }
+        set_nonblocking(s);
+        int i = 0;
+        while(i<MAX_REPLICAS && replicas[i].sock!=-1) i++;
+        if(i==MAX_REPLICAS || ev_add(s, 1)<0){
+            log_msg(LOG_INFO, "Replica limit exceeded\n");
+            close(s);
+            continue;
+        }
+        Replica* r = &replicas[i];
+        r->sock = s;
+        r->syncing = n_workers;
+        r->sync_seq = repl_seq;
+        repl_count++;
+        log_msg(LOG_INFO, "Replica %d connected\n", i);
+        tx_append(&r->tx, "REPL_BEGIN\n", 11);
+        // cada shard manda sua parte depois das mudanças que já recebeu
+        for(int w=1; w<n_workers; w++){
+            ShardMsg* m = msg_new(SM_REPL_DUMP, 0);
+            if(!m){
+                repl_drop(r);
+                break;
+            }
+            m->a = i;
+            m->rid = r->gen;
+            shard_post(w, m);
+        }
+        if(r->sock==-1) continue;
+        TxBuf mine = {0};
+        int lost = repl_dump(&mine)<0;
+        repl_part(i, r->gen, lost, mine.data ? mine.data+mine.off : NULL, tx_pending(&mine));
+        tx_free(&mine);
+    }
+}
+
+// Primário: a réplica não manda nada; só percebe a queda
+static void repl_io(Replica* r){
+    if (r->want_write) repl_flush_one(r);
+    char buf[256];
+    while (r->sock!=-1) {
+        ssize_t n = recv(r->sock, buf, sizeof(buf), 0);
+        if (n<0 && errno==EINTR) continue;
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+        if (n<=0) repl_drop(r);
+    }
+}
+static Replica* repl_of_sock(int fd){
+    for (int i=0; i<MAX_REPLICAS; i++) {
+        if (replicas[i].sock==fd) return &replicas[i];
+    }
+    return NULL;
+}
+
+// Réplica: tabela vazia para receber o estado do primário
+static void sl_clear(void){
+    sl_count = 0;
+    if (sl_index.slots) memset(sl_index.slots, 0, (size_t)sl_index.cap*sizeof(uint64_t));
+    sl_index.count = 0;
+    for (int l=0; l<=MAX_LOC; l++) {
+        loc_occ[l].count = 0;
+        loc_count_publish(l);
+    }
+}
+
+static int repl_loading;   // entre REPL_BEGIN e REPL_SYNC
+
+static void repl_line(char* line){
+    uint64_t uid;
+    if (strncmp(line,"REPL_SET ",9)==0) {
+        if (uid_scan(line+9, &uid)<0 || line[19]!=' ') return;
+        char* end;
+        int loc = (int)strtol(line+20, &end, 10);
+        int idx = find_sl_record(uid);
+        int old = idx<0 ? -1 : sl_location(idx);
+        if (idx<0) sl_record_add(uid, loc);
+        else       sl_set_location(idx, loc);
+        // o estado inicial não é mudança
+        if (!repl_loading) {
+            int now = loc>=1 && loc<=MAX_LOC ? loc : -1;
+            hist_append(uid, old, now);
+            sub_notify(uid, old, now);
+        }
+        if (*end==' ') repl_seq = strtoull(end+1, NULL, 10);
+    }
+    else if (strcmp(line,"REPL_BEGIN")==0) {
+        sl_clear();
+        hist_gap();
+        repl_loading = 1;
+    }
+    else if (strncmp(line,"REPL_SYNC ",10)==0) {
+        // o que mudou antes da carga não chegou como transição
+        hist_gap();
+        repl_loading = 0;
+        repl_seq = strtoull(line+10, NULL, 10);
+    }
+}
+
+// Leituras esperando um seq que já chegou
+static void repl_wake(void){
+    PendingTable* pt = &repl_waits;
+    for (uint32_t i=0; i<pt->cap && pt->count; i++) {
+        Pending* p = &pt->slots[i];
+        if (!p->id || p->seq>repl_seq) continue;
+        Pending w;
+        pending_take_id(pt, p->id, &w);
+        sl_reply_usrloc(&w.to, w.uid);
+    }
+}
+
+static int repl_connect(void){
+    int sock = connect_local(peer_port);
+    if (sock<0) return -1;
+    if (ev_add(sock, 1)<0) {
+        close(sock);
+        return -1;
+    }
+    repl_up.sock = sock;
+    return 0;
+}
+
+// Réplica: mudanças do primário. Se ele cai, continua servindo o que tem.
+static void repl_recv(void){
+    int sock = repl_up.sock;
+    while (1) {
+        ssize_t n = rx_recv(sock, &repl_up.rx);
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) {
+            log_msg(LOG_INFO, "Primary disconnected\n");
+            ev_del(sock);
+            close(sock);
+            rx_free(&repl_up.rx);
+            repl_up.sock = -1;
+            peer_retry_at = now_ms() + PEER_RETRY;
+            break;
+        }
+        size_t used;
+        char* line;
+        while ((line = rx_line(&repl_up.rx, &used))) {
+            repl_line(line);
+            rx_consume(&repl_up.rx, used);
+        }
+    }
+    repl_wake();
+}
+
+// Ocupa um slot com o socket já conectado; -1 se não há slot livre
+static int peer_add(int sock){
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (peers[p].sock!=-1) continue;
+        if (ev_add(sock, 1)<0) return -1;
+        peers[p].sock = sock;
+        peers[p].want_write = 0;
+        peers[p].rx_bin = peers[p].tx_bin = 0;
+        peers[p].auth_inv = 0;
+        peer_count++;
+        atomic_fetch_add(&peer_up, 1);
+        // até o REQ_LOCRANGE, o SL atende todos os locais
+        if (is_su) atomic_store(&peer_route[p], ROUTE_UP | 1u<<8 | MAX_LOC);
+        return p;
+    }
+    return -1;
+}
+
+// Conecta à porta de peer local e se apresenta; retorna o slot ou -1
+static int peer_connect(void){
+    int sock = connect_local(peer_port);
+    if (sock<0) return -1;
+    int p = peer_add(sock);
+    if (p<0) {
+        close(sock);
+        return -1;
+    }
+    peers[p].id = 0;
+    peer_send(p, "REQ_CONNPEER()\n",15);
+    if (loc_range_set) {
+        // sempre em texto: o BINPEER vem depois
+        char m[PEER_MSG_MAX];
+        snprintf(m, sizeof(m), "REQ_LOCRANGE %d %d\n", loc_lo, loc_hi);
+        peer_send(p, m, strlen(m));
+    }
+    if (!is_su) peer_send(p, "REQ_AUTHCACHE\n",14);
+    if (peer_bin_wanted) peer_send(p, "REQ_BINPEER\n",12);
+    return p;
+}
+
+// SL com -L (ou réplica): tenta de novo daqui a PEER_RETRY ms
+static void peer_retry(void){
+    if (is_replica ? repl_connect()==0 : peer_connect()>=0) {
+        peer_retry_at = 0;
+        log_msg(LOG_INFO, "%s connected\n", is_replica ? "Primary" : "Peer");
+    } else {
+        peer_retry_at = now_ms() + PEER_RETRY;
+    }
+}
+
+static void peer_lost(int p){
+    Peer* pr = &peers[p];
+    ev_del(pr->sock);
+    close(pr->sock);
+    rx_free(&pr->rx);
+    pr->tx.off = pr->tx.len = 0;
+    pr->sock = -1;
+    peer_count--;
+    atomic_fetch_sub(&peer_up, 1);
+    atomic_store(&peer_route[p], 0);
+    // sem SU, mudanças de is_special podem se perder
+    if (!is_su) atomic_store(&auth_cache_gen, 0);
+    // pedidos que não terão mais resposta, em todos os workers
+    pending_fail_peer(&su_uar, p, su_uar_fail);
+    pending_expire(&sl_inspects, -1, sl_inspect_fail);
+    for (int w=1; w<n_workers; w++) {
+        ShardMsg* m = msg_new(SM_PEER_LOST, 0);
+        if (!m) continue;
+        m->peer = p;
+        shard_post(w, m);
+    }
+}
+
+void handle_peer_message(int p){
+    Peer* pr = &peers[p];
+    int sock = pr->sock;
+    while (pr->sock==sock) {
+        ssize_t valread = rx_recv(sock, &pr->rx);
+        if (valread<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;
+        if (valread<0 && errno==EINTR) continue;
+        if(valread<=0){
+            log_msg(LOG_INFO, "Peer %d disconnected\n", pr->id);
+            peer_lost(p);
+            if (loc_range_set) {
+                peer_retry_at = now_ms() + PEER_RETRY;
+            } else if (!peer_count) {
+                log_msg(LOG_INFO, "No peer found, starting to listen...\n");
+                if (peer_listen_start()<0) perror("listen peer");
+            }
+            return;
+        }
+        // o modo pode mudar no meio do buffer (linha BINPEER)
+        size_t used, flen;
+        while(1){
+            if(pr->rx_bin){
+                uint8_t* f = rx_frame(&pr->rx, &flen, &used);
+                if(!f) break;
+                process_peer_frame(p, f, flen);
+            } else {
+                char* line = rx_line(&pr->rx, &used);
+                if(!line) break;
+                process_peer_line(p, line);
+            }
+            if(pr->sock!=sock) return;
+            rx_consume(&pr->rx, used);
+        }
+    }
+}
+
+// RES_LOCLIST com os ocupantes de locId, montado direto na fila de saída
+// (só quando é a vez da resposta)
+static void send_loclist(int c_sock, int locId){
+    static const char hdr[] = "RES_LOCLIST ";
+    const LocOccupants* o = (locId>=1 && locId<=MAX_LOC) ? &loc_occ[locId] : NULL;
+    if (!o || o->count==0) {
+        client_send(c_sock, "RES_LOCLIST EMPTY\n", 18);
+        return;
+    }
+    // "uid, uid, ...\n": 10 dígitos + ", " por ocupante
+    size_t len = sizeof(hdr)-1 + (size_t)o->count*12 - 1;
+    TxBuf* tx = &clients[c_sock].tx;
+    char* out = tx_reserve(tx, len);
+    if (!out) {
+        client_send(c_sock, "ERROR(19)\n", 10);
+        return;
+    }
+    char* p = out;
+    memcpy(p, hdr, sizeof(hdr)-1);
+    p += sizeof(hdr)-1;
+    for (int i=0; i<o->count; i++) {
+        if (i) { *p++ = ','; *p++ = ' '; }
+        uid_digits(sl_uids[o->recs[i]], p);
+        p += 10;
+    }
+    *p = '\n';
+    tx->len += len;
+    if (tx_pending(tx)>TX_HIGH) clients[c_sock].paused = 1;
+    client_mark_dirty(c_sock);
+}
+
+// Com um worker e a resposta na vez, o inspect escreve direto na saída
+static int loclist_direct(const ReplyTo* to){
+    return n_workers==1 && reply_client_ok(to) && clients[to->sock].seq_out==to->seq;
+}
+
+// Com vários workers os ocupantes estão espalhados pelos shards: o worker do
+// cliente pede a parte de cada um e responde quando todas chegarem. Com um
+// worker só, também monta a resposta que ainda tem de esperar a vez.
+typedef struct {
+    ReplyTo to;
+    int     remaining;
+    int     nomem;       // algum shard ficou de fora
+    TxBuf   acc;         // "RES_LOCLIST " + "uid, " por ocupante
+} LocGather;
+
+// -1 sem memória
+static int loc_append_uids(TxBuf* tx, int locId){
+    if (locId<1 || locId>MAX_LOC) return 0;
+    const LocOccupants* o = &loc_occ[locId];
+    if (!o->count) return 0;
+    char* p = tx_reserve(tx, (size_t)o->count*12);
+    if (!p) return -1;
+    for (int i=0; i<o->count; i++) {
+        uid_digits(sl_uids[o->recs[i]], p);
+        p += 10;
+        *p++ = ','; *p++ = ' ';
+    }
+    tx->len += (size_t)o->count*12;
+    return 0;
+}
+
+static void loc_gather_part(LocGather* g, int lost, const char* part, size_t len){
+    g->nomem |= lost;
+    if (len && tx_append(&g->acc, part, len)<0) g->nomem = 1;
+    if (--g->remaining>0) return;
+    TxBuf* acc = &g->acc;
+    if (g->nomem) {
+        reply_local(&g->to, "ERROR(25)\n", 10);
+    } else if (tx_pending(acc)<=12) {
+        reply_local(&g->to, "RES_LOCLIST EMPTY\n", 18);
+    } else {
+        // o ", " do último vira "\n"
+        char* end = acc->data+acc->off+tx_pending(acc);
+        end[-2] = '\n';
+        reply_local(&g->to, acc->data+acc->off, tx_pending(acc)-1);
+    }
+    tx_free(&g->acc);
+    free(g);
+}
+
+static void loc_gather_start(const ReplyTo* to, int locId){
+    LocGather* g = calloc(1, sizeof(*g));
+    if (!g) {
+        reply_send(to, "ERROR(25)\n", 10);
+        return;
+    }
+    g->to = *to;
+    g->remaining = n_workers;
+    if (tx_append(&g->acc, "RES_LOCLIST ", 12)<0) {
+        free(g);
+        reply_send(to, "ERROR(25)\n", 10);
+        return;
+    }
+    for (int w=0; w<n_workers; w++) {
+        if (w==worker_id) continue;
+        ShardMsg* m = msg_new(SM_LOC_COLLECT, 0);
+        if (!m) {
+            g->remaining--;
+            g->nomem = 1;
+            continue;
+        }
+        m->to = *to;
+        m->a = locId;
+        m->ctx = g;
+        shard_post(w, m);
+    }
+    TxBuf mine = {0};
+    int lost = loc_append_uids(&mine, locId)<0;
+    loc_gather_part(g, lost, mine.data ? mine.data+mine.off : NULL, tx_pending(&mine));
+    tx_free(&mine);
+}
+
+// SL: inspect, assinatura ou histórico de local autorizado (spec=1) ou não, no worker do cliente
+static void sl_authorized(const ReplyTo* to, int spec, int op, int locId, int64_t t1, int64_t t2){
+    if(!spec){
+        // permission denied
+        reply_local(to, "ERROR(19)\n",10);
+    } else if(op==CMD_SUBSCRIBE){
+        sub_loc_set(to, locId, 1);
+        reply_local(to, "OK(04)\n", 7);
+    } else if(op==CMD_LOCHIST){
+        hist_gather_start(to, locId, t1, t2);
+    } else if(loclist_direct(to)){
+        stat_done(to->kind, to->t0, NULL);
+        send_loclist(to->sock, locId);
+        reply_advance(to->sock);
+    } else {
+        loc_gather_start(to, locId);
+    }
+}
+
+// ----------------------------------------------------
+// Métricas de todos os workers: quem pede junta uma cópia de cada um
+typedef struct {
+    ReplyTo to;          // STATS_REPLY
+    int     mode;
+    int     remaining;
+    int     nomem;       // faltou a parte de algum worker
+    Stats   acc;
+} StatsGather;
+static Stats* stats_prev;   // worker 0: última linha do -S
+
+// Cópia das métricas deste worker, com as medidas do momento
+static void stats_snapshot(Stats* s){
+    *s = wstats;
+    for (int fd=0; fd<clients_cap; fd++) {
+        if (!clients[fd].in_use) continue;
+        int64_t q = (int64_t)tx_pending(&clients[fd].tx);
+        if (clients[fd].ur_send) q += (int64_t)tx_pending(&clients[fd].ur_send->buf);
+        s->clients++;
+        s->paused += clients[fd].paused;
+        s->client_txq += q;
+        if (q>s->client_txq_max) s->client_txq_max = q;
+    }
+    s->su_uar     = su_uar.count;
+    s->inspects   = sl_inspects.count;
+    s->repl_waits = repl_waits.count;
+    s->hist_events = hist_events;
+    s->hist_bytes  = (int64_t)hist_bytes;
+    if (worker_id!=0) return;
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (peers[p].sock==-1) continue;
+        s->peers++;
+        s->peer_txq += (int64_t)tx_pending(&peers[p].tx);
+    }
+    for (int i=0; i<MAX_REPLICAS; i++) {
+        if (replicas[i].sock==-1) continue;
+        s->replicas++;
+        s->replica_txq += (int64_t)(tx_pending(&replicas[i].tx) + tx_pending(&replicas[i].hold));
+    }
+}
+
+// a += b (sinal -1: a -= b, para o intervalo do -S)
+static void stats_merge(Stats* a, const Stats* b, int sign){
+    for (int k=0; k<ST_KINDS; k++) {
+        Hist* x = &a->h[k];
+        const Hist* y = &b->h[k];
+        x->count  += sign*y->count;
+        x->errors += sign*y->errors;
+        for (int i=0; i<HIST_BUCKETS; i++) x->b[i] += sign*y->b[i];
+        if (sign>0 && y->max>x->max) x->max = y->max;
+    }
+    a->peer_failures += sign*b->peer_failures;
+    a->repl_timeouts += sign*b->repl_timeouts;
+    a->auth_hits     += sign*b->auth_hits;
+    a->evt_sent      += sign*b->evt_sent;
+    a->evt_merged    += sign*b->evt_merged;
+    a->evt_lost      += sign*b->evt_lost;
+    if (sign<0) return;
+    a->clients    += b->clients;
+    a->paused     += b->paused;
+    a->client_txq += b->client_txq;
+    if (b->client_txq_max>a->client_txq_max) a->client_txq_max = b->client_txq_max;
+    a->su_uar     += b->su_uar;
+    a->inspects   += b->inspects;
+    a->repl_waits += b->repl_waits;
+    a->peers       += b->peers;
+    a->peer_txq    += b->peer_txq;
+    a->replicas    += b->replicas;
+    a->replica_txq += b->replica_txq;
+    a->hist_events += b->hist_events;
+    a->hist_bytes  += b->hist_bytes;
+}
+
+static void tx_appendf(TxBuf* tx, const char* fmt, ...){
+    char m[BUFFER_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(m, sizeof(m), fmt, ap);
+    va_end(ap);
+    if (n>0) tx_append(tx, m, (size_t)n<sizeof(m) ? (size_t)n : sizeof(m)-1);
+}
+
+// Uma linha JSON (sem o \n); latências em us
+static void stats_json(TxBuf* tx, const Stats* s, int64_t interval_ms){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tx_appendf(tx, "{\"ts\":%lld,\"role\":\"%s\",\"workers\":%d",
+               (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000,
+               is_su ? "SU" : is_replica ? "replica" : "SL", n_workers);
+    if (interval_ms) tx_appendf(tx, ",\"interval_ms\":%lld", (long long)interval_ms);
+    tx_appendf(tx, ",\"clients\":%lld,\"paused\":%lld,\"client_txq\":%lld,\"client_txq_max\":%lld",
+               (long long)s->clients, (long long)s->paused, (long long)s->client_txq, (long long)s->client_txq_max);
+    tx_appendf(tx, ",\"su_uar\":%lld,\"inspects\":%lld,\"repl_waits\":%lld",
+               (long long)s->su_uar, (long long)s->inspects, (long long)s->repl_waits);
+    tx_appendf(tx, ",\"peers\":%lld,\"peer_txq\":%lld,\"replicas\":%lld,\"replica_txq\":%lld",
+               (long long)s->peers, (long long)s->peer_txq, (long long)s->replicas, (long long)s->replica_txq);
+    tx_appendf(tx, ",\"peer_failures\":%llu,\"repl_timeouts\":%llu,\"auth_hits\":%llu",
+               (unsigned long long)s->peer_failures, (unsigned long long)s->repl_timeouts,
+               (unsigned long long)s->auth_hits);
+    tx_appendf(tx, ",\"events\":%llu,\"events_merged\":%llu,\"events_lost\":%llu",
+               (unsigned long long)s->evt_sent, (unsigned long long)s->evt_merged,
+               (unsigned long long)s->evt_lost);
+    tx_appendf(tx, ",\"history_events\":%lld,\"history_bytes\":%lld",
+               (long long)s->hist_events, (long long)s->hist_bytes);
+    for (int k=0; k<ST_KINDS; k++) {
+        const Hist* h = &s->h[k];
+        tx_appendf(tx, "%s\"%s\":{\"n\":%llu,\"err\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                   k==0 ? ",\"cmds\":{" : k==ST_RTT_LOCREG ? "},\"peer_rtt\":{" : ",",
+                   st_names[k], (unsigned long long)h->count, (unsigned long long)h->errors,
+                   (unsigned long long)hist_pct(h, 0.50), (unsigned long long)hist_pct(h, 0.99),
+                   (unsigned long long)hist_pct(h, 0.999), (unsigned long long)h->max);
+    }
+    tx_appendf(tx, "}}");
+}
+
+static void stats_print(const Stats* s){
+    log_msg(LOG_OUT, "clients %lld (paused %lld), client queue %lld B (max %lld B)\n",
+                     (long long)s->clients, (long long)s->paused, (long long)s->client_txq, (long long)s->client_txq_max);
+    log_msg(LOG_OUT, "peers %lld (queue %lld B), replicas %lld (queue %lld B)\n",
+                     (long long)s->peers, (long long)s->peer_txq, (long long)s->replicas, (long long)s->replica_txq);
+    log_msg(LOG_OUT, "pending: su_uar %lld, inspects %lld, replica reads %lld; peer failures %llu, replica timeouts %llu, auth cache hits %llu\n",
+                     (long long)s->su_uar, (long long)s->inspects, (long long)s->repl_waits,
+                     (unsigned long long)s->peer_failures, (unsigned long long)s->repl_timeouts,
+                     (unsigned long long)s->auth_hits);
+    log_msg(LOG_OUT, "events: sent %llu, coalesced %llu, lost %llu\n",
+                     (unsigned long long)s->evt_sent, (unsigned long long)s->evt_merged,
+                     (unsigned long long)s->evt_lost);
+    log_msg(LOG_OUT, "history: %lld transitions, %lld B in sealed blocks\n",
+                     (long long)s->hist_events, (long long)s->hist_bytes);
+    log_msg(LOG_OUT, "%-14s %10s %8s %9s %9s %9s %9s  (us)\n", "command", "count", "errors", "p50", "p99", "p999", "max");
+    for (int k=0; k<ST_KINDS; k++) {
+        const Hist* h = &s->h[k];
+        if (!h->count) continue;
+        log_msg(LOG_OUT, "%-14s %10llu %8llu %9llu %9llu %9llu %9llu%s\n", st_names[k],
+                         (unsigned long long)h->count, (unsigned long long)h->errors,
+                         (unsigned long long)hist_pct(h, 0.50), (unsigned long long)hist_pct(h, 0.99),
+                         (unsigned long long)hist_pct(h, 0.999), (unsigned long long)h->max,
+                         k>=ST_RTT_LOCREG ? "  (peer)" : "");
+    }
+}
+
+static void stats_gather_done(StatsGather* g){
+    if (g->nomem) {
+        // incompleta: a linha do -S esperaria pela próxima
+        if (g->mode==STATS_REPLY) reply_local(&g->to, "ERROR(22)\n", 10);
+    } else if (g->mode==STATS_STDIN) {
+        stats_print(&g->acc);
+    } else if (g->mode==STATS_REPLY) {
+        TxBuf tx = {0};
+        tx_append(&tx, "RES_STATS ", 10);
+        stats_json(&tx, &g->acc, 0);
+        tx_append(&tx, "\n", 1);
+        if (tx.data) reply_local(&g->to, tx.data+tx.off, tx_pending(&tx));
+        else         reply_local(&g->to, "ERROR(22)\n", 10);
+        tx_free(&tx);
+    } else {
+        // -S: só o que aconteceu desde a linha anterior
+        static int64_t prev_at;
+        int64_t now = now_ms();
+        Stats* cur = malloc(sizeof(Stats));
+        if (cur) *cur = g->acc;
+        if (stats_prev) {
+            stats_merge(&g->acc, stats_prev, -1);
+            // o max do intervalo sai da maior faixa ocupada
+            for (int k=0; k<ST_KINDS; k++) {
+                Hist* h = &g->acc.h[k];
+                h->max = 0;
+                for (int i=HIST_BUCKETS-1; i>=0; i--) {
+                    if (h->b[i]) { h->max = hist_top(i); break; }
+                }
+            }
+        }
+        TxBuf tx = {0};
+        stats_json(&tx, &g->acc, prev_at ? now-prev_at : 0);
+        tx_append(&tx, "\n", 1);
+        if (tx.data) log_put(1, tx.data+tx.off, tx_pending(&tx));
+        tx_free(&tx);
+        free(stats_prev);
+        stats_prev = cur;
+        prev_at = now;
+    }
+    free(g);
+}
+
+// s NULL: a parte se perdeu
+static void stats_gather_part(StatsGather* g, const Stats* s){
+    if (s) stats_merge(&g->acc, s, 1);
+    else   g->nomem = 1;
+    if (--g->remaining==0) stats_gather_done(g);
+}
+
+// to só conta em STATS_REPLY
+static void stats_gather_start(const ReplyTo* to, int mode){
+    StatsGather* g = calloc(1, sizeof(*g));
+    if (!g) {
+        if (mode==STATS_REPLY) reply_local(to, "ERROR(22)\n", 10);
+        return;
+    }
+    if (to) g->to = *to;
+    g->mode = mode;
+    g->remaining = n_workers;
+    for (int w=0; w<n_workers; w++) {
+        if (w==worker_id) continue;
+        ShardMsg* m = msg_new(SM_STATS_COLLECT, 0);
+        if (!m) {
+            g->remaining--;
+            g->nomem = 1;
+            continue;
+        }
+        m->to.worker = worker_id;
+        m->ctx = g;
+        shard_post(w, m);
+    }
+    Stats* mine = malloc(sizeof(Stats));
+    if (!mine) {
+        stats_gather_part(g, NULL);
+        return;
+    }
+    stats_snapshot(mine);
+    stats_gather_part(g, mine);
+    free(mine);
+}
+
+// ----------------------------------------------------
+// Tratamento das mensagens de peer, comum aos modos texto e binário
+static void on_discpeer(int p){
+    peer_send_op(p, PB_OK_DISC, "OK(01)\n");
+    peer_flush();
+    peer_lost(p);
+    if (loc_range_set) peer_retry_at = now_ms() + PEER_RETRY;
+}
+
+// SU: resposta do REQ_LOCREG do SL p. O acesso responde quando todos os SLs
+// do pedido responderem; o local antigo é o que algum deles tinha. O seq é o
+// do dono do local novo (na saída, o do SL onde o usuário estava).
+static void su_on_res_locreg(int peer, int oldLoc, int has_rid, uint32_t rid, uint64_t seq){
+    Pending* q = has_rid ? pending_find(&su_uar, rid) : pending_oldest(&su_uar);
+    // resposta atrasada (prazo vencido) ou cliente saiu => ignora
+    if(!q || !(q->peers & 1u<<peer)) return;
+    q->peers &= ~(1u<<peer);
+    if(oldLoc!=-1) q->result = oldLoc;
+    if(peer==q->arg || (q->arg<0 && oldLoc!=-1)) q->seq = seq;
+    if(q->peers) return;
+    Pending p;
+    pending_take_id(&su_uar, q->id, &p);
+    hist_add(&wstats.h[ST_RTT_LOCREG], (uint64_t)(now_ns()-p.sent)/1000);
+    char resp[BUFFER_SIZE];
+    if(p.want_seq) snprintf(resp,sizeof(resp),"RES_USRACCESS(%d) %llu\n", p.result, (unsigned long long)p.seq);
+    else           snprintf(resp,sizeof(resp),"RES_USRACCESS(%d)\n", p.result);
+    reply_send(&p.to, resp, strlen(resp));
+}
+
+// SU: x=1 se tem perm especial, x=0 senão
+static void su_on_req_usrauth(int peer, uint64_t uid, int has_rid, uint32_t rid){
+    int idx = find_su_user(uid);
+    int spec = 0;
+    if(idx>=0) {
+        spec = su_is_special(idx);
+    }
+    peer_send_res_usrauth(peer, spec, has_rid, rid);
+}
+
+// SL: registra a nova localização e devolve a antiga (e o seq da mudança)
+static void sl_on_req_locreg(int peer, uint64_t uid, int loc, int has_rid, uint32_t rid, uint64_t seq){
+    int idx = find_sl_record(uid);
+    int oldLoc = -1;
+    if(idx<0){
+        // Novo (sem memória => não registra, mas responde igual)
+        sl_record_add(uid, loc);
+    } else {
+        oldLoc = sl_location(idx);
+        sl_set_location(idx, loc);
+    }
+    wal_log(uid, loc);
+    int newLoc = loc>=1 && loc<=MAX_LOC ? loc : -1;
+    hist_append(uid, oldLoc, newLoc);
+    sub_notify(uid, oldLoc, newLoc);
+    peer_send_res_locreg(peer, uid, oldLoc, has_rid, rid, seq);
+}
+
+// SL: resposta do REQ_USRAUTH de um inspect
+static void sl_on_res_usrauth(int x, int has_rid, uint32_t rid){
+    Pending p;
+    int r = has_rid ? pending_take(&sl_inspects, rid, &p)
+                    : pending_take_oldest(&sl_inspects, &p);
+    if(r<0) return;   // Nao havia "inspect" pendente => ignore
+    hist_add(&wstats.h[ST_RTT_USRAUTH], (uint64_t)(now_ns()-p.sent)/1000);
+    if(x==0 || x==1) auth_cache_put(p.uid, x);
+    if(!reply_client_ok(&p.to)) return;   // o cliente saiu
+    sl_authorized(&p.to, x, p.op, p.arg, p.t1, p.t2);
+}
+
+static void sl_on_auth_inv(uint64_t uid){
+    auth_cache_drop(uid);
+}
 
-// ----------------- Declarações de funções
-int  find_su_user(const char* uid);
-int  find_sl_record(const char* uid);
+// Mensagem do peer já decodificada, no worker que cuida dela
+static void peer_in(int peer, int op, uint64_t uid, int a, int has_rid, uint32_t rid, uint64_t seq){
+    switch(op){
+    case PB_RES_LOCREG:  su_on_res_locreg(peer, a, has_rid, rid, seq);       break;
+    case PB_REQ_USRAUTH: su_on_req_usrauth(peer, uid, has_rid, rid);         break;
+    case PB_REQ_LOCREG:  sl_on_req_locreg(peer, uid, a, has_rid, rid, seq);  break;
+    case PB_RES_USRAUTH: sl_on_res_usrauth(a, has_rid, rid);                 break;
+    case PB_AUTH_INV:    sl_on_auth_inv(uid);                                break;
+    case PB_AUTH_CACHE:  auth_cache_reset(a);                                break;
+    }
+}
 
-void handle_client_message(int client_sock);
-void process_client_line(int client_sock, const char* line);
+// Mensagem do peer para o worker w
+static void peer_in_post(int w, int peer, int op, uint64_t uid, int a, int has_rid, uint32_t rid, uint64_t seq){
+    ShardMsg* m = msg_new(SM_PEER_IN, 0);
+    if (!m) return;
+    m->peer = peer;
+    m->op = op;
+    m->uid = uid;
+    m->a = a;
+    m->has_rid = has_rid;
+    m->rid = rid;
+    m->seq = seq;
+    shard_post(w, m);
+}
 
-void handle_peer_message(int peer_sock);
-void process_peer_line(int peer_sock, const char* line);
+// Worker 0 recebe tudo do peer: pedidos vão para o shard do UID, respostas
+// para o worker que gerou o ReqId (sem ReqId, peer antigo => worker 0),
+// AUTHINV e AUTHCACHE para todos.
+// No SL cada REQ_LOCREG ganha aqui seu seq, na ordem em que vai às réplicas.
+static void peer_dispatch(int peer, int op, uint64_t uid, int a, int has_rid, uint32_t rid, uint64_t seq){
+    if (uid>=UID_LIMIT) return;
+    if (op==PB_REQ_LOCREG) seq = repl_log(uid, a);
+    if (op==PB_AUTH_INV || op==PB_AUTH_CACHE) {
+        // cada worker tem seu cache
+        for (int w=1; w<n_workers; w++) peer_in_post(w, peer, op, uid, a, has_rid, rid, seq);
+        peer_in(peer, op, uid, a, has_rid, rid, seq);
+        return;
+    }
+    int w;
+    if (op==PB_RES_LOCREG || op==PB_RES_USRAUTH)
+        w = has_rid ? (int)(rid & ((1u<<WORKER_BITS)-1)) : 0;
+    else
+        w = shard_of(uid);
+    if (w>=n_workers) return;
+    if (w==worker_id) {
+        peer_in(peer, op, uid, a, has_rid, rid, seq);
+        return;
+    }
+    peer_in_post(w, peer, op, uid, a, has_rid, rid, seq);
+}
 
-int  get_client_index_by_socket(int sock);
-void close_and_remove_client(int sock);
+// SL: o SU vai mandar AUTHINV; caches de uma conexão anterior (ou de antes
+// de um REQ_USRIMPORT) não valem mais. Cada worker esvazia o seu quando o
+// aviso passa pela fila, na ordem dos RES_USRAUTH: um anterior, com o
+// is_special velho, chega antes e não entra na geração nova.
+static void sl_auth_cache_start(int peer){
+    int g = ++auth_gen_next;
+    atomic_store(&auth_cache_gen, g);
+    peer_dispatch(peer, PB_AUTH_CACHE, 0, g, 0, 0, 0);
+}
 
-void send_req_discpeer_and_exit();  // kill
+// Linhas de peer: um handler por linha em cada papel, com os argumentos
+// depois da palavra (a); o que falta na tabela do papel é ignorado
+typedef void (*PeerLineFn)(int p, const char* a);
 
-// ----------------------------------------------------
-// Funções auxiliares
-int find_su_user(const char* uid) {
-    for (int i=0; i<su_count; i++) {
-        if (strcmp(su_users[i].uid, uid)==0) {
-            return i;
-        }
-    }
-    return -1;
+// REQ_DISCPEER => peer quer fechar
+static void pl_discpeer(int p, const char* a){
+    (void)a;
+    on_discpeer(p);
 }
-int find_sl_record(const char* uid) {
-    for (int i=0; i<sl_count; i++) {
-        if (strcmp(sl_records[i].uid, uid)==0) {
-            return i;
-        }
+// Se "OK(01)" => peer confirm disc
+static void pl_ok_disc(int p, const char* a){
+    (void)a;
+    peer_lost(p);
+}
+static void pl_peer_limit(int p, const char* a){
+    (void)p; (void)a;
+    log_msg(LOG_ERROR, "Peer limit exceeded\n");
+    exit(0);
+}
+// Negociação do modo binário: REQ_BINPEER pede, e cada lado manda
+// BINPEER antes de passar a mandar quadros. Peer antigo ignora o pedido.
+static void pl_req_binpeer(int p, const char* a){
+    (void)a;
+    peer_start_tx_bin(p);
+}
+static void pl_binpeer(int p, const char* a){
+    (void)a;
+    peers[p].rx_bin = 1;
+    peer_start_tx_bin(p);
+}
+
+// SU: "REQ_LOCRANGE <lo> <hi>": locais que o SL atende (SL com -L)
+static void pl_locrange(int p, const char* a){
+    long lo, hi;
+    if (arg_long(&a, &lo)<0 || arg_long(&a, &hi)<0) return;
+    if (lo>=1 && lo<=hi && hi<=MAX_LOC) {
+        atomic_store(&peer_route[p], ROUTE_UP | (unsigned)lo<<8 | (unsigned)hi);
+        log_msg(LOG_INFO, "Peer %d serves locations %ld-%ld\n", peers[p].id, lo, hi);
     }
-    return -1;
 }
-int get_client_index_by_socket(int sock) {
-    for (int i=0; i<MAX_CLIENTS; i++){
-        if (client_sockets[i] == sock) {
-            return i;
-        }
+// SU: "REQ_AUTHCACHE": o SL guarda autorizações; daqui em diante cada
+// mudança de is_special vai para ele como AUTHINV
+static void pl_req_authcache(int p, const char* a){
+    (void)a;
+    peers[p].auth_inv = 1;
+    peer_send_op(p, PB_AUTH_CACHE, "AUTHCACHE\n");
+}
+// SU: "RES_LOCREG <UID> <oldLoc> [ReqId [Seq]]"
+static void pl_res_locreg(int p, const char* a){
+    uint64_t uid, rid = 0, seq = 0;
+    long oldLoc;
+    if (arg_uid(&a, &uid)<0 || arg_long(&a, &oldLoc)<0) return;
+    int has_rid = arg_u64(&a, &rid)==0;
+    if (has_rid) arg_u64(&a, &seq);
+    peer_dispatch(p, PB_RES_LOCREG, uid, (int)oldLoc, has_rid, (uint32_t)rid, seq);
+}
+// SU: "REQ_USRAUTH <UID> [ReqId]"
+static void pl_req_usrauth(int p, const char* a){
+    uint64_t uid, rid = 0;
+    if (arg_uid(&a, &uid)<0) return;
+    int has_rid = arg_u64(&a, &rid)==0;
+    peer_dispatch(p, PB_REQ_USRAUTH, uid, 0, has_rid, (uint32_t)rid, 0);
+}
+// SL: "REQ_LOCREG <UID> <loc> [ReqId]"
+static void pl_req_locreg(int p, const char* a){
+    uint64_t uid, rid = 0;
+    long loc;
+    if (arg_uid(&a, &uid)<0 || arg_long(&a, &loc)<0) return;
+    int has_rid = arg_u64(&a, &rid)==0;
+    peer_dispatch(p, PB_REQ_LOCREG, uid, (int)loc, has_rid, (uint32_t)rid, 0);
+}
+// SL: "RES_USRAUTH(x) [ReqId]"
+static void pl_res_usrauth(int p, const char* a){
+    uint64_t rid = 0;
+    long x;
+    if (arg_long(&a, &x)<0) return;
+    int has_rid = 0;
+    if (*a==')') {
+        a++;
+        has_rid = arg_u64(&a, &rid)==0;
     }
-    return -1;
+    peer_dispatch(p, PB_RES_USRAUTH, 0, (int)x, has_rid, (uint32_t)rid, 0);
+}
+// SL: "AUTHCACHE": o SU aceitou o REQ_AUTHCACHE (SU antigo não responde)
+static void pl_authcache(int p, const char* a){
+    (void)a;
+    sl_auth_cache_start(p);
+}
+// SL: "AUTHINV <UID>"
+static void pl_authinv(int p, const char* a){
+    uint64_t uid;
+    if (uid_parse(a, &uid)==0) peer_dispatch(p, PB_AUTH_INV, uid, 0, 0, 0, 0);
 }
-void close_and_remove_client(int sock) {
-    int idx = get_client_index_by_socket(sock);
-    if (idx>=0){
-        int c_id = client_ids[idx];
-        int loc  = client_locs[idx];
-        printf("Client %d removed (Loc %d)\n", c_id, loc);
 
-        close(client_sockets[idx]);
-        client_sockets[idx]=0;
-        client_ids[idx]=0;
-        client_locs[idx]=0;
+static const PeerLineFn peer_line_fns[2][PL_N] = {
+    {   // SL
+        [PL_DISCPEER] = pl_discpeer,        [PL_OK_DISC] = pl_ok_disc,
+        [PL_PEER_LIMIT] = pl_peer_limit,    [PL_REQ_BINPEER] = pl_req_binpeer,
+        [PL_BINPEER] = pl_binpeer,          [PL_REQ_LOCREG] = pl_req_locreg,
+        [PL_RES_USRAUTH] = pl_res_usrauth,  [PL_AUTHCACHE] = pl_authcache,
+        [PL_AUTHINV] = pl_authinv,
+    },
+    {   // SU
+        [PL_DISCPEER] = pl_discpeer,        [PL_OK_DISC] = pl_ok_disc,
+        [PL_PEER_LIMIT] = pl_peer_limit,    [PL_REQ_BINPEER] = pl_req_binpeer,
+        [PL_BINPEER] = pl_binpeer,          [PL_LOCRANGE] = pl_locrange,
+        [PL_REQ_AUTHCACHE] = pl_req_authcache, [PL_RES_LOCREG] = pl_res_locreg,
+        [PL_REQ_USRAUTH] = pl_req_usrauth,
+    },
+};
 
-        if (is_su) {
-            printf("SU Successful disconnect\n");
-        } else {
-            printf("SL Successful disconnect\n");
-        }
+void process_peer_line(int p, char* line){
+    // printf("[PEER] %s\n", line);
+    const char* a = NULL;
+    PeerLineFn f = peer_line_fns[is_su][kw_find(&peer_kw, line, &a)];
+    if (f) f(p, a);
+}
+
+// Quadro binário: f[0] é o opcode. Quadros curtos ou desconhecidos são ignorados.
+void process_peer_frame(int p, const uint8_t* f, size_t len){
+    if(len<1) return;
+    switch(f[0]){
+    case PB_REQ_DISCPEER:
+        on_discpeer(p);
+        break;
+    case PB_OK_DISC:
+        peer_lost(p);
+        break;
+    case PB_RES_LOCREG:
+        if(!is_su || len<15) break;
+        peer_dispatch(p, PB_RES_LOCREG, get_u64(f+1), (int16_t)get_u16(f+9), 1, get_u32(f+11),
+                      len>=23 ? get_u64(f+15) : 0);
+        break;
+    case PB_REQ_USRAUTH:
+        if(!is_su || len<13) break;
+        peer_dispatch(p, PB_REQ_USRAUTH, get_u64(f+1), 0, 1, get_u32(f+9), 0);
+        break;
+    case PB_REQ_LOCREG:
+        if(is_su || len<15) break;
+        peer_dispatch(p, PB_REQ_LOCREG, get_u64(f+1), (int16_t)get_u16(f+9), 1, get_u32(f+11), 0);
+        break;
+    case PB_RES_USRAUTH:
+        if(is_su || len<6) break;
+        peer_dispatch(p, PB_RES_USRAUTH, 0, f[1], 1, get_u32(f+2), 0);
+        break;
+    case PB_AUTH_CACHE:
+        if(!is_su) sl_auth_cache_start(p);
+        break;
+    case PB_AUTH_INV:
+        if(is_su || len<9) break;
+        peer_dispatch(p, PB_AUTH_INV, get_u64(f+1), 0, 0, 0, 0);
+        break;
     }
 }
 
-// kill
-void send_req_discpeer_and_exit(){
-    if (peer_count>0 && peer_sockets[0]!=-1){
-        char msg[BUFFER_SIZE];
-        snprintf(msg,sizeof(msg),"REQ_DISCPEER(%d)\n", peer_id);
-        send(peer_sockets[0], msg, strlen(msg),0);
+// ----------------------------------------------------
+// Sem memória para a parte: o próprio pedido volta como parte vazia com op = 1,
+// e quem junta responde com erro em vez de esperar para sempre
+static int shard_part_lost(ShardMsg* m, int type, int dest){
+    m->type = type;
+    m->op = 1;
+    m->len = 0;
+    shard_post(dest, m);
+    return 1;
+}
+
+// Mensagens vindas de outros workers; 1 se m foi reaproveitada (não libera)
+static int shard_handle(ShardMsg* m){
+    switch(m->type){
+    case SM_CMD:
+        exec_client_cmd(&m->to, (const Cmd*)m->data);
+        break;
+    case SM_REPLY:
+        reply_local(&m->to, m->data, m->len);
+        break;
+    case SM_PEER_OUT:
+        switch(m->op){
+        case PB_REQ_LOCREG:  peer_send_req_locreg(m->peer, m->uid, m->a, m->rid);               break;
+        case PB_RES_LOCREG:  peer_send_res_locreg(m->peer, m->uid, m->a, m->has_rid, m->rid, m->seq);  break;
+        case PB_REQ_USRAUTH: peer_send_req_usrauth(m->peer, m->uid, m->rid);                    break;
+        case PB_RES_USRAUTH: peer_send_res_usrauth(m->peer, m->a, m->has_rid, m->rid);          break;
+        case PB_AUTH_INV:    peer_send_auth_inv(m->uid);                                        break;
+        case PB_AUTH_CACHE:  peer_send_auth_flush();                                            break;
+        }
+        break;
+    case SM_PEER_IN:
+        peer_in(m->peer, m->op, m->uid, m->a, m->has_rid, m->rid, m->seq);
+        break;
+    case SM_PEER_LOST:
+        pending_fail_peer(&su_uar, m->peer, su_uar_fail);
+        pending_expire(&sl_inspects, -1, sl_inspect_fail);
+        break;
+    case SM_LOC_COLLECT: {
+        TxBuf part = {0};
+        ShardMsg* r = loc_append_uids(&part, m->a)<0 ? NULL : msg_new(SM_LOC_PART, tx_pending(&part));
+        if(!r){
+            tx_free(&part);
+            return shard_part_lost(m, SM_LOC_PART, m->to.worker);
+        }
+        if(part.data) memcpy(r->data, part.data+part.off, tx_pending(&part));
+        r->ctx = m->ctx;
+        shard_post(m->to.worker, r);
+        tx_free(&part);
+        break;
     }
-    for (int i=0; i<MAX_CLIENTS; i++){
-        if (client_sockets[i]>0){
-            close(client_sockets[i]);
-            client_sockets[i]=0;
+    case SM_LOC_PART:
+        loc_gather_part(m->ctx, m->op, m->data, m->len);
+        break;
+    case SM_REPL_DUMP: {
+        TxBuf part = {0};
+        ShardMsg* r = repl_dump(&part)<0 ? NULL : msg_new(SM_REPL_PART, tx_pending(&part));
+        if(!r){
+            tx_free(&part);
+            return shard_part_lost(m, SM_REPL_PART, 0);
         }
+        if(part.data) memcpy(r->data, part.data+part.off, tx_pending(&part));
+        r->a = m->a;
+        r->rid = m->rid;
+        shard_post(0, r);
+        tx_free(&part);
+        break;
+    }
+    case SM_REPL_PART:
+        repl_part(m->a, (int)m->rid, m->op, m->data, m->len);
+        break;
+    case SM_STATS_COLLECT: {
+        ShardMsg* r = msg_new(SM_STATS_PART, sizeof(Stats));
+        if(!r) return shard_part_lost(m, SM_STATS_PART, m->to.worker);
+        stats_snapshot((Stats*)r->data);
+        r->ctx = m->ctx;
+        shard_post(m->to.worker, r);
+        break;
     }
-    for (int i=0;i<MAX_PEERS;i++){
-        if (peer_sockets[i]!=-1){
-            close(peer_sockets[i]);
-            peer_sockets[i]=-1;
+    case SM_STATS_PART:
+        stats_gather_part(m->ctx, m->op ? NULL : (const Stats*)m->data);
+        break;
+    case SM_IMPORT: {
+        ShardMsg* r = msg_new(SM_IMPORT_PART, sizeof(ImportCount));
+        ImportCount n = {0};
+        su_import_apply((const uint64_t*)m->data, (int)(m->len/sizeof(uint64_t)), &n);
+        if(!r) return shard_part_lost(m, SM_IMPORT_PART, m->to.worker);
+        memcpy(r->data, &n, sizeof(n));
+        r->ctx = m->ctx;
+        shard_post(m->to.worker, r);
+        break;
+    }
+    case SM_IMPORT_PART:
+        import_gather_part(m->ctx, m->op ? NULL : (const ImportCount*)m->data);
+        break;
+    case SM_SUB: {
+        SubTarget t = { m->to.worker, m->to.sock, m->to.client_id };
+        if (m->op) sub_add(&sub_loc[m->a], &t);
+        else       sub_del(&sub_loc[m->a], &t);
+        break;
+    }
+    case SM_UNSUB_ALL: {
+        SubTarget t = { m->to.worker, m->to.sock, m->to.client_id };
+        sub_forget(&t);
+        break;
+    }
+    case SM_EVENT:
+        sub_event_in(m);
+        break;
+    case SM_HIST_COLLECT: {
+        int64_t win[2];
+        memcpy(win, m->data, sizeof(win));
+        TxBuf part = {0};
+        int r0 = hist_entered(&part, m->a, win[0], win[1]);
+        ShardMsg* r = r0==-2 ? NULL : msg_new(SM_HIST_PART, tx_pending(&part));
+        if(!r){
+            tx_free(&part);
+            m->a = 0;   // a era o local
+            return shard_part_lost(m, SM_HIST_PART, m->to.worker);
         }
+        if(part.data) memcpy(r->data, part.data+part.off, tx_pending(&part));
+        r->a = r0==-1;
+        r->ctx = m->ctx;
+        shard_post(m->to.worker, r);
+        tx_free(&part);
+        break;
+    }
+    case SM_HIST_PART:
+        hist_gather_part(m->ctx, m->a, m->op, m->data, m->len);
+        break;
+    }
+    return 0;
+}
+
+static void shard_drain(void){
+    MsgQueue* q = &shard_q[worker_id];
+    char buf[64];
+    while(read(q->wake[0], buf, sizeof(buf))>0);
+    // zera antes de esvaziar: quem postar daqui em diante acorda de novo
+    atomic_store(&q->signaled, 0);
+    ShardMsg* m;
+    while((m = q_pop(q))){
+        if(!shard_handle(m)) free(m);
     }
-    printf("Successful disconnect\n");
-    printf("Peer %d disconnected\n", peer_id);
-    exit(0);
 }
 
 // ----------------------------------------------------
-// Mensagens de cliente
-void handle_client_message(int client_sock){
-    char buffer[BUFFER_SIZE];
-    int valread = recv(client_sock, buffer, sizeof(buffer)-1, 0);
-    if (valread<=0) {
-        // desconectar
-        close_and_remove_client(client_sock);
-        return;
+static void accept_peers(void){
+    while(1){
+        int newp = accept(peer_listen_sock,NULL,NULL);
+        if(newp<0){
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK) perror("accept peer");
+            return;
+        }
+        set_nonblocking(newp);
+        // o SL fala com um SU só
+        int p = (is_su || peer_count==0) ? peer_add(newp) : -1;
+        if(p<0){
+            send(newp,"ERROR(01)\n",10,0);
+            log_msg(LOG_INFO, "Peer limit exceeded\n");
+            close(newp);
+            continue;
+        }
+        peers[p].id = next_peer_id;
+        log_msg(LOG_INFO, "Peer %d connected\n", next_peer_id);
+        char resp[BUFFER_SIZE];
+        snprintf(resp,sizeof(resp),"RES_CONNPEER(%d)\n", next_peer_id);
+        peer_send(p, resp, strlen(resp));
+        if(!is_su) peer_send(p, "REQ_AUTHCACHE\n",14);
+        if(peer_bin_wanted) peer_send(p, "REQ_BINPEER\n",12);
+        if(is_su) su_next_peer_id=++next_peer_id;
+        else      sl_next_peer_id=++next_peer_id;
     }
-    buffer[valread] = '\0';
+}
 
-    char* line = strtok(buffer, "\n");
-    while (line) {
-        process_client_line(client_sock, line);
-        line = strtok(NULL, "\n");
+// Slot do peer com esse socket; -1 se não é de peer
+static int peer_of_sock(int fd){
+    for (int p=0; p<MAX_PEERS; p++) {
+        if (peers[p].sock==fd) return p;
     }
+    return -1;
 }
 
-typedef struct {
-    char uid[11];
-    int  client_sock;
-} SU_UsrAccessReq;
-
-static SU_UsrAccessReq su_uar[MAX_USERS];
-static int su_uar_count = 0;
-
-// Salva (uid -> socket)
-static void su_uar_add(const char* uid, int c_sock){
-    for (int i=0; i<su_uar_count; i++){
-        if(strcmp(su_uar[i].uid, uid)==0){
-            su_uar[i].client_sock = c_sock;
-            return;
-        }
+// Conexão aceita (pelo accept() ou pelo accept multishot do -U)
+static void client_open(int newc){
+    set_nonblocking(newc);
+    int idx = add_client(newc);
+    if(idx<0){
+        send(newc,"ERROR(09)\n",10,0);
+        close(newc);
+        return;
     }
-    if(su_uar_count<MAX_USERS){
-        strcpy(su_uar[su_uar_count].uid, uid);
-        su_uar[su_uar_count].client_sock = c_sock;
-        su_uar_count++;
+    if(ur_on){
+        clients[idx].ur_gen = ++ur_gen_next;
+        ur_recv_arm(newc);
     }
+    else if(ev_add(newc, 1)<0){
+        perror("ev_add client");
+        clients[idx].in_use=0;
+        atomic_fetch_sub(&client_count, 1);
+        close(newc);
+        return;
+    }
+    if(worker_id==0){
+        if(is_su) su_next_client_id= atomic_load(&next_client_id);
+        else      sl_next_client_id= atomic_load(&next_client_id);
+    }
+    log_msg(LOG_INFO, "Client %d connected\n",clients[idx].id);
+    if(is_su) log_msg(LOG_INFO, "SU New ID: %d\n", clients[idx].id);
+    else      log_msg(LOG_INFO, "SL New ID: %d\n", clients[idx].id);
 }
 
-// Retorna e remove
-static int su_uar_remove(const char* uid){
-    for(int i=0;i<su_uar_count;i++){
-        if(strcmp(su_uar[i].uid,uid)==0){
-            int sock = su_uar[i].client_sock;
-            su_uar_count--;
-            su_uar[i] = su_uar[su_uar_count];
-            return sock;
+static void accept_clients(int server_sock){
+    while(1){
+        int newc = accept(server_sock,NULL,NULL);
+        if(newc<0){
+            if(errno==EINTR) continue;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK) perror("accept client");
+            return;
         }
+        client_open(newc);
     }
-    return -1;
 }
 
-void process_client_line(int client_sock, const char* line){
-    int c_idx = get_client_index_by_socket(client_sock);
-    if (c_idx<0) return;
-    int c_id = client_ids[c_idx];
+#ifndef SERVER_NO_MAIN
+static void usage(const char* prog){
+    fprintf(stderr,"USAGE: %s [-m MaxClients] [-t PeerTimeoutMs] [-b] [-f FlushBytes] [-n Workers] [-d DataDir] [-s SnapEvery] [-L Lo-Hi] [-R ReplPort | -r] [-S StatsSecs] [-v Level[:N]] [-o LogFile] [-H MB[:Secs]] [-U] [-I ImportDir] <PeerPort=40000> <ClientPort=50000|60000>\n",prog);
+    fprintf(stderr,"  -b  pede ao peer o protocolo binário (o padrão é texto)\n");
+    fprintf(stderr,"  -f  bytes acumulados para o peer antes de enviar (padrão %d; 0 => envia cada mensagem)\n", PEER_FLUSH);
+    fprintf(stderr,"  -n  threads, cada uma com sua porta de clientes (SO_REUSEPORT) e seu shard (1..%d)\n", MAX_WORKERS);
+    fprintf(stderr,"  -d  diretório do WAL e dos snapshots (sem -d nada é gravado)\n");
+    fprintf(stderr,"  -s  entradas no WAL antes de gravar um snapshot (padrão %d)\n", SNAP_EVERY);
+    fprintf(stderr,"  -L  SL: atende só os locais Lo..Hi e conecta (e reconecta) ao SU, que pode ter vários SLs\n");
+    fprintf(stderr,"  -R  SL: aceita réplicas de leitura nessa porta e manda a elas cada mudança\n");
+    fprintf(stderr,"  -r  réplica só de leitura (REQ_USRLOC) do SL cuja porta -R é a PeerPort; sem -n nem -d\n");
+    fprintf(stderr,"  -S  a cada StatsSecs escreve no stderr uma linha JSON com as métricas do intervalo\n");
+    fprintf(stderr,"      (as totais: comando stats no teclado ou REQ_STATS de um cliente)\n");
+    fprintf(stderr,"  -v  nível do log: error, info ou trace (padrão; :N mostra 1 a cada N comandos);\n");
+    fprintf(stderr,"      muda com \"log Level[:N]\" no teclado\n");
+    fprintf(stderr,"  -o  grava o log nesse arquivo em vez da saída padrão (os erros vão sempre para o stderr)\n");
+    fprintf(stderr,"  -H  SL: MB do histórico de movimentos (padrão %d; 0 desliga) e, com :Secs, a idade máxima;\n", HIST_MB);
+    fprintf(stderr,"      os blocos mais antigos saem primeiro (REQ_USRHIST, REQ_LOCHIST)\n");
+    fprintf(stderr,"  -U  clientes pelo io_uring (accept e recv multishot, envios da iteração numa chamada só);\n");
+    fprintf(stderr,"      sem suporte no kernel o worker fica no epoll\n");
+    fprintf(stderr,"  -I  SU: REQ_USRIMPORT <arquivo> lê arquivos comuns desse diretório (sem -I só o envio pela conexão)\n");
+    exit(EXIT_FAILURE);
+}
 
-    printf("< %s\n", line);
+static int client_port;
+static int repl_port = 0;   // -R
+static int use_uring = 0;   // -U
+static int     stats_every = 0;   // -S: segundos entre linhas JSON no stderr
+static int64_t stats_at = 0;      // ms da próxima
 
-    // REQ_CONN(LocId)
-    if (strncmp(line,"REQ_CONN(",9)==0) {
-        int loc = atoi(line+9);
-        client_locs[c_idx] = loc;
-        printf("Client %d added (Loc %d)\n", c_id, loc);
-        char resp[BUFFER_SIZE];
-        snprintf(resp,sizeof(resp),"RES_CONN(%d)\n", c_id);
-        send(client_sock, resp, strlen(resp), 0);
-        return;
+// Socket de clientes do worker; com vários workers cada um tem o seu e o
+// kernel distribui as conexões
+static int open_client_listener(void){
+    int server_sock = socket(AF_INET6, SOCK_STREAM,0);
+    if(server_sock<0){
+        perror("socket client");
+        exit(EXIT_FAILURE);
+    }
+    int opt=1, no=0;
+    setsockopt(server_sock,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+    setsockopt(server_sock,IPPROTO_IPV6,IPV6_V6ONLY,&no,sizeof(no));
+#ifdef SO_REUSEPORT
+    if(n_workers>1 && setsockopt(server_sock,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof(opt))<0){
+        perror("SO_REUSEPORT");
+        exit(EXIT_FAILURE);
     }
+#endif
 
-    // Se SU
-    if (is_su) {
-        // REQ_USRADD UID is_spec
-        if (strncmp(line,"REQ_USRADD ",11)==0) {
-            char tmp[BUFFER_SIZE];
-            strcpy(tmp, line+11);
-            char* uid     = strtok(tmp," ");
-            char* sIsSpec = strtok(NULL," ");
-            if (!uid || strlen(uid)!=10 || !sIsSpec) {
-                send(client_sock,"ERROR(17)\n",10,0);
-                return;
-            }
-            int isSpec = atoi(sIsSpec);
-            int idx = find_su_user(uid);
-            if (idx>=0) {
-                // update
-                su_users[idx].is_special = isSpec;
-                char r[BUFFER_SIZE];
-                snprintf(r,sizeof(r),"OK(03) %s\n", uid);
-                send(client_sock, r, strlen(r), 0);
-            } else {
-                if (su_count>=MAX_USERS) {
-                    send(client_sock,"ERROR(17)\n",10,0);
-                } else {
-                    strcpy(su_users[su_count].uid, uid);
-                    su_users[su_count].is_special=isSpec;
-                    su_count++;
-                    char r[BUFFER_SIZE];
-                    snprintf(r,sizeof(r),"OK(02) %s\n", uid);
-                    send(client_sock, r, strlen(r), 0);
-                }
-            }
-        }
-        // REQ_USRACCESS UID in/out
-        else if (strncmp(line,"REQ_USRACCESS ",14)==0) {
-            char tmp[BUFFER_SIZE];
-            strcpy(tmp, line+14);
-            char* uid = strtok(tmp," ");
-            char* dir = strtok(NULL," ");
-            if (!uid || strlen(uid)!=10 || !dir) {
-                send(client_sock,"ERROR(18)\n",10,0);
-                return;
-            }
-            int idx = find_su_user(uid);
-            if (idx<0) {
-                send(client_sock,"ERROR(18)\n",10,0);
-                return;
-            }
-            int loc = (strcmp(dir,"in")==0)
-                      ? client_locs[c_idx] : -1;
-
-            if (peer_sockets[0]==-1) {
-                // sem peer
-                char r[BUFFER_SIZE];
-                snprintf(r,sizeof(r),"RES_USRACCESS(-1)\n");
-                send(client_sock, r, strlen(r),0);
-            } else {
-                // Mapeia quem fez a requisição
-                su_uar_add(uid, client_sock);
-                // Manda REQ_LOCREG <UID> <loc>
-                char req[BUFFER_SIZE];
-                snprintf(req,sizeof(req),
-                         "REQ_LOCREG %s %d\n", uid, loc);
-                send(peer_sockets[0], req, strlen(req), 0);
-            }
-        }
-        // REQ_DISC(...)
-        else if (strncmp(line,"REQ_DISC(",9)==0) {
-            close_and_remove_client(client_sock);
-            char r[BUFFER_SIZE];
-            snprintf(r,sizeof(r),"OK(01)\n");
-            send(client_sock,r,strlen(r),0);
-        }
-        else {
-            // Desconhecido
-            send(client_sock,"UNKNOWN_CMD\n",12,0);
-        }
-    }
-    else {
-        // Se SL
-        // REQ_USRLOC <UID>
-        if (strncmp(line,"REQ_USRLOC ",11)==0) {
-            const char* uid=line+11;
-            if (strlen(uid)!=10) {
-                send(client_sock,"ERROR(18)\n",10,0);
-                return;
-            }
-            int idx = find_sl_record(uid);
-            if (idx<0 || sl_records[idx].location==-1) {
-                send(client_sock,"ERROR(18)\n",10,0);
-            } else {
-                char r[BUFFER_SIZE];
-                snprintf(r,sizeof(r),"RES_USRLOC(%d)\n", sl_records[idx].location);
-                send(client_sock,r,strlen(r),0);
-            }
-        }
-        // REQ_LOCLIST <UID> <locId> => "inspect"
-        else if (strncmp(line,"REQ_LOCLIST ",12)==0) {
-            char tmp[BUFFER_SIZE];
-            strcpy(tmp,line+12);
-            char* uid = strtok(tmp," ");
-            char* sLoc= strtok(NULL," ");
-            if (!uid || strlen(uid)!=10 || !sLoc) {
-                send(client_sock,"ERROR(19)\n",10,0);
-                return;
-            }
-            int locId = atoi(sLoc);
+    struct sockaddr_in6 client_addr6;
+    memset(&client_addr6,0,sizeof(client_addr6));
+    client_addr6.sin6_family=AF_INET6;
+    client_addr6.sin6_addr  = in6addr_any;
+    client_addr6.sin6_port  = htons(client_port);
 
-            // Se já há um "inspect" pendente, rejeita
-            if (g_pending_inspect_in_use) {
-                // recusar outro "inspect" simultâneo
-                send(client_sock,"ERROR(19)\n",10,0);
-                return;
-            }
-            g_pending_inspect_in_use=1;
-            strcpy(g_pending_inspect_uid, uid);
-            g_pending_inspect_loc = locId;
-            g_pending_inspect_sock= client_sock;
-
-            if (peer_sockets[0]==-1) {
-                // sem SU => permission denied
-                g_pending_inspect_in_use=0;
-                send(client_sock,"ERROR(19)\n",10,0);
-                return;
-            }
-            // Manda REQ_USRAUTH(UID)
-            char msg[BUFFER_SIZE];
-            snprintf(msg,sizeof(msg),
-                     "REQ_USRAUTH %s\n", uid);
-            send(peer_sockets[0], msg, strlen(msg),0);
-        }
-        // REQ_DISC(...)
-        else if (strncmp(line,"REQ_DISC(",9)==0) {
-            close_and_remove_client(client_sock);
-            char r[BUFFER_SIZE];
-            snprintf(r,sizeof(r),"OK(01)\n");
-            send(client_sock,r,strlen(r),0);
-        }
-        else {
-            send(client_sock,"UNKNOWN_CMD\n",12,0);
+    // um servidor -U que acabou de sair ainda segura a porta até o kernel
+    // desmontar o anel dele (accept multishot pendente): com -U espera um
+    // pouco; sem -U a porta ocupada é erro de configuração e sai na hora
+    int tries = use_uring ? 50 : 1;
+    while(bind(server_sock,(struct sockaddr*)&client_addr6,sizeof(client_addr6))<0){
+        if(errno==EADDRINUSE && --tries>0){
+            usleep(20000);
+            continue;
         }
+        perror("bind client");
+        exit(EXIT_FAILURE);
     }
-}
-
-// ----------------------------------------------------
-// Mensagens de peer
-void handle_peer_message(int peer_sock){
-    char buffer[BUFFER_SIZE];
-    int valread = recv(peer_sock, buffer, sizeof(buffer)-1,0);
-    if(valread<=0){
-        printf("Peer %d disconnected\n", peer_id);
-        close(peer_sock);
-        peer_sockets[0] = -1;
-        peer_count--;
-        printf("No peer found, starting to listen...\n");
-        return;
+    if(listen(server_sock,SOMAXCONN)<0){
+        perror("listen client");
+        exit(EXIT_FAILURE);
     }
-    buffer[valread]='\0';
-
-    char* line = strtok(buffer,"\n");
-    while(line){
-        process_peer_line(peer_sock, line);
-        line = strtok(NULL,"\n");
+    set_nonblocking(server_sock);
+    if(ur_on) ur_accept_arm(server_sock);
+    else if(ev_add(server_sock, 1)<0){
+        perror("ev_add client");
+        exit(EXIT_FAILURE);
     }
+    return server_sock;
 }
 
-void process_peer_line(int peer_sock, const char* line){
-    // printf("[PEER] %s\n", line);
+// Loop de um worker. O worker 0 também cuida do stdin e do peer.
+static void* worker_loop(void* arg){
+    worker_id = (int)(intptr_t)arg;
+    if(worker_id!=0) ev_init();
+    if(use_uring) ur_on = (ur_setup()==0);
+    persist_open();
+    hist_gap();
 
-    // REQ_DISCPEER => peer quer fechar
-    if(strncmp(line,"REQ_DISCPEER",12)==0){
-        send(peer_sock,"OK(01)\n",7,0);
-        close(peer_sock);
-        peer_sockets[0] = -1;
-        peer_count=0;
-        return;
-    }
-    // Se "OK(01)" => peer confirm disc
-    if(strncmp(line,"OK(01)",6)==0){
-        close(peer_sock);
-        peer_sockets[0] = -1;
-        peer_count=0;
-        return;
-    }
-    if(strncmp(line,"ERROR(01)",9)==0){
-        fprintf(stderr,"Peer limit exceeded\n");
-        exit(0);
+    int server_sock = open_client_listener();
+    int wake_fd = -1;
+    if(n_workers>1){
+        wake_fd = shard_q[worker_id].wake[0];
+        if(ev_add(wake_fd, 0)<0){
+            perror("ev_add wake");
+            exit(EXIT_FAILURE);
+        }
     }
+    // stdin fica level-triggered (fgets tem buffer próprio); arquivo comum não entra no epoll
+    int stdin_open = (worker_id==0 && ev_add(STDIN_FILENO, 0)==0);
 
-    if (is_su) {
-        // SU
-        // Ao chegar "REQ_LOCREG <UID> <loc>"
-        if(strncmp(line,"REQ_LOCREG ",10)==0){
-            char tmp[BUFFER_SIZE];
-            strcpy(tmp, line+10);
-            // char uid[11];
-            // int loc=-1;
-        }
-        // Ao chegar "RES_LOCREG <UID> <oldLoc>"
-        else if(strncmp(line,"RES_LOCREG ",10)==0){
-            char tmp[BUFFER_SIZE];
-            strcpy(tmp,line+10);
-            char uid[11];
-            int oldLoc=-1;
-            if(sscanf(tmp,"%10s %d", uid, &oldLoc)==2){
-                int c_sock = su_uar_remove(uid);
-                if(c_sock>0){
-                    char r[BUFFER_SIZE];
-                    snprintf(r,sizeof(r),"RES_USRACCESS(%d)\n", oldLoc);
-                    send(c_sock, r, strlen(r),0);
-                }
-            }
+    // printf("[INFO] Server running. peer_port=%d, client_port=%d\n", peer_port,client_port);
+
+    // Loop principal
+    int ready[MAX_EVENTS];
+    while(1){
+        // acorda a tempo de vencer o pedido pendente mais antigo
+        int64_t now = now_ms();
+        int timeout = pending_next_timeout(is_su ? &su_uar : is_replica ? &repl_waits : &sl_inspects, now);
+        if(worker_id==0 && peer_retry_at){
+            int t = peer_retry_at>now ? (int)(peer_retry_at-now) : 0;
+            if(timeout<0 || t<timeout) timeout = t;
         }
-        // Ao chegar "REQ_USRAUTH <UID>"
-        else if(strncmp(line,"REQ_USRAUTH ",11)==0){
-            char uid[11];
-            if(sscanf(line+11,"%10s", uid)==1){
-                int idx = find_su_user(uid);
-                int spec = 0;
-                if(idx>=0) {
-                    spec = su_users[idx].is_special; 
-                } 
-                // "RES_USRAUTH(x)"
-                // x=1 se tem perm especial, x=0 senão
-                char resp[BUFFER_SIZE];
-                snprintf(resp,sizeof(resp),"RES_USRAUTH(%d)\n", spec);
-                send(peer_sockets[0], resp, strlen(resp),0);
-            }
+        if(worker_id==0 && stats_at){
+            int t = stats_at>now ? (int)(stats_at-now) : 0;
+            if(timeout<0 || t<timeout) timeout = t;
         }
-    }
-    else {
-        // SL
-        // Ao chegar "REQ_LOCREG <UID> <loc>" => mas esse vem do SU p/ SL
-        if(strncmp(line,"REQ_LOCREG ",10)==0){
-            char tmp[BUFFER_SIZE];
-            strcpy(tmp, line+10);
-            char uid[11];
-            int loc=-1;
-            if(sscanf(tmp,"%10s %d", uid, &loc)==2){
-                int idx = find_sl_record(uid);
-                if(idx<0){
-                    // Novo
-                    if(sl_count>=MAX_USERS){
-                        char msg[BUFFER_SIZE];
-                        snprintf(msg,sizeof(msg),
-                                 "RES_LOCREG %s -1\n", uid);
-                        send(peer_sockets[0], msg, strlen(msg),0);
+        // arquivo de REQ_USRIMPORT pela metade: só olha o que já chegou
+        if(import_nfiles) timeout = 0;
+        int n = ur_on ? ur_wait(ready, MAX_EVENTS, timeout) : ev_wait(ready, MAX_EVENTS, timeout);
+        if(n<0){
+            if(errno!=EINTR) perror("ev_wait");
+            continue;
+        }
+        now = now_ms();
+        pending_expire(&su_uar, now, su_uar_fail);
+        pending_expire(&sl_inspects, now, sl_inspect_fail);
+        pending_expire(&repl_waits, now, repl_wait_fail);
+        if(worker_id==0 && peer_retry_at && now>=peer_retry_at) peer_retry();
+        if(worker_id==0 && stats_at && now>=stats_at){
+            stats_at += (int64_t)stats_every*1000;
+            if(stats_at<=now) stats_at = now + (int64_t)stats_every*1000;
+            stats_gather_start(NULL, STATS_PERIODIC);
+        }
+        for(int i=0;i<n;i++){
+            int fd = ready[i];
+            // Teclado
+            if(fd==STDIN_FILENO && stdin_open){
+                char buf[BUFFER_SIZE];
+                if(!fgets(buf,sizeof(buf),stdin)){
+                    // EOF: para de monitorar o stdin
+                    ev_del(STDIN_FILENO);
+                    stdin_open=0;
+                    continue;
+                }
+                if(strncmp(buf,"kill",4)==0){
+                    send_req_discpeer_and_exit();
+                }
+                else if(strncmp(buf,"stats",5)==0){
+                    stats_gather_start(NULL, STATS_STDIN);
+                }
+                // "log [error|info|trace[:N]]": muda ou mostra o nível
+                else if(strncmp(buf,"log",3)==0){
+                    char* arg = buf+3;
+                    while(*arg==' ') arg++;
+                    if(*arg && *arg!='\n' && log_set(arg)<0){
+                        log_msg(LOG_OUT, "Usage: log error|info|trace[:N]\n");
                     } else {
-                        strcpy(sl_records[sl_count].uid, uid);
-                        sl_records[sl_count].location=loc;
-                        sl_count++;
-                        char msg[BUFFER_SIZE];
-                        snprintf(msg,sizeof(msg),
-                                 "RES_LOCREG %s -1\n", uid);
-                        send(peer_sockets[0], msg, strlen(msg),0);
+                        log_msg(LOG_OUT, "Log level %s, trace 1 in %d commands\n",
+                                          log_names[atomic_load(&log_level)], atomic_load(&log_sample));
                     }
-                } else {
-                    int oldLoc = sl_records[idx].location;
-                    sl_records[idx].location = loc;
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg,sizeof(msg),
-                             "RES_LOCREG %s %d\n", uid, oldLoc);
-                    send(peer_sockets[0], msg, strlen(msg),0);
                 }
             }
-        }
-        // Ao chegar "RES_USRAUTH(x)" => sem UID
-        else if(strncmp(line,"RES_USRAUTH(",12)==0){
-            // parse "RES_USRAUTH(1)" ou "RES_USRAUTH(0)"
-            int x=-1;
-            if(sscanf(line,"RES_USRAUTH(%d)", &x)==1){
-                if(!g_pending_inspect_in_use){
-                    // Nao havia "inspect" pendente => ignore
-                    return;
-                }
-                // Tem pending
-                g_pending_inspect_in_use=0;
-                int c_sock = g_pending_inspect_sock;
-                int locId  = g_pending_inspect_loc;
-                if(x==0){
-                    // permission denied
-                    send(c_sock,"ERROR(19)\n",10,0);
-                } else {
-                    // Montar a lista de quem esta em locId
-                    char list[BUFFER_SIZE];
-                    list[0]='\0';
-                    int found=0;
-                    for(int i=0;i<sl_count;i++){
-                        if(sl_records[i].location==locId){
-                            if(found) strcat(list,", ");
-                            strcat(list, sl_records[i].uid);
-                            found=1;
-                        }
-                    }
-                    if(!found){
-                        strcpy(list,"EMPTY");
-                    }
-                    char resp[BUFFER_SIZE];
-                    snprintf(resp,sizeof(resp),
-                             "RES_LOCLIST %s\n", list);
-                    send(c_sock, resp, strlen(resp),0);
+            // outros workers
+            else if(fd==wake_fd){
+                shard_drain();
+            }
+            // peer novo
+            else if(worker_id==0 && fd==peer_listen_sock && peer_listening){
+                accept_peers();
+            }
+            // réplica nova (primário) ou mudanças do primário (réplica)
+            else if(worker_id==0 && repl_listen_sock!=-1 && fd==repl_listen_sock){
+                accept_replicas();
+            }
+            else if(worker_id==0 && repl_up.sock!=-1 && fd==repl_up.sock){
+                repl_recv();
+            }
+            else if(worker_id==0 && repl_count && repl_of_sock(fd)){
+                repl_io(repl_of_sock(fd));
+            }
+            // client novo
+            else if(fd==server_sock){
+                accept_clients(server_sock);
+            }
+            // peer msgs (ou o socket voltou a aceitar escrita)
+            else if(worker_id==0 && peer_of_sock(fd)>=0){
+                int p = peer_of_sock(fd);
+                if(peers[p].want_write){
+                    wal_commit();
+                    peer_flush_one(p);
                 }
+                handle_peer_message(p);
+            }
+            // client msgs (ou o socket voltou a aceitar escrita)
+            else if(get_client_index_by_socket(fd)>=0){
+                if(clients[fd].want_write && client_flush(fd)<0) continue;
+                handle_client_message(fd);
             }
         }
+        if(import_nfiles) import_step();
+        // um fsync para as mudanças da iteração, antes de qualquer resposta
+        wal_commit();
+        // tudo que a iteração gerou sai num único send() por conexão;
+        // um cliente que volta a ser lido pode gerar mais saída (entra no fim da lista)
+        for(int i=0;i<dirty_count;i++){
+            int fd = dirty_fds[i];
+            if(get_client_index_by_socket(fd)<0 || !clients[fd].dirty) continue;
+            if(client_flush(fd)==1) handle_client_message(fd);
+        }
+        dirty_count = 0;
+        if(worker_id==0){
+            peer_flush();
+            repl_flush();
+        }
     }
+    return NULL;
 }
 
-// ----------------------------------------------------
 int main(int argc,char* argv[]){
-    if(argc!=3){
-        fprintf(stderr,"USAGE: %s <PeerPort=40000> <ClientPort=50000|60000>\n",argv[0]);
+    int c;
+    while((c=getopt(argc,argv,"m:t:bf:n:d:s:L:R:rS:v:o:H:UI:"))!=-1){
+        switch(c){
+        case 'm':
+            max_clients = atoi(optarg);
+            if(max_clients<1) usage(argv[0]);
+            break;
+        case 't':
+            peer_timeout_ms = atoi(optarg);
+            if(peer_timeout_ms<1) usage(argv[0]);
+            break;
+        case 'b':
+            peer_bin_wanted = 1;
+            break;
+        case 'f':
+            if(atoi(optarg)<0) usage(argv[0]);
+            peer_flush_bytes = atoi(optarg);
+            break;
+        case 'n':
+            n_workers = atoi(optarg);
+            if(n_workers<1 || n_workers>MAX_WORKERS) usage(argv[0]);
+            break;
+        case 'd':
+            data_dir = optarg;
+            break;
+        case 'I':
+            import_dir = optarg;
+            break;
+        case 's':
+            snap_every = atol(optarg);
+            if(snap_every<1) usage(argv[0]);
+            break;
+        case 'L':
+            if(sscanf(optarg,"%d-%d",&loc_lo,&loc_hi)!=2 || loc_lo<1 || loc_lo>loc_hi || loc_hi>MAX_LOC)
+                usage(argv[0]);
+            loc_range_set = 1;
+            break;
+        case 'R':
+            repl_port = atoi(optarg);
+            if(repl_port<1) usage(argv[0]);
+            break;
+        case 'r':
+            is_replica = 1;
+            break;
+        case 'S':
+            stats_every = atoi(optarg);
+            if(stats_every<1) usage(argv[0]);
+            break;
+        case 'v':
+            if(log_set(optarg)<0) usage(argv[0]);
+            break;
+        case 'H': {
+            long mb, secs = 0;
+            int k = sscanf(optarg,"%ld:%ld",&mb,&secs);
+            if(k<1 || mb<0 || secs<0) usage(argv[0]);
+            hist_budget  = (size_t)mb<<20;
+            hist_max_age = (int64_t)secs*1000;
+            break;
+        }
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'o':
+            log_fd = open(optarg, O_WRONLY|O_CREAT|O_APPEND, 0644);
+            if(log_fd<0){
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(argc-optind!=2){
+        usage(argv[0]);
+    }
+#ifndef SO_REUSEPORT
+    if(n_workers>1){
+        fprintf(stderr,"-n requer SO_REUSEPORT\n");
         exit(EXIT_FAILURE);
     }
-    int peer_port   = atoi(argv[1]);
-    int client_port = atoi(argv[2]);
+#endif
+    peer_port   = atoi(argv[optind]);
+    client_port = atoi(argv[optind+1]);
+    log_start();
+    kw_init();
 
     if(client_port==50000){
         is_su=1;
         // printf("[MODE] Running as SU (Usuarios)\n");
-        next_client_id = su_next_client_id;
+        atomic_store(&next_client_id, su_next_client_id);
         next_peer_id   = su_next_peer_id;
     }
     else if(client_port==60000){
         is_su=0;
         // printf("[MODE] Running as SL (Localizacao)\n");
-        next_client_id = sl_next_client_id;
+        atomic_store(&next_client_id, sl_next_client_id);
         next_peer_id   = sl_next_peer_id;
     // } else {
     //     fprintf(stderr,"Invalid port (use 50000=SU ou 60000=SL)\n");
@@ -546,201 +5583,92 @@ int main(int argc,char* argv[]){
 
     // Zera arrays
     for(int i=0;i<MAX_PEERS;i++){
-        peer_sockets[i]=-1;
-    }
-    for(int i=0;i<MAX_CLIENTS;i++){
-        client_sockets[i]=0;
-        client_ids[i]=0;
-        client_locs[i]=0;
+        peers[i].sock=-1;
     }
     // Zeramos base SU/SL
     su_count=0; 
     sl_count=0;
-    // Se for SL, zera "global pending"
-    g_pending_inspect_in_use=0;
-    g_pending_inspect_loc= -1;
-    g_pending_inspect_sock=0;
-
-    // 1) peer socket
-    int peer_listen_sock = socket(AF_INET6, SOCK_STREAM,0);
-    if(peer_listen_sock<0){
-        perror("socket peer");
-        exit(EXIT_FAILURE);
+    if(is_su) loc_range_set=0;
+    repl_up.sock=-1;
+    for(int i=0;i<MAX_REPLICAS;i++){
+        replicas[i].sock=-1;
     }
-    int opt=1, no=0;
-    setsockopt(peer_listen_sock,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
-    setsockopt(peer_listen_sock,IPPROTO_IPV6,IPV6_V6ONLY,&no,sizeof(no));
+    if(is_replica){
+        // a réplica recebe tudo do primário, com uma thread só
+        if(is_su || n_workers>1 || repl_port || loc_range_set) usage(argv[0]);
+        data_dir=NULL;
+    }
+    else if(!is_su){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        repl_seq = ((uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000) << 16;
+    }
+
+    if(data_dir && n_workers>1) pthread_barrier_init(&persist_barrier, NULL, n_workers);
+    // filas entre workers prontas antes de qualquer thread postar
+    for(int w=0;w<n_workers && n_workers>1;w++){
+        if(q_init(&shard_q[w])<0){
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ev_init();
 
-    struct sockaddr_in6 peer_addr6;
-    memset(&peer_addr6,0,sizeof(peer_addr6));
-    peer_addr6.sin6_family=AF_INET6;
-    peer_addr6.sin6_addr   = in6addr_any;
-    peer_addr6.sin6_port   = htons(peer_port);
+    // réplicas de leitura
+    if(repl_port && !is_su){
+        repl_listen_sock = socket(AF_INET6, SOCK_STREAM,0);
+        int opt=1, no=0;
+        setsockopt(repl_listen_sock,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+        setsockopt(repl_listen_sock,IPPROTO_IPV6,IPV6_V6ONLY,&no,sizeof(no));
+        struct sockaddr_in6 addr6;
+        memset(&addr6,0,sizeof(addr6));
+        addr6.sin6_family=AF_INET6;
+        addr6.sin6_addr  = in6addr_any;
+        addr6.sin6_port  = htons(repl_port);
+        if(bind(repl_listen_sock,(struct sockaddr*)&addr6,sizeof(addr6))<0
+           || listen(repl_listen_sock,MAX_REPLICAS)<0){
+            perror("listen replica");
+            exit(EXIT_FAILURE);
+        }
+        set_nonblocking(repl_listen_sock);
+        if(ev_add(repl_listen_sock, 1)<0){
+            perror("ev_add replica");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if(bind(peer_listen_sock,(struct sockaddr*)&peer_addr6,sizeof(peer_addr6))<0){
+    // 1) peer socket. SL com -L sempre conecta ao SU (que aceita vários SLs);
+    // a réplica conecta ao primário e não fala com o SU.
+    if(loc_range_set || is_replica){
+        peer_retry();
+        if(peer_retry_at) log_msg(LOG_INFO, "No peer found, retrying...\n");
+    }
+    else if(peer_listen_start()<0){
         if(errno==EADDRINUSE){
             // printf("Peer port in use => connecting as client...\n");
-            int connect_sock = socket(AF_INET6, SOCK_STREAM,0);
-            if(connect_sock<0){
-                perror("[ERRO] socket connect");
-                exit(EXIT_FAILURE);
-            }
-            struct sockaddr_in6 tmp;
-            memset(&tmp,0,sizeof(tmp));
-            tmp.sin6_family=AF_INET6;
-            inet_pton(AF_INET6,"::1",&tmp.sin6_addr);
-            tmp.sin6_port=htons(peer_port);
-
-            if(connect(connect_sock,(struct sockaddr*)&tmp,sizeof(tmp))<0){
+            if(peer_connect()<0){
                 perror("[ERRO] connect peer");
-                close(connect_sock);
                 exit(EXIT_FAILURE);
             }
-            peer_sockets[0] = connect_sock;
-            peer_count=1;
-            send(connect_sock,"REQ_CONNPEER()\n",15,0);
         } else {
             perror("bind peer");
             exit(EXIT_FAILURE);
         }
     } else {
-        printf("No peer found, starting to listen...\n");
-        if(listen(peer_listen_sock,1)<0){
-            perror("listen peer");
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    // 2) client socket
-    int server_sock = socket(AF_INET6, SOCK_STREAM,0);
-    if(server_sock<0){
-        perror("socket client");
-        exit(EXIT_FAILURE);
-    }
-    setsockopt(server_sock,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
-    setsockopt(server_sock,IPPROTO_IPV6,IPV6_V6ONLY,&no,sizeof(no));
-
-    struct sockaddr_in6 client_addr6;
-    memset(&client_addr6,0,sizeof(client_addr6));
-    client_addr6.sin6_family=AF_INET6;
-    client_addr6.sin6_addr  = in6addr_any;
-    client_addr6.sin6_port  = htons(client_port);
-
-    if(bind(server_sock,(struct sockaddr*)&client_addr6,sizeof(client_addr6))<0){
-        perror("bind client");
-        exit(EXIT_FAILURE);
-    }
-    if(listen(server_sock,MAX_CLIENTS)<0){
-        perror("listen client");
-        exit(EXIT_FAILURE);
+        log_msg(LOG_INFO, "No peer found, starting to listen...\n");
     }
 
-    // printf("[INFO] Server running. peer_port=%d, client_port=%d\n", peer_port,client_port);
-
-    // Loop principal
-    while(1){
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO,&readfds);
-        FD_SET(peer_listen_sock,&readfds);
-        FD_SET(server_sock,&readfds);
-
-        int max_sd = (peer_listen_sock>server_sock?peer_listen_sock:server_sock);
-
-        for(int i=0;i<MAX_PEERS;i++){
-            if(peer_sockets[i]!=-1){
-                FD_SET(peer_sockets[i],&readfds);
-                if(peer_sockets[i]>max_sd) max_sd=peer_sockets[i];
-            }
-        }
-        for(int i=0;i<MAX_CLIENTS;i++){
-            if(client_sockets[i]>0){
-                FD_SET(client_sockets[i],&readfds);
-                if(client_sockets[i]>max_sd) max_sd=client_sockets[i];
-            }
-        }
-
-        int activity = select(max_sd+1,&readfds,NULL,NULL,NULL);
-        if(activity<0 && errno!=EINTR){
-            perror("select");
-            continue;
-        }
-
-        // Teclado
-        if(FD_ISSET(STDIN_FILENO,&readfds)){
-            char buf[BUFFER_SIZE];
-            if(!fgets(buf,sizeof(buf),stdin)) continue;
-            if(strncmp(buf,"kill",4)==0){
-                send_req_discpeer_and_exit();
-            }
-        }
-        // peer novo
-        if(FD_ISSET(peer_listen_sock,&readfds)){
-            int newp = accept(peer_listen_sock,NULL,NULL);
-            if(newp<0){
-                perror("accept peer");
-            } else {
-                if(peer_count>=MAX_PEERS){
-                    send(newp,"ERROR(01)\n",10,0);
-                    printf("Peer limit exceeded\n");
-                    close(newp);
-                } else {
-                    if(peer_sockets[0]!=-1){
-                        send(newp,"ERROR(01)\n",10,0);
-                        printf("Peer limit exceeded\n");
-                        close(newp);
-                    } else {
-                        peer_sockets[0]=newp;
-                        peer_count++;
-                        peer_id = next_peer_id;
-                        printf("Peer %d connected\n", next_peer_id);
-                        char resp[BUFFER_SIZE];
-                        snprintf(resp,sizeof(resp),"RES_CONNPEER(%d)\n", next_peer_id);
-                        send(newp, resp, strlen(resp),0);
-                        if(is_su) su_next_peer_id=++next_peer_id; 
-                        else      sl_next_peer_id=++next_peer_id;
-                    }
-                }
-            }
-        }
-        // client novo
-        if(FD_ISSET(server_sock,&readfds)){
-            int newc = accept(server_sock,NULL,NULL);
-            if(newc<0){
-                perror("accept client");
-            } else {
-                int assigned=0;
-                for(int i=0;i<MAX_CLIENTS;i++){
-                    if(client_sockets[i]==0){
-                        client_sockets[i]=newc;
-                        client_ids[i]= next_client_id++;
-                        if(is_su) su_next_client_id= next_client_id;
-                        else      sl_next_client_id= next_client_id;
-                        printf("Client %d connected\n",client_ids[i]);
-                        if(is_su) printf("SU New ID: %d\n", client_ids[i]);
-                        else      printf("SL New ID: %d\n", client_ids[i]);
-                        assigned=1;
-                        break;
-                    }
-                }
-                if(!assigned){
-                    send(newc,"ERROR(09)\n",10,0);
-                    close(newc);
-                }
-            }
-        }
-        // peer msgs
-        for(int i=0;i<MAX_PEERS;i++){
-            if(peer_sockets[i]!=-1 && FD_ISSET(peer_sockets[i],&readfds)){
-                handle_peer_message(peer_sockets[i]);
-            }
-        }
-        // client msgs
-        for(int i=0;i<MAX_CLIENTS;i++){
-            if(client_sockets[i]>0 && FD_ISSET(client_sockets[i],&readfds)){
-                handle_client_message(client_sockets[i]);
-            }
+    // 2) workers; a thread principal é o worker 0
+    for(int w=1;w<n_workers;w++){
+        pthread_t th;
+        if(pthread_create(&th, NULL, worker_loop, (void*)(intptr_t)w)!=0){
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(th);
     }
+    if(stats_every) stats_at = now_ms() + (int64_t)stats_every*1000;
+    worker_loop((void*)0);
     return 0;
 }
+#endif